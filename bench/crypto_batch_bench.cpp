@@ -0,0 +1,78 @@
+// Per-message cost of sealing and opening many small envelopes (48-byte key||IV blobs,
+// as written by share fan-out) one aes_encrypt_blob/aes_decrypt_blob call at a time
+// versus through aes_gcm_encrypt_batch/aes_gcm_decrypt_batch.
+//
+// Build from the repository root:
+//   g++ -std=c++17 -O2 -I include bench/crypto_batch_bench.cpp src/crypto_utils.cpp -o crypto_batch_bench -lssl -lcrypto
+// Usage: crypto_batch_bench [messages-per-batch] [rounds]
+
+#include "crypto_utils.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static double nsPerMessage(chrono::steady_clock::time_point start, size_t messages) {
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / messages;
+}
+
+int main(int argc, char *argv[]) {
+    size_t batch = argc > 1 ? strtoul(argv[1], nullptr, 10) : 256;
+    size_t rounds = argc > 2 ? strtoul(argv[2], nullptr, 10) : 2000;
+    if (batch == 0 || rounds == 0) {
+        cerr << "Usage: " << argv[0] << " [messages-per-batch] [rounds]" << endl;
+        return 1;
+    }
+
+    unsigned char key[AES_KEYLEN], iv[AES_IVLEN];
+    if (!generate_aes_key_iv(key, iv)) {
+        cerr << "Failed to generate key" << endl;
+        return 1;
+    }
+    string keyIV(AES_KEYLEN + AES_IVLEN, 'k');
+    vector<string_view> plaintexts(batch, string_view(keyIV));
+    size_t messages = batch * rounds;
+
+    vector<string> blobs(batch);
+    string plaintext;
+    auto start = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < batch; i++)
+            blobs[i] = aes_encrypt_blob(plaintexts[i], key);
+    double singleSeal = nsPerMessage(start, messages);
+
+    start = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < batch; i++)
+            aes_decrypt_blob(blobs[i], key, plaintext);
+    double singleOpen = nsPerMessage(start, messages);
+
+    start = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        aes_gcm_encrypt_batch(plaintexts, key, nullptr, blobs);
+    double batchSeal = nsPerMessage(start, messages);
+
+    vector<string_view> views(blobs.begin(), blobs.end());
+    vector<string> opened;
+    vector<bool> ok;
+    start = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        if (aes_gcm_decrypt_batch(views, key, opened, ok) != batch) {
+            cerr << "Batch decryption failed" << endl;
+            return 1;
+        }
+    }
+    double batchOpen = nsPerMessage(start, messages);
+
+    cout << batch << " x " << plaintexts[0].size() << "-byte messages, " << rounds << " rounds" << endl;
+    cout << "seal:  single " << singleSeal << " ns/msg, batch " << batchSeal << " ns/msg ("
+         << singleSeal / batchSeal << "x)" << endl;
+    cout << "open:  single " << singleOpen << " ns/msg, batch " << batchOpen << " ns/msg ("
+         << singleOpen / batchOpen << "x)" << endl;
+    return 0;
+}
@@ -2,6 +2,10 @@
 #define CRYPTO_UTILS_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
 
 #include <openssl/rsa.h>
 #include <openssl/sha.h>
@@ -13,13 +17,71 @@ const int AES_KEYLEN = 32; // 256-bit key
 const int AES_IVLEN  = 16; // 128-bit IV
 
 // AES encryption/decryption
-string aes_encrypt(const string &plaintext, const unsigned char *key, const unsigned char *iv);
-string aes_decrypt(const string &ciphertext, const unsigned char *key, const unsigned char *iv);
+// aes_encrypt() output is "GCM" | ciphertext | 16-byte tag.
+const size_t AES_GCM_PREFIXLEN = 3;
+const size_t AES_GCM_OVERHEAD  = AES_GCM_PREFIXLEN + 16;
+
+string aes_encrypt(string_view plaintext, const unsigned char *key, const unsigned char *iv);
+string aes_decrypt(string_view ciphertext, const unsigned char *key, const unsigned char *iv);
 bool generate_aes_key_iv(unsigned char *key, unsigned char *iv);
 
+// Buffer-based forms of the above; they never allocate.
+// aes_encrypt_into writes plaintext.size() + AES_GCM_OVERHEAD bytes to 'out'.
+// aes_decrypt_into writes ciphertext.size() - AES_GCM_OVERHEAD bytes to 'out' and returns
+// that count; 'out' may be ciphertext.data() + AES_GCM_PREFIXLEN to decrypt in place.
+size_t aes_encrypt_into(string_view plaintext, const unsigned char *key, const unsigned char *iv,
+                        unsigned char *out);
+size_t aes_decrypt_into(string_view ciphertext, const unsigned char *key, const unsigned char *iv,
+                        unsigned char *out);
+
+// IV-prefixed blobs, [16-byte IV][aes_encrypt() output], as used by the metadata files,
+// shared envelopes and encrypted names. aes_encrypt_blob draws a random IV unless one
+// is given; aes_decrypt_blob resizes 'out' (reusing its capacity) and decrypts into it.
+string aes_encrypt_blob(string_view plaintext, const unsigned char *key, const unsigned char *iv = nullptr);
+void aes_decrypt_blob(string_view blob, const unsigned char *key, string &out);
+
+// Batch forms of the blob helpers for many small independent messages under one key
+// (share envelopes, names). Blob i is written to blobs[i], reusing its capacity; with
+// no 'ivs' (AES_IVLEN bytes per message) the IVs of the whole batch come from one
+// RAND_bytes call. decrypt_batch does not stop at a bad blob: ok[i] tells whether
+// blob i authenticated (plaintexts[i] is left empty if not), and the number of good
+// blobs is returned.
+void aes_gcm_encrypt_batch(const vector<string_view> &plaintexts, const unsigned char *key,
+                           const unsigned char *ivs, vector<string> &blobs);
+size_t aes_gcm_decrypt_batch(const vector<string_view> &blobs, const unsigned char *key,
+                             vector<string> &plaintexts, vector<bool> &ok);
+
+// Segmented AES-GCM (used by the streaming file format in encrypted_fs).
+// Each segment is sealed independently under a nonce derived from the file IV,
+// the segment index and a "last segment" flag, so segments cannot be reordered,
+// dropped or truncated without failing authentication.
+const int GCM_TAGLEN   = 16; // 128-bit tag
+const int GCM_NONCELEN = 12; // 96-bit nonce
+
+void aes_gcm_segment_nonce(const unsigned char *iv, uint32_t index, bool last, unsigned char *nonce);
+void aes_gcm_seal(const unsigned char *key, const unsigned char *nonce,
+                  const unsigned char *aad, size_t aadLen,
+                  const unsigned char *in, size_t inLen,
+                  unsigned char *out, unsigned char *tag);
+void aes_gcm_open(const unsigned char *key, const unsigned char *nonce,
+                  const unsigned char *aad, size_t aadLen,
+                  const unsigned char *in, size_t inLen,
+                  const unsigned char *tag, unsigned char *out);
+
+// Deterministic authenticated encryption (SIV construction) for short strings such as
+// file names. The 16-byte synthetic IV is HMAC-SHA256(macKey, plaintext) truncated; it
+// is the AES-256-CTR counter block and the authenticator. Output is SIV | ciphertext.
+// Equal plaintexts under the same keys give equal outputs, and nothing else leaks.
+const size_t SIV_LEN = 16;
+
+string aes_siv_encrypt(string_view plaintext, const unsigned char *macKey, const unsigned char *encKey);
+// Returns false (leaving 'out' empty) if 'ciphertext' is malformed or fails authentication.
+bool aes_siv_decrypt(string_view ciphertext, const unsigned char *macKey, const unsigned char *encKey,
+                     string &out);
+
 // RSA functions
-string rsa_encrypt(RSA *rsa, const string &data);
-string rsa_decrypt(RSA *rsa, const string &data);
+string rsa_encrypt(RSA *rsa, string_view data);
+string rsa_decrypt(RSA *rsa, string_view data);
 RSA* load_public_key(const string &path);
 RSA* load_private_key(const string &path, const string &passphrase);
 bool generate_rsa_keypair(const string &privateKeyPath, const string &publicKeyPath, const string &passphrase);
@@ -27,12 +89,10 @@ bool generate_rsa_keypair(const string &privateKeyPath, const string &publicKeyP
 // Utility functions
 string generateRandomPassphrase();
 bool authenticateUser(const string &username,
-                      const string &publicKeyPath,
-                      const string &privateKeyPath,
-                      const string &passphrase);
+                      RSA *publicKey,
+                      RSA *privateKey);
 string deriveKeyFromPassword(const string &password);
-bool verifyKeyPair(const string &publicKeyPath,
-                   const string &privateKeyPath,
-                   const string &passphrase);
+bool verifyKeyPair(RSA *publicKey,
+                   RSA *privateKey);
 
 #endif // CRYPTO_UTILS_H
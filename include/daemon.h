@@ -0,0 +1,21 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+
+using namespace std;
+
+// Serves many users from one process over the Unix-domain socket 'socketPath'.
+// A client sends three lines to log in (username, passphrase, public key file name,
+// resolved in public_keys/ like the command-line argument) and is answered with
+//   %login status=ok user=<name>   or   %login status=error
+// after which every line is a shell command, answered with its output and its
+// %result line exactly as in batch mode. "exit" or closing the socket ends a session.
+// One thread polls all connections; logins and commands run on a fixed worker pool,
+// at most one command per session at a time, and sessions share the process-wide
+// caches (login public keys, envelope stores, share mapping shards).
+// The socket is created owner-only since passphrases travel over it. Runs until
+// SIGINT or SIGTERM; returns false if the socket can't be set up.
+bool runDaemon(const string &socketPath, size_t workers = 0);
+
+#endif // DAEMON_H
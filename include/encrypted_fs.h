@@ -2,35 +2,69 @@
 #define ENCRYPTED_FS_H
 
 #include <string>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+#include "session.h"
 
 using namespace std;
 
+// Streaming callbacks for the segmented file format.
+// A ChunkSource fills at most 'cap' bytes of 'buf' and returns the number of bytes
+// produced, 0 at end of input, or -1 on error.
+// A ChunkSink consumes one block of decrypted output and returns false to abort.
+typedef function<long(char *buf, size_t cap)> ChunkSource;
+typedef function<bool(const char *data, size_t len)> ChunkSink;
+
+// Plaintext bytes per authenticated segment of an encrypted file.
+const size_t ENC_SEGMENT_SIZE = 64 * 1024;
 
 // Encrypts and writes the file content to 'path'.
 // - 'plaintext': the clear text content of the file.
-// - 'ownerUsername': the name of the file's owner.
-// - 'ownerDerivedKey': the key derived from the owner's passphrase (used to encrypt metadata).
-// - 'globalSharingKey': the global key used for sharing (used to update admin access).
+// - 'owner': the session of the file's owner; its public key wraps the file envelope,
+//   its derived key encrypts metadata and its global sharing key updates admin access.
 // Returns true on success, false otherwise.
 bool encryptedWriteFile(const string &path,
                           const string &plaintext,
-                          const string &ownerUsername,
-                          const string &ownerDerivedKey,
-                          const string &globalSharingKey);
+                          const UserSession &owner);
+
+// Streaming variant of encryptedWriteFile: the plaintext is pulled from 'source'
+// one segment at a time, so memory use does not depend on the file size.
+// 'sizeHint', when known, is the plaintext size; the file's space is preallocated.
+bool encryptedWriteStream(const string &path,
+                          const ChunkSource &source,
+                          const UserSession &owner,
+                          uint64_t sizeHint = 0);
 
 // Reads and decrypts a file from 'path'.
 // - 'plaintext': will contain the decrypted file content upon success.
-// - 'username': the name of the user reading the file.
-// - 'passphrase': the user's passphrase, used to unlock their private key.
-// - 'derivedKey': the key derived from the user's passphrase (used for metadata decryption).
-// - 'globalKey': the global sharing key (used if the file was shared).
+// - 'reader': the session of the user reading the file; its unlocked private key opens
+//   owned envelopes and its global sharing key opens shared ones.
 // Returns true on success, false otherwise.
 bool encryptedReadFile(const string &path,
                          string &plaintext,
-                         const string &username,
-                         const string &passphrase,
-                         const string &derivedKey,
-                         const string &globalKey);
+                         const UserSession &reader);
+
+// Streaming variant of encryptedReadFile: every segment is authenticated before it
+// is handed to 'sink'. If a later segment fails, the sink has already received the
+// verified prefix and the function returns false.
+bool encryptedReadStream(const string &path,
+                         const ChunkSink &sink,
+                         const UserSession &reader);
+
+// Reads and decrypts only the plaintext bytes [offset, offset + length) of 'path'.
+// The range is clamped to the end of the file. Only the ciphertext segments that
+// overlap the range are read and authenticated, so the cost follows 'length'.
+bool encryptedReadRange(const string &path,
+                        uint64_t offset,
+                        uint64_t length,
+                        const ChunkSink &sink,
+                        const UserSession &reader);
+
+// Recovers the clear key/IV of 'path' for the session user from their own envelope or,
+// for a file shared with them, from their shared envelope. Used when re-sharing.
+bool recoverFileKey(const string &path, const UserSession &session, string &keyIV);
 
 // Unused: Reads and decrypts a global metadata file (like global_sharing.key or a shared_envelopes.enc file)
 // using the global sharing key. Returns true on success.
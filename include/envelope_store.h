@@ -0,0 +1,88 @@
+#ifndef ENVELOPE_STORE_H
+#define ENVELOPE_STORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "user_metadata.h"
+#include "fs_utils.h"
+
+using namespace std;
+
+// Loads or saves one encrypted envelope metadata file (e.g. loadUserMetadata / saveUserMetadata).
+typedef bool (*MetadataLoadFn)(const string &username, const string &key, vector<EnvelopeEntry> &entries);
+typedef bool (*MetadataSaveFn)(const string &username, const string &key, const vector<EnvelopeEntry> &entries);
+// Optional append-only journal next to the metadata file (e.g. appendUserMetadataJournal).
+typedef bool (*MetadataAppendFn)(const string &username, const string &key, const vector<EnvelopeUpdate> &updates);
+typedef bool (*MetadataCompactCheckFn)(const string &username);
+
+// In-memory, hash-indexed copy of one user's envelope metadata file.
+// The file is decrypted once, lookups are O(1), and updates are buffered as dirty
+// entries until flush() writes them back in one batch. A stat() check before each
+// use reloads the table if another session rewrote the file, re-applying any
+// entries that are still dirty.
+// Stores with a journal flush by appending records instead of rewriting the file;
+// once the journal outgrows the snapshot, the next flush compacts it with a full save.
+// Loads hold a shared and flushes an exclusive MetadataLock on the metadata file, so
+// sessions in other processes never interleave a reload and a write-back.
+class EnvelopeStore {
+public:
+    EnvelopeStore(const string &username, const string &metaPath,
+                  MetadataLoadFn load, MetadataSaveFn save,
+                  const string &journalPath = "",
+                  MetadataAppendFn append = nullptr,
+                  MetadataCompactCheckFn needsCompaction = nullptr);
+
+    // Looks up 'filePath'. Returns false if it is missing or the file can't be loaded.
+    bool find(const string &key, const string &filePath, string &envelope);
+    // Inserts or replaces the envelope for 'filePath'; written back by flush().
+    bool upsert(const string &key, const string &filePath, const string &envelope);
+    // Applies several updates under one lock and a single load; written back by flush().
+    bool applyBatch(const string &key, const vector<EnvelopeUpdate> &updates);
+    // Drops the envelope for 'filePath'; written back (as a tombstone) by flush().
+    bool remove(const string &key, const string &filePath);
+    // Writes dirty entries back to disk. A no-op when nothing changed.
+    bool flush();
+    bool dirty();
+    const string &metadataPath() const { return metaPath_; }
+
+private:
+    bool ensureLoaded(const string &key);
+    bool unchangedOnDisk();
+    void restamp();
+    void written(bool journal);
+    void apply(const EnvelopeUpdate &update);
+
+    mutex lock_;
+    string username_;
+    string metaPath_;
+    MetadataLoadFn load_;
+    MetadataSaveFn save_;
+    string journalPath_;
+    MetadataAppendFn append_;
+    MetadataCompactCheckFn needsCompaction_;
+
+    bool loaded_;
+    string key_;
+    FileStamp stamp_;
+    FileStamp journalStamp_;
+    vector<EnvelopeEntry> entries_;
+    unordered_map<string, size_t> index_;          // filePath -> position in entries_
+    unordered_map<string, EnvelopeUpdate> dirty_;  // filePath -> change not yet on disk
+    bool awaitingCommit_;                           // written inside a transaction not yet ended
+    bool journalPending_;                           // ...with a journal append
+};
+
+// Per-process stores for a user's own envelopes (envelopes.enc + envelopes.log) and
+// for the envelopes shared with them (shared_envelopes.enc).
+EnvelopeStore &userEnvelopeStore(const string &username);
+EnvelopeStore &sharedEnvelopeStore(const string &username);
+
+// Sync point: write back every dirty store. Called at the end of each shell command,
+// inside its transaction, and at exit. While the thread holds metadata locks (a command
+// that locked its own files) only the stores it changed are written back.
+bool flushEnvelopeStores();
+
+#endif // ENVELOPE_STORE_H
@@ -0,0 +1,31 @@
+#ifndef FRAMED_PROTOCOL_H
+#define FRAMED_PROTOCOL_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "session.h"
+
+using namespace std;
+
+// Binary request/response protocol for programs that keep many commands in flight.
+// All integers are big-endian.
+//   request:  u32 id | u32 length | <length bytes: one command line>
+//   response: u32 id | u32 status | u32 length | <length bytes: the command's output>
+// 'id' is chosen by the client and echoed back; 'status' is 0 ok, 1 error, 2 invalid.
+// Responses are sent as commands finish, so they may arrive in any order.
+const size_t FRAME_HEADER_LEN = 8;
+const size_t FRAME_RESPONSE_HEADER_LEN = 12;
+const uint32_t FRAME_MAX_PAYLOAD = 16 * 1024 * 1024;
+
+// Serves framed requests from 'in' until end of input or an "exit" request.
+// Read-only commands (see commandIsReadOnly) run concurrently on a thread pool, up
+// to 'maxInFlight' at a time; any other command waits for everything before it to
+// finish and runs alone, so the results are those of running the requests in order.
+// Returns false on a malformed frame.
+bool runFramed(const string &base, const UserSession &session, istream &in, ostream &out,
+               size_t maxInFlight = 64);
+
+#endif // FRAMED_PROTOCOL_H
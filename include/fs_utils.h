@@ -2,10 +2,91 @@
 #define FS_UTILS_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <cstdint>
 
 using namespace std;
 
+// Identity and version of a file on disk, used to notice changes made by other sessions.
+struct FileStamp {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtimeNs;
+
+    bool operator==(const FileStamp &other) const {
+        return device == other.device && inode == other.inode &&
+               size == other.size && mtimeNs == other.mtimeNs;
+    }
+};
+
+// Read-only memory map of a whole file. view() points straight at the page cache and
+// stays valid until close() or destruction, so callers can parse and decrypt in place
+// without copying. Only for files that are replaced by rename (writeFile): a file
+// truncated in place while mapped raises SIGBUS in the reader, so encrypted files and
+// journals are read with preadFull instead.
+class MappedFile {
+public:
+    MappedFile() : data_(nullptr), size_(0) {}
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const string &path);
+    void close();
+    // Hints that the mapping will be read front to back (kernel read-ahead).
+    void adviseSequential() const;
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+    string_view view() const { return string_view(data_, size_); }
+
+private:
+    char *data_;
+    size_t size_;
+};
+
+// Streaming directory reader over getdents64(2). Entries are decoded straight out of
+// one fixed buffer, so nothing is collected per directory, and the entry type comes
+// from d_type; fstatat() is only needed for symlinks (which are followed, like stat())
+// and on filesystems that report DT_UNKNOWN. Entries include "." and "..".
+enum class DirEntryType { File, Directory, Other, Missing };
+
+struct DirEntry {
+    string_view name;     // valid until the next call to next()
+    DirEntryType type;
+};
+
+class DirReader {
+public:
+    DirReader() : fd_(-1), pos_(0), len_(0), failed_(false) {}
+    ~DirReader() { close(); }
+    DirReader(const DirReader &) = delete;
+    DirReader &operator=(const DirReader &) = delete;
+
+    bool open(const string &path);
+    // Opens the directory 'name' relative to the open directory 'dirFd'. A symlink
+    // in place of 'name' is not followed.
+    bool openAt(int dirFd, const char *name);
+    void close();
+    int fd() const { return fd_; }
+    // Hands the open descriptor to the caller and frees the read buffer.
+    int release();
+    // Next entry; false at the end of the directory or on a read error (see failed()).
+    bool next(DirEntry &entry);
+    bool failed() const { return failed_; }
+
+private:
+    bool start();
+
+    int fd_;
+    size_t pos_;
+    size_t len_;
+    bool failed_;
+    vector<char> buf_;
+};
+
 // File and directory operations
 bool fileExists(const string &path);
 bool directoryExists(const string &path);
@@ -13,10 +94,27 @@ bool createDirectory(const string &path);
 bool createDirectories(const string &path);
 bool listDirectory(const string &path, vector<string> &entries);
 bool isDirectory(const string &path);
+// readFile reads the file in one pass into a string sized from fstat().
+// writeFile replaces 'path' atomically: the data is written to a temporary file that
+// is preallocated and filled with large pwrite() calls, then renamed over 'path'.
+// Readers that have the old file open or mapped keep a consistent copy. Not for
+// files that must keep their inode (hard-linked shares use the encrypted_fs writers).
 bool readFile(const string &path, string &contents);
-bool writeFile(const string &path, const string &contents);
+bool writeFile(const string &path, string_view contents);
 bool removeFile(const string &path);
 bool createHardLink(const string &existing, const string &newLink);
+bool getFileStamp(const string &path, FileStamp &stamp);
+
+// Plain descriptor I/O with fixed caller buffers, retrying short transfers and EINTR.
+// readFull returns the bytes read (less than 'cap' only at end of file) or -1 on error.
+long readFull(int fd, char *buf, size_t cap);
+bool writeFull(int fd, const char *data, size_t len);
+// Positional read of up to 'cap' bytes at 'offset'; same result as readFull.
+long preadFull(int fd, char *buf, size_t cap, uint64_t offset);
+// Positional write of the whole buffer at 'offset'.
+bool pwriteFull(int fd, const char *data, size_t len, uint64_t offset);
+// Reserves 'size' bytes of disk for 'fd' up front; a no-op where unsupported.
+void preallocate(int fd, uint64_t size);
 
 // Path helper functions
 string normalizePath(const string &base, const string &currentRelative, const string &inputPath);
@@ -0,0 +1,66 @@
+#ifndef METADATA_LOCK_H
+#define METADATA_LOCK_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+enum class LockMode { Shared, Exclusive };
+
+// Reader/writer lock on one or more metadata files, held against other threads and
+// other processes (CLI sessions, a daemon) alike. Readers of a file share it and
+// writers get it alone.
+//
+// Files are hashed onto a fixed set of stripes, each one byte of
+// filesystem/metadata/.locks locked with an OFD byte-range lock; inside a process a
+// shared_mutex per stripe orders the threads and only the first reader and the writer
+// touch the file lock. The stripes of a MetadataLock are always taken in ascending
+// order, so several of them, like the files of one share, can't deadlock each other.
+//
+// Locks nest within a thread: a stripe the thread already holds is re-entered, and an
+// exclusive hold covers shared requests. A stripe below one the thread holds, or an
+// exclusive hold of a stripe it holds shared (two files can share a stripe), would
+// break the order and is only tried; lock() fails if it is taken. So code that writes
+// several files adds them all to one MetadataLock up front, before any nested use.
+//
+// Exclusive stripes released while a MetadataTransaction is open stay held until it
+// ends (see releaseRetainedMetadataLocks), so no one sees or overwrites the files
+// before its changes are applied.
+//
+// Lock the files before any in-memory store mutex that guards their contents.
+class MetadataLock {
+public:
+    MetadataLock();
+    // Locks a single file; check locked().
+    MetadataLock(const string &path, LockMode mode);
+    ~MetadataLock();
+
+    MetadataLock(const MetadataLock &) = delete;
+    MetadataLock &operator=(const MetadataLock &) = delete;
+
+    // Adds a file to lock with lock() or tryLock().
+    void add(const string &path, LockMode mode);
+    // Waits until every added file is locked. False, with nothing held, on failure.
+    bool lock();
+    // Like lock(), but fails instead of waiting for a file another holder has.
+    bool tryLock();
+    void unlock();
+    bool locked() const { return locked_; }
+
+private:
+    bool acquire(bool wait);
+
+    vector<pair<size_t, LockMode>> stripes_;    // sorted by stripe, one mode each
+    vector<size_t> taken_;                      // stripes this lock acquired, not re-entered
+    bool locked_;
+};
+
+// True while the calling thread holds any stripe, retained ones included.
+bool metadataLocksHeld();
+// Releases the stripes kept for the calling thread's transaction; called by the
+// outermost MetadataTransaction when it ends.
+void releaseRetainedMetadataLocks();
+
+#endif // METADATA_LOCK_H
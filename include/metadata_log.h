@@ -0,0 +1,91 @@
+#ifndef METADATA_LOG_H
+#define METADATA_LOG_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+// One change to a file, as recorded in the metadata log. Every kind can be applied
+// again and leaves the same result, which is what makes replay after a crash safe.
+enum class MetadataChangeKind : unsigned char {
+    Write = 1,      // replace the file with 'data'
+    WriteAt = 2,    // write 'data' at 'offset' and cut the file there (journal appends)
+    Remove = 3,     // delete the file if it exists
+    Link = 4,       // make 'path' a hard link to the file named by 'data'
+};
+
+struct MetadataChange {
+    MetadataChangeKind kind;
+    string path;
+    string data;
+    uint64_t offset;
+};
+
+// Write-ahead log for the metadata files (filesystem/metadata/.wal).
+//
+// The changes of a transaction are appended to the log as one checksummed record, the
+// log is synced, and only then are the files changed; a marker noted afterwards says
+// the record has been applied. Threads committing at the same time share one
+// fdatasync (group commit), so a burst of commands pays for a single sync rather than
+// one per file. After a crash the next process to open the log alone replays it, which
+// either completes an interrupted transaction or, if its record never reached the
+// disk, leaves none of it behind.
+//
+// Transactions nest per thread: one opened while another is open joins it, and its
+// commit() leaves the changes to the outermost one. Changes are not visible on disk
+// until that commit, so code inside a transaction must not read back what it wrote.
+// Exclusive MetadataLocks released while a transaction is open stay held until the
+// outermost one ends, so the files it changes are not touched by others meanwhile.
+class MetadataTransaction {
+public:
+    MetadataTransaction();
+    // Discards the changes made since it was opened if commit() was not called.
+    ~MetadataTransaction();
+
+    MetadataTransaction(const MetadataTransaction &) = delete;
+    MetadataTransaction &operator=(const MetadataTransaction &) = delete;
+
+    void add(MetadataChange change);
+    // Logs, syncs and applies the changes. False if they could not be made durable
+    // (nothing was changed) or applying them failed.
+    bool commit();
+
+private:
+    static MetadataTransaction *outermost(MetadataTransaction *transaction);
+    void end(bool committed);
+
+    friend void onMetadataTransactionEnd(function<void(bool committed)> ender);
+
+    MetadataTransaction *outer_;
+    size_t mark_;                               // where its changes start in the outermost's
+    size_t endersMark_;
+    vector<MetadataChange> changes_;            // outermost only, like enders_
+    vector<function<void(bool)>> enders_;
+    bool finished_;
+};
+
+// True while the calling thread has a transaction open.
+bool metadataTransactionOpen();
+// Runs 'ender' when the thread's open transaction ends: with true once its changes are
+// on disk, with false if they were discarded. At once (true) if none is open.
+void onMetadataTransactionEnd(function<void(bool committed)> ender);
+
+// Metadata counterparts of writeFile, removeFile and createHardLink. Inside a
+// transaction they only record the change; otherwise they commit it on their own.
+bool logWriteFile(const string &path, string_view contents);
+bool logWriteAt(const string &path, uint64_t offset, string_view data);
+bool logRemoveFile(const string &path);
+// Replaces 'newLink' if it names a different file.
+bool logHardLink(const string &existing, const string &newLink);
+
+// Opens the log at startup, before any metadata is read; if no other process has it
+// open, transactions left behind by a crash are replayed first.
+bool openMetadataLog();
+// Checkpoints the log at exit: once every logged change is on disk it is emptied.
+void closeMetadataLog();
+
+#endif // METADATA_LOG_H
@@ -0,0 +1,66 @@
+#ifndef NAME_CACHE_H
+#define NAME_CACHE_H
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+#include "fs_utils.h"
+
+using namespace std;
+
+// How the names of files and directories below personal/ and shared/ are stored.
+// Plain: as typed. Siv: each name is encrypted with encryptName(), which is
+// deterministic, so a path is resolved by encrypting its components instead of
+// listing and decrypting directories. The <user>/personal and <user>/shared skeleton
+// and the per-owner directories under shared/ keep their plain names.
+// The mode of a filesystem is recorded in filesystem/metadata/name_mode.
+enum class NameMode { Plain, Siv };
+
+NameMode loadNameMode();
+// Records 'mode' for the filesystem. Existing entries are not renamed, so the mode can
+// only change while no user has any files or directories.
+bool storeNameMode(NameMode mode);
+const char *nameModeName(NameMode mode);
+bool parseNameMode(const string &name, NameMode &mode);
+
+// Maps plain paths to on-disk paths and on-disk names back to plain ones for one
+// session, remembering both directions so repeated lookups (cd, ls, cat of the same
+// directories) cost a hash lookup instead of an HMAC and a cipher call.
+// Paths are full paths starting at "filesystem"; anything else is left unchanged.
+// The mode is read again whenever the mode file changes, checked once per diskPath();
+// diskChild() and plainChild() work below a path resolved that way.
+// Safe to use from several threads.
+class NameCache {
+public:
+    NameCache();
+    NameCache(const NameCache &) = delete;
+    NameCache &operator=(const NameCache &) = delete;
+
+    // Drops cached names and reads the filesystem's mode.
+    void init(const string &globalKey);
+    NameMode mode();
+
+    // On-disk form of 'plainPath'. False if a name is too long to be stored encrypted.
+    bool diskPath(const string &plainPath, string &out);
+    // On-disk name of the entry 'name' inside the on-disk directory 'diskDir'.
+    bool diskChild(const string &diskDir, const string &name, string &out);
+    // Plain name of the on-disk entry 'diskName' inside 'diskDir'. Names that don't
+    // decrypt are returned as they are.
+    string plainChild(const string &diskDir, const string &diskName);
+
+private:
+    NameMode refreshMode();
+    NameMode currentMode();
+    bool encrypt(const string &name, string &out);
+    string decrypt(const string &diskName);
+
+    mutex lock_;
+    string globalKey_;
+    NameMode mode_;
+    FileStamp modeStamp_;                     // of the mode file when mode_ was read
+    unordered_map<string, string> toDisk_;    // plain name -> on-disk name
+    unordered_map<string, string> toPlain_;   // on-disk name -> plain name
+};
+
+#endif // NAME_CACHE_H
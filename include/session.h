@@ -0,0 +1,40 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+
+#include <openssl/rsa.h>
+
+#include "name_cache.h"
+
+using namespace std;
+
+// Credentials of a logged-in user. They are unlocked once at login and then used
+// by every shell command, so no command re-reads or re-decrypts the PEM keyfile.
+// The private key is parsed into OpenSSL's secure heap (locked, guarded pages)
+// and all key material is wiped when the session is destroyed.
+struct UserSession {
+    string username;
+    bool isAdmin;
+    RSA *privateKey;          // owned; unlocked with the user's passphrase
+    RSA *publicKey;           // owned; public half of privateKey, wraps new envelopes
+    string derivedKey;        // key derived from the passphrase, encrypts user metadata
+    string globalSharingKey;  // unwrapped global sharing key
+    mutable NameCache names;  // plain <-> on-disk names, keyed by globalSharingKey
+
+    UserSession();
+    ~UserSession();
+    UserSession(const UserSession &) = delete;
+    UserSession &operator=(const UserSession &) = delete;
+};
+
+// Unlocks the private key of 'username' with 'passphrase', checks it against the
+// public key presented at login and unwraps the global sharing key (initializing
+// it first when the admin logs in). Returns false, after printing the reason,
+// if any step fails.
+bool openUserSession(const string &username,
+                     const string &passphrase,
+                     const string &loginPublicKeyPath,
+                     UserSession &session);
+
+#endif // SESSION_H
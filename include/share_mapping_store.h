@@ -0,0 +1,61 @@
+#ifndef SHARE_MAPPING_STORE_H
+#define SHARE_MAPPING_STORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "fs_utils.h"
+
+using namespace std;
+
+// One recipient of a shared file and the hard link created for them.
+struct ShareTarget {
+    string recipient;
+    string targetFile;
+};
+
+// Share mappings of one owner, stored in filesystem/metadata/<owner>/share_mappings.mapping
+// and encrypted with the global sharing key. The shard is decrypted once into a hash
+// index from source file to recipients; writes rewrite only this owner's shard.
+// As with EnvelopeStore, a stat() check reloads the shard if another session changed it,
+// and a MetadataLock on the shard keeps other sessions out between reload and rewrite.
+class ShareMappingStore {
+public:
+    ShareMappingStore(const string &owner, const string &shardPath);
+
+    // Recipients of 'sourceFile' (empty if it was never shared).
+    bool recipients(const string &key, const string &sourceFile, vector<ShareTarget> &targets);
+    // Adds or updates 'target' for 'sourceFile' and writes the shard.
+    bool addRecipient(const string &key, const string &sourceFile, const ShareTarget &target);
+    // Readable "<source> user:target ..." listing, used when admin inspects a shard.
+    bool describe(const string &key, string &text);
+
+private:
+    bool ensureLoaded(const string &key);
+    bool save();
+    void restamp();
+
+    mutex lock_;
+    string owner_;
+    string shardPath_;
+    bool loaded_;
+    string key_;
+    FileStamp stamp_;
+    bool awaitingCommit_;      // saved inside a transaction not yet ended
+    unordered_map<string, vector<ShareTarget>> mappings_;
+};
+
+// Owner of a file under filesystem/<owner>/..., or "" for any other path.
+string shareMappingOwner(const string &filePath);
+// filesystem/metadata/<owner>/share_mappings.mapping
+string shareMappingShardPath(const string &owner);
+// Per-process shard for 'owner'.
+ShareMappingStore &shareMappingShard(const string &owner);
+// Splits the old global mapping file, if there still is one, into per-owner shards.
+// The stores do this on each use; callers that lock a shard themselves call it first,
+// since it locks shards of its own.
+void migrateLegacyShareMappings(const string &key);
+
+#endif // SHARE_MAPPING_STORE_H
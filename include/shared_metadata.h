@@ -1,21 +1,29 @@
 #ifndef SHARED_METADATA_H
 #define SHARED_METADATA_H
 
+#include <map>
 #include <string>
 #include <vector>
 #include "user_metadata.h"
+#include "share_mapping_store.h"
 
 using namespace std;
 
 // Shared metadata functions (for files shared with a user)
+// filesystem/metadata/<username>/shared_envelopes.enc
+string sharedMetadataPath(const string &username);
 bool loadSharedMetadata(const string &username, const string &globalKey, vector<EnvelopeEntry> &entries);
 bool saveSharedMetadata(const string &username, const string &globalKey, const vector<EnvelopeEntry> &entries);
 bool updateSharedEnvelopeEntry(const string &username, const string &globalKey, const string &filePath, const string &envelope);
+// Batched fan-out of one clear key/IV to many share targets: the sealed envelopes,
+// grouped per recipient (see shared_metadata.cpp).
+bool sealSharedEnvelopes(const vector<ShareTarget> &targets, const string &globalKey, const string &clearKeyIV,
+                         map<string, vector<EnvelopeUpdate>> &byRecipient);
 bool findUserSharedEnvelope(const string &username, const string &filePath, const string &globalKey, string &envelope);
 
-// Share mapping functions
-bool updateShareMapping(const string &mappingFilePath, const string &filePath, const string &targetUser, const string &targetFile, const string &sharingKey);
-vector<string> getSharedRecipientsForFile(const string &mappingFilePath, const string &filePath, const string &sharingKey);
+// Share mapping functions (sharded per owner, see share_mapping_store.h)
+bool updateShareMapping(const string &filePath, const string &targetUser, const string &targetFile, const string &sharingKey);
+vector<ShareTarget> getSharedRecipientsForFile(const string &filePath, const string &sharingKey);
 bool updateRecursiveShare(const string &owner, const string &ownerDerivedKey, const string &filePath, const string &globalSharingKey, const string &clearKeyIV);
 
 
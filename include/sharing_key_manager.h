@@ -3,19 +3,21 @@
 
 #include <string>
 
+#include <openssl/rsa.h>
+
 using namespace std;
 
 // Global sharing key management functions
-bool initGlobalSharingKey(const string &adminPublicKeyPath,
-                          const string &adminPrivateKeyPath,
-                          const string &adminPassphrase, 
+bool initGlobalSharingKey(RSA *adminPublicKey,
+                          RSA *adminPrivateKey,
                           string &globalKey);
 bool grantUserAccessToGlobalKey(const string &username, const string &userPublicKeyPath);
 bool retrieveGlobalSharingKey(const string &username,
-                              const string &userPublicKeyPath,
-                              const string &userPrivateKeyPath,
-                              const string &userPass,
+                              RSA *userPrivateKey,
                               string &globalKey);
-bool updateAdminAccessForFile(const string &owner, const string &ownerDerivedKey, const string &globalSharingKey, const string &filePath, const string &clearKeyIV);
+
+// Admin escrow slot stored in each encrypted file header (see encrypted_fs.cpp).
+bool wrapAdminEscrow(const string &clearKeyIV, string &escrow);
+bool unwrapAdminEscrow(RSA *adminPrivateKey, const string &escrow, string &clearKeyIV);
 
 #endif // SHARING_KEY_MANAGER_H
@@ -1,11 +1,40 @@
 #ifndef SHELL_H
 #define SHELL_H
 
+#include <istream>
+#include <ostream>
 #include <string>
 
+#include "session.h"
+
 using namespace std;
 
 // Interactive shell main loop
-void shellLoop(const string &base, bool isAdmin, const string &currentUser, const string &userPass, const string &globalSharingKey, const string &userDerivedKey);
+void shellLoop(const string &base, const UserSession &session);
+
+// Outcome of one command line.
+enum class CommandStatus { Ok, Failed, Invalid, Exit };
+
+// Runs one command line without prompting and writes only the command's output to
+// 'out'. "exit" only returns Exit, and commands that prompt on the terminal are
+// Invalid. 'currentRelative' is the shell's current directory below 'base'.
+CommandStatus runCommandLine(ostream &out, const string &line, const string &base, string &currentRelative,
+                             const UserSession &session);
+// True for commands that change neither the filesystem nor the current directory
+// (pwd, ls, find, tree, du, cat), so several of them can run at once.
+bool commandIsReadOnly(const string &line);
+
+// Runs one line of a non-interactive shell: writes the command's output followed by
+// its %result line (see runBatch) to 'out', like runCommandLine().
+CommandStatus runScriptCommand(ostream &out, const string &line, const string &base, string &currentRelative,
+                               const UserSession &session, size_t seq);
+
+// Runs the commands of 'script' one per line (blank lines and lines starting with '#'
+// are skipped) with buffered output. After each command a line
+//   %result seq=<n> status=ok|error|invalid us=<elapsed> cmd=<name>
+// is printed, and at the end a %summary line with the counts and commands per second.
+// "exit" ends the script early; changepass is not available.
+// Returns false if any command failed or was invalid.
+bool runBatch(const string &base, const UserSession &session, istream &script);
 
 #endif // SHELL_H
@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Work-stealing thread pool. Each worker owns a task deque: it runs its own tasks
+// newest-first and, when that deque is empty, steals the oldest task of another
+// worker, so uneven jobs (one large file among many small ones) don't leave threads
+// idle. Tasks submitted from outside the pool are dealt round-robin; tasks submitted
+// from inside a worker go to that worker's own deque.
+// wait() blocks until every task submitted so far has run; the destructor waits too.
+class ThreadPool {
+public:
+    // 'threads' == 0 uses the number of hardware threads.
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void submit(function<void()> task);
+    void wait();
+    // Like wait(), but gives up after 'timeout'. Returns true once the pool is idle.
+    bool waitFor(chrono::milliseconds timeout);
+    size_t size() const { return workers_.size(); }
+
+private:
+    struct WorkQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    void workerLoop(size_t self);
+    bool takeTask(size_t self, function<void()> &task);
+
+    mutex lock_;                   // guards the counters below
+    condition_variable taskReady_;
+    condition_variable allDone_;
+    size_t queued_;                // tasks sitting in a deque
+    size_t pending_;               // queued + running
+    size_t nextQueue_;             // round-robin slot for external submits
+    bool stopping_;
+    vector<unique_ptr<WorkQueue>> queues_;
+    vector<thread> workers_;
+};
+
+// Worker count for 'jobs' independent jobs: at most one thread per job, capped
+// at the number of hardware threads.
+size_t workerCountFor(size_t jobs);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,44 @@
+#ifndef TREE_WALK_H
+#define TREE_WALK_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// One entry of a directory reached by walkTree().
+struct WalkEntry {
+    string name;      // as returned by WalkOptions::displayName
+    bool isDir;
+    // Files only, and only with WalkOptions::sizes:
+    uint64_t bytes;   // allocated size
+    uint64_t device;
+    uint64_t inode;
+    bool linked;      // the inode has other hard links
+};
+
+// Maps the on-disk name of an entry of the on-disk directory 'diskDir' to the name the
+// walk reports; by default names are reported as they are.
+typedef function<string(const string &diskDir, const string &diskName)> WalkNameFn;
+
+// Called once per directory with its entries (unordered). 'path' is the directory's
+// display path relative to the root ("" for the root itself) and 'depth' its depth.
+// Calls come concurrently from the walker threads.
+typedef function<void(const string &path, int depth, vector<WalkEntry> &entries)> WalkVisitor;
+
+struct WalkOptions {
+    bool sizes = false;
+    WalkNameFn displayName;
+    size_t threads = 0;   // 0: one per hardware thread
+};
+
+// Parallel recursive walk of the directory 'root'. Every directory is a task on a
+// work-stealing ThreadPool, and subdirectories are opened with openat() relative to
+// their parent's descriptor without following symlinks, so the walk never leaves
+// 'root' and no path is re-resolved from the top. Returns false if 'root' can't be
+// opened or some subdirectory could not be read (those are reported and skipped).
+bool walkTree(const string &root, const WalkOptions &options, const WalkVisitor &visit);
+
+#endif // TREE_WALK_H
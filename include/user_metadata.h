@@ -12,11 +12,36 @@ struct EnvelopeEntry {
     string envelope;
 };
 
+// One buffered change to an envelope table: an upsert, or a tombstone when 'removed' is set.
+struct EnvelopeUpdate {
+    string filePath;
+    string envelope;
+    bool removed;
+};
+
+// Envelope table codec shared by user and shared metadata.
+// Binary layout (version 1): "BENV" magic, 1 byte version, varint entry count, then per
+// entry a varint path length, the path, a varint envelope length and the raw envelope.
+// deserializeEnvelopeEntries also accepts the legacy "<path> <hex envelope>" text lines.
+string serializeEnvelopeEntries(const vector<EnvelopeEntry> &entries);
+bool deserializeEnvelopeEntries(const string &data, vector<EnvelopeEntry> &entries);
+// Human-readable "<path> <hex envelope>" listing, used when admin inspects metadata files.
+string formatEnvelopeEntries(const vector<EnvelopeEntry> &entries);
+
 // User metadata functions
 bool findUserEnvelope(const string &username, const string &filePath, 
                       const string &derivedKey, string &envelope);
+// filesystem/metadata/<username>/envelopes.enc (journal: envelopes.log next to it)
+string userMetadataPath(const string &username);
 bool loadUserMetadata(const string &username, const string &derivedKey, vector<EnvelopeEntry> &entries);
 bool saveUserMetadata(const string &username, const string &derivedKey, const vector<EnvelopeEntry> &entries);
 bool updateUserEnvelopeEntry(const string &username, const string &derivedKey, const string &filePath, const string &envelope);
+bool removeUserEnvelopeEntry(const string &username, const string &derivedKey, const string &filePath);
+
+// User metadata journal (envelopes.log). Updates are appended as individually
+// authenticated records instead of rewriting envelopes.enc; loadUserMetadata replays
+// them on top of the snapshot and saveUserMetadata folds them back in (compaction).
+bool appendUserMetadataJournal(const string &username, const string &derivedKey, const vector<EnvelopeUpdate> &updates);
+bool userMetadataNeedsCompaction(const string &username);
 
 #endif // USER_METADATA_H
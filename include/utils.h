@@ -2,19 +2,34 @@
 #define UTILS_H
 
 #include <string>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
 
 using namespace std;
 
-// Bytes to Hex
-string toHex(const string &input);
-string fromHex(const string &hexString);
+// Bytes to Hex. fromHex accepts either case and returns an empty string for odd-length
+// input or any character that is not a hex digit.
+string toHex(string_view input);
+string fromHex(string_view hexString);
+// Buffer forms: hexEncode writes 2 * len characters; hexDecode reads 2 * len characters
+// into len bytes and returns false on a non-hex character.
+void hexEncode(const unsigned char *in, size_t len, char *out);
+bool hexDecode(const char *in, size_t len, unsigned char *out);
+
+// LEB128 varints used by the binary metadata formats.
+void putVarint(string &out, uint64_t value);
+// Reads a varint at 'pos' (advancing it); false if it runs past 'end' or is malformed.
+bool getVarint(const unsigned char *&pos, const unsigned char *end, uint64_t &value);
 
 // Encrypt a single file/directory name using the global key.
-// The function returns a hex string containing IV + ciphertext.
+// The function returns a hex string containing SIV + ciphertext; the same name always
+// encrypts to the same string.
 string encryptName(const string &name, const string &globalKey);
 
 // Decrypt a single file/directory name using the global key.
-// The input is expected to be a hex string (IV+ciphertext).
+// The input is expected to be a hex string (SIV+ciphertext); throws if it does not
+// authenticate.
 string decryptName(const string &encryptedNameHex, const string &globalKey);
 
 // Split a path (using '/' as separator), encrypt each component, and reassemble.
@@ -1,6 +1,8 @@
 #include "crypto_utils.h"
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
@@ -11,109 +13,329 @@
 #include <sstream>
 #include <cstring>
 #include <iostream>
+#include <memory>
 
 using namespace std;
 
 
-string aes_encrypt(const string &plaintext, const unsigned char *key, const unsigned char *iv) {
-    const string tag_prefix = "GCM";
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx)
-        throw runtime_error("Failed to create cipher context");
+// Per-thread AES-256-GCM context, one per direction. The EVP_CIPHER_CTX is created and
+// bound to the cipher once per thread; each message then only loads key and IV, and
+// when the key is the one used last time only the IV, which skips the key schedule.
+// Every GCM caller here uses 96-bit IVs (aes_encrypt() passes a 16-byte IV of which
+// GCM uses the first 12 bytes by default), so the IV length never has to change.
+class GcmContextCache {
+public:
+    explicit GcmContextCache(int encrypt)
+        : ctx_(EVP_CIPHER_CTX_new()), encrypt_(encrypt), bound_(false), keyed_(false) {}
+    ~GcmContextCache() {
+        OPENSSL_cleanse(key_, sizeof(key_));
+        EVP_CIPHER_CTX_free(ctx_);
+    }
+    GcmContextCache(const GcmContextCache &) = delete;
+    GcmContextCache &operator=(const GcmContextCache &) = delete;
+
+    // Resets the context for a new message under 'key' and 'iv'.
+    EVP_CIPHER_CTX *begin(const unsigned char *key, const unsigned char *iv) {
+        if (!ctx_)
+            throw runtime_error("Failed to create cipher context");
+        if (!bound_) {
+            if (EVP_CipherInit_ex(ctx_, EVP_aes_256_gcm(), nullptr, nullptr, nullptr, encrypt_) != 1)
+                throw runtime_error("EVP_CipherInit_ex failed");
+            bound_ = true;
+        }
+        bool sameKey = keyed_ && CRYPTO_memcmp(key_, key, AES_KEYLEN) == 0;
+        if (EVP_CipherInit_ex(ctx_, nullptr, nullptr, sameKey ? nullptr : key, iv, encrypt_) != 1) {
+            invalidate();
+            throw runtime_error("EVP_CipherInit_ex failed");
+        }
+        if (!sameKey) {
+            memcpy(key_, key, AES_KEYLEN);
+            keyed_ = true;
+        }
+        return ctx_;
+    }
 
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key, iv) != 1)
-        throw runtime_error("EVP_EncryptInit_ex failed");
+    // Drops all cached state; the next begin() starts from scratch.
+    void invalidate() {
+        if (ctx_)
+            EVP_CIPHER_CTX_reset(ctx_);
+        OPENSSL_cleanse(key_, sizeof(key_));
+        bound_ = keyed_ = false;
+    }
 
-    vector<unsigned char> ciphertext(plaintext.size());
-    int len = 0;
+private:
+    EVP_CIPHER_CTX *ctx_;
+    int encrypt_;
+    bool bound_;
+    bool keyed_;
+    unsigned char key_[AES_KEYLEN];
+};
+
+// One GCM message on the calling thread's cached context. If the operation does not
+// reach finish() (a throw, a failed tag check), the cache is invalidated so no
+// half-finished state carries over to the next message.
+class GcmOperation {
+public:
+    GcmOperation(bool encrypt, const unsigned char *key, const unsigned char *iv)
+        : cache_(encrypt ? encryptCache() : decryptCache()), ctx_(cache_.begin(key, iv)), finished_(false) {}
+    ~GcmOperation() {
+        if (!finished_)
+            cache_.invalidate();
+    }
+    EVP_CIPHER_CTX *get() const { return ctx_; }
+    void finish() { finished_ = true; }
+
+private:
+    static GcmContextCache &encryptCache() {
+        thread_local GcmContextCache cache(1);
+        return cache;
+    }
+    static GcmContextCache &decryptCache() {
+        thread_local GcmContextCache cache(0);
+        return cache;
+    }
+
+    GcmContextCache &cache_;
+    EVP_CIPHER_CTX *ctx_;
+    bool finished_;
+};
+
+static const unsigned char kAesPrefix[AES_GCM_PREFIXLEN] = {'G', 'C', 'M'};
 
-    if (EVP_EncryptUpdate(ctx, ciphertext.data(), &len,
+size_t aes_encrypt_into(string_view plaintext, const unsigned char *key, const unsigned char *iv,
+                        unsigned char *out) {
+    GcmOperation ctx(true, key, iv);
+
+    memcpy(out, kAesPrefix, AES_GCM_PREFIXLEN);
+    unsigned char *body = out + AES_GCM_PREFIXLEN;
+    int len = 0;
+    if (!plaintext.empty() &&
+        EVP_EncryptUpdate(ctx.get(), body, &len,
                           reinterpret_cast<const unsigned char*>(plaintext.data()), plaintext.size()) != 1)
         throw runtime_error("EVP_EncryptUpdate failed");
 
-    int ciphertext_len = len;
+    size_t ciphertext_len = len;
 
-    if (EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len) != 1)
+    if (EVP_EncryptFinal_ex(ctx.get(), body + ciphertext_len, &len) != 1)
         throw runtime_error("EVP_EncryptFinal_ex failed");
     ciphertext_len += len;
 
-    unsigned char tag[16];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag) != 1)
+    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, 16, body + ciphertext_len) != 1)
         throw runtime_error("EVP_CIPHER_CTX_ctrl (get tag) failed");
-
-    EVP_CIPHER_CTX_free(ctx);
-
-    string final_result = tag_prefix;
-    final_result += string(reinterpret_cast<char*>(ciphertext.data()), ciphertext_len);
-    final_result += string(reinterpret_cast<char*>(tag), 16);
-    return final_result;
+    ctx.finish();
+    return ciphertext_len + AES_GCM_OVERHEAD;
 }
 
-
-
-string aes_decrypt(const string &ciphertext, const unsigned char *key, const unsigned char *iv) {
-    if (ciphertext.size() < 3)
+size_t aes_decrypt_into(string_view ciphertext, const unsigned char *key, const unsigned char *iv,
+                        unsigned char *out) {
+    if (ciphertext.size() < AES_GCM_PREFIXLEN)
         throw runtime_error("Invalid ciphertext length");
-
-    string mode_tag = ciphertext.substr(0, 3);
-    string actual_cipher = ciphertext.substr(3);
-
-    if (actual_cipher.size() < 16)
+    if (ciphertext.size() < AES_GCM_OVERHEAD)
         throw runtime_error("Ciphertext too short for GCM");
 
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx)
-        throw runtime_error("Failed to create cipher context");
+    GcmOperation ctx(false, key, iv);
 
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key, iv) != 1)
-        throw runtime_error("EVP_DecryptInit_ex failed");
-
-    int ciphertext_len = actual_cipher.size() - 16;
-    auto ciphertext_data = reinterpret_cast<const unsigned char*>(actual_cipher.data());
-    auto tag = reinterpret_cast<const unsigned char*>(actual_cipher.data() + ciphertext_len);
+    size_t ciphertext_len = ciphertext.size() - AES_GCM_OVERHEAD;
+    auto ciphertext_data = reinterpret_cast<const unsigned char*>(ciphertext.data()) + AES_GCM_PREFIXLEN;
+    // OpenSSL wants a mutable tag pointer and the input may be a read-only mapping.
+    unsigned char tag[16];
+    memcpy(tag, ciphertext_data + ciphertext_len, sizeof(tag));
 
-    vector<unsigned char> plaintext(ciphertext_len);
     int len = 0;
-
-    if (EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext_data, ciphertext_len) != 1)
+    if (ciphertext_len > 0 && EVP_DecryptUpdate(ctx.get(), out, &len, ciphertext_data, ciphertext_len) != 1)
         throw runtime_error("EVP_DecryptUpdate failed");
-    
-    vector<unsigned char> tag_vec(tag, tag + 16);
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag_vec.data()) != 1)
+
+    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, 16, tag) != 1)
         throw runtime_error("EVP_CIPHER_CTX_ctrl (set tag) failed");
 
-    int plaintext_len = len;
-    if (EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    size_t plaintext_len = len;
+    if (EVP_DecryptFinal_ex(ctx.get(), out + plaintext_len, &len) != 1)
         throw runtime_error("EVP_DecryptFinal_ex failed (authentication failed)");
+    ctx.finish();
+    return plaintext_len + len;
+}
+
+string aes_encrypt(string_view plaintext, const unsigned char *key, const unsigned char *iv) {
+    string result(plaintext.size() + AES_GCM_OVERHEAD, '\0');
+    aes_encrypt_into(plaintext, key, iv, reinterpret_cast<unsigned char*>(&result[0]));
+    return result;
+}
+
+string aes_decrypt(string_view ciphertext, const unsigned char *key, const unsigned char *iv) {
+    string result(ciphertext.size() >= AES_GCM_OVERHEAD ? ciphertext.size() - AES_GCM_OVERHEAD : 0, '\0');
+    result.resize(aes_decrypt_into(ciphertext, key, iv, reinterpret_cast<unsigned char*>(&result[0])));
+    return result;
+}
+
+string aes_encrypt_blob(string_view plaintext, const unsigned char *key, const unsigned char *iv) {
+    string blob(AES_IVLEN + plaintext.size() + AES_GCM_OVERHEAD, '\0');
+    unsigned char *out = reinterpret_cast<unsigned char*>(&blob[0]);
+    if (iv)
+        memcpy(out, iv, AES_IVLEN);
+    else if (RAND_bytes(out, AES_IVLEN) != 1)
+        throw runtime_error("RAND_bytes failed");
+    aes_encrypt_into(plaintext, key, out, out + AES_IVLEN);
+    return blob;
+}
+
+void aes_decrypt_blob(string_view blob, const unsigned char *key, string &out) {
+    if (blob.size() < AES_IVLEN + AES_GCM_OVERHEAD)
+        throw runtime_error("Encrypted blob too short");
+    out.resize(blob.size() - AES_IVLEN - AES_GCM_OVERHEAD);
+    aes_decrypt_into(blob.substr(AES_IVLEN), key, reinterpret_cast<const unsigned char*>(blob.data()),
+                     reinterpret_cast<unsigned char*>(&out[0]));
+}
+
+void aes_gcm_encrypt_batch(const vector<string_view> &plaintexts, const unsigned char *key,
+                           const unsigned char *ivs, vector<string> &blobs) {
+    string drawn;
+    if (!ivs) {
+        drawn.resize(plaintexts.size() * AES_IVLEN);
+        if (!drawn.empty() &&
+            RAND_bytes(reinterpret_cast<unsigned char*>(&drawn[0]), drawn.size()) != 1)
+            throw runtime_error("RAND_bytes failed");
+        ivs = reinterpret_cast<const unsigned char*>(drawn.data());
+    }
+    blobs.resize(plaintexts.size());
+    for (size_t i = 0; i < plaintexts.size(); i++) {
+        string &blob = blobs[i];
+        blob.resize(AES_IVLEN + plaintexts[i].size() + AES_GCM_OVERHEAD);
+        unsigned char *out = reinterpret_cast<unsigned char*>(&blob[0]);
+        memcpy(out, ivs + i * AES_IVLEN, AES_IVLEN);
+        aes_encrypt_into(plaintexts[i], key, out, out + AES_IVLEN);
+    }
+}
+
+size_t aes_gcm_decrypt_batch(const vector<string_view> &blobs, const unsigned char *key,
+                             vector<string> &plaintexts, vector<bool> &ok) {
+    plaintexts.resize(blobs.size());
+    ok.assign(blobs.size(), false);
+    size_t good = 0;
+    for (size_t i = 0; i < blobs.size(); i++) {
+        try {
+            aes_decrypt_blob(blobs[i], key, plaintexts[i]);
+            ok[i] = true;
+            good++;
+        } catch (const exception &) {
+            plaintexts[i].clear();
+        }
     }
-    plaintext_len += len;
+    return good;
+}
+
+static void sivTag(string_view plaintext, const unsigned char *macKey, unsigned char *siv) {
+    unsigned char mac[SHA256_DIGEST_LENGTH];
+    unsigned int macLen = 0;
+    if (!HMAC(EVP_sha256(), macKey, AES_KEYLEN, reinterpret_cast<const unsigned char*>(plaintext.data()),
+              plaintext.size(), mac, &macLen))
+        throw runtime_error("HMAC failed");
+    memcpy(siv, mac, SIV_LEN);
+}
+
+static void sivCtr(const unsigned char *encKey, const unsigned char *siv,
+                   const unsigned char *in, size_t len, unsigned char *out) {
+    unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+    int outLen = 0, finalLen = 0;
+    if (!ctx || EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_ctr(), nullptr, encKey, siv) != 1 ||
+        (len > 0 && EVP_EncryptUpdate(ctx.get(), out, &outLen, in, len) != 1) ||
+        EVP_EncryptFinal_ex(ctx.get(), out + outLen, &finalLen) != 1)
+        throw runtime_error("AES-CTR failed");
+}
 
-    EVP_CIPHER_CTX_free(ctx);
-    return string(reinterpret_cast<char*>(plaintext.data()), plaintext_len);
+string aes_siv_encrypt(string_view plaintext, const unsigned char *macKey, const unsigned char *encKey) {
+    string out(SIV_LEN + plaintext.size(), '\0');
+    unsigned char *siv = reinterpret_cast<unsigned char*>(&out[0]);
+    sivTag(plaintext, macKey, siv);
+    sivCtr(encKey, siv, reinterpret_cast<const unsigned char*>(plaintext.data()), plaintext.size(), siv + SIV_LEN);
+    return out;
 }
 
+bool aes_siv_decrypt(string_view ciphertext, const unsigned char *macKey, const unsigned char *encKey,
+                     string &out) {
+    out.clear();
+    if (ciphertext.size() < SIV_LEN)
+        return false;
+    const unsigned char *siv = reinterpret_cast<const unsigned char*>(ciphertext.data());
+    string plaintext(ciphertext.size() - SIV_LEN, '\0');
+    sivCtr(encKey, siv, siv + SIV_LEN, plaintext.size(), reinterpret_cast<unsigned char*>(&plaintext[0]));
+    unsigned char expected[SIV_LEN];
+    sivTag(plaintext, macKey, expected);
+    if (CRYPTO_memcmp(expected, siv, SIV_LEN) != 0)
+        return false;
+    out = move(plaintext);
+    return true;
+}
 
 bool generate_aes_key_iv(unsigned char *key, unsigned char *iv) {
     return (RAND_bytes(key, AES_KEYLEN) == 1 && RAND_bytes(iv, AES_IVLEN) == 1);
 }
 
-string rsa_encrypt(RSA *rsa, const string &data) {
-    int rsa_size = RSA_size(rsa);
-    vector<unsigned char> encrypted(rsa_size);
-    int len = RSA_public_encrypt(data.size(), reinterpret_cast<const unsigned char*>(data.data()), encrypted.data(), rsa, RSA_PKCS1_OAEP_PADDING);
+// STREAM-style nonce: 7 bytes of the file IV || big-endian segment index || last flag.
+void aes_gcm_segment_nonce(const unsigned char *iv, uint32_t index, bool last, unsigned char *nonce) {
+    memcpy(nonce, iv, GCM_NONCELEN - 5);
+    nonce[GCM_NONCELEN - 5] = static_cast<unsigned char>(index >> 24);
+    nonce[GCM_NONCELEN - 4] = static_cast<unsigned char>(index >> 16);
+    nonce[GCM_NONCELEN - 3] = static_cast<unsigned char>(index >> 8);
+    nonce[GCM_NONCELEN - 2] = static_cast<unsigned char>(index);
+    nonce[GCM_NONCELEN - 1] = last ? 1 : 0;
+}
+
+void aes_gcm_seal(const unsigned char *key, const unsigned char *nonce,
+                  const unsigned char *aad, size_t aadLen,
+                  const unsigned char *in, size_t inLen,
+                  unsigned char *out, unsigned char *tag) {
+    GcmOperation ctx(true, key, nonce);
+
+    int len = 0;
+    if (aadLen > 0 && EVP_EncryptUpdate(ctx.get(), nullptr, &len, aad, aadLen) != 1)
+        throw runtime_error("EVP_EncryptUpdate (aad) failed");
+    if (inLen > 0 && EVP_EncryptUpdate(ctx.get(), out, &len, in, inLen) != 1)
+        throw runtime_error("EVP_EncryptUpdate failed");
+    if (EVP_EncryptFinal_ex(ctx.get(), out + (inLen > 0 ? len : 0), &len) != 1)
+        throw runtime_error("EVP_EncryptFinal_ex failed");
+    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, GCM_TAGLEN, tag) != 1)
+        throw runtime_error("EVP_CIPHER_CTX_ctrl (get tag) failed");
+    ctx.finish();
+}
+
+void aes_gcm_open(const unsigned char *key, const unsigned char *nonce,
+                  const unsigned char *aad, size_t aadLen,
+                  const unsigned char *in, size_t inLen,
+                  const unsigned char *tag, unsigned char *out) {
+    GcmOperation ctx(false, key, nonce);
+
+    int len = 0;
+    if (aadLen > 0 && EVP_DecryptUpdate(ctx.get(), nullptr, &len, aad, aadLen) != 1)
+        throw runtime_error("EVP_DecryptUpdate (aad) failed");
+    if (inLen > 0 && EVP_DecryptUpdate(ctx.get(), out, &len, in, inLen) != 1)
+        throw runtime_error("EVP_DecryptUpdate failed");
+    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, GCM_TAGLEN, const_cast<unsigned char*>(tag)) != 1)
+        throw runtime_error("EVP_CIPHER_CTX_ctrl (set tag) failed");
+    if (EVP_DecryptFinal_ex(ctx.get(), out + (inLen > 0 ? len : 0), &len) != 1)
+        throw runtime_error("EVP_DecryptFinal_ex failed (authentication failed)");
+    ctx.finish();
+}
+
+string rsa_encrypt(RSA *rsa, string_view data) {
+    string encrypted(RSA_size(rsa), '\0');
+    int len = RSA_public_encrypt(data.size(), reinterpret_cast<const unsigned char*>(data.data()),
+                                 reinterpret_cast<unsigned char*>(&encrypted[0]), rsa, RSA_PKCS1_OAEP_PADDING);
     if (len == -1)
         throw runtime_error("RSA_public_encrypt failed");
-    return string(reinterpret_cast<char*>(encrypted.data()), len);
+    encrypted.resize(len);
+    return encrypted;
 }
 
-string rsa_decrypt(RSA *rsa, const string &data) {
-    int rsa_size = RSA_size(rsa);
-    vector<unsigned char> decrypted(rsa_size);
-    int len = RSA_private_decrypt(data.size(), reinterpret_cast<const unsigned char*>(data.data()), decrypted.data(), rsa, RSA_PKCS1_OAEP_PADDING);
-    if (len == -1)
+string rsa_decrypt(RSA *rsa, string_view data) {
+    string decrypted(RSA_size(rsa), '\0');
+    int len = RSA_private_decrypt(data.size(), reinterpret_cast<const unsigned char*>(data.data()),
+                                  reinterpret_cast<unsigned char*>(&decrypted[0]), rsa, RSA_PKCS1_OAEP_PADDING);
+    if (len == -1) {
+        OPENSSL_cleanse(&decrypted[0], decrypted.size());
         throw runtime_error("RSA_private_decrypt failed");
-    return string(reinterpret_cast<char*>(decrypted.data()), len);
+    }
+    decrypted.resize(len);
+    return decrypted;
 }
 
 RSA* load_public_key(const string &path) {
@@ -180,44 +402,25 @@ string generateRandomPassphrase() {
 
 // Challenge-response authentication: encrypt a test string with the public key and decrypt it with the private key.
 bool authenticateUser(const string &username,
-                      const string &publicKeyPath,
-                      const string &privateKeyPath,
-                      const string &passphrase) {
+                      RSA *publicKey,
+                      RSA *privateKey) {
     const string testStr = "test_challenge";
 
-    // Load public key from the given file.
-    RSA* rsa_pub = load_public_key(publicKeyPath);
-    if (!rsa_pub) {
-        cerr << "Failed to load public key from " << publicKeyPath << "\n";
-        return false;
-    }
-
     string encrypted;
     try {
-        encrypted = rsa_encrypt(rsa_pub, testStr);
+        encrypted = rsa_encrypt(publicKey, testStr);
     } catch (const exception &ex) {
         cerr << "RSA encryption failed: " << ex.what() << "\n";
-        RSA_free(rsa_pub);
-        return false;
-    }
-    RSA_free(rsa_pub);
-
-    // Load private key from the protected keyfiles folder.
-    RSA* rsa_priv = load_private_key(privateKeyPath, passphrase);
-    if (!rsa_priv) {
-        cerr << "Failed to load private key from " << privateKeyPath << "\n";
         return false;
     }
 
     string decrypted;
     try {
-        decrypted = rsa_decrypt(rsa_priv, encrypted);
+        decrypted = rsa_decrypt(privateKey, encrypted);
     } catch (const exception &ex) {
         cerr << "RSA decryption failed: " << ex.what() << "\n";
-        RSA_free(rsa_priv);
         return false;
     }
-    RSA_free(rsa_priv);
 
     return (decrypted == testStr);
 }
@@ -229,39 +432,24 @@ string deriveKeyFromPassword(const string &password) {
     return string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
 }
 
-bool verifyKeyPair(const string &publicKeyPath,
-                   const string &privateKeyPath,
-                   const string &passphrase) {
+bool verifyKeyPair(RSA *publicKey,
+                   RSA *privateKey) {
     const string testStr = "verify_keypair";
-    RSA* rsaPub = load_public_key(publicKeyPath);
-    if (!rsaPub) {
-        cerr << "Failed to load public key from " << publicKeyPath << endl;
-        return false;
-    }
     string encrypted;
     try {
-        encrypted = rsa_encrypt(rsaPub, testStr);
+        encrypted = rsa_encrypt(publicKey, testStr);
     } catch (const exception &ex) {
         cerr << "Encryption failed: " << ex.what() << endl;
-        RSA_free(rsaPub);
         return false;
     }
-    RSA_free(rsaPub);
 
-    RSA* rsaPriv = load_private_key(privateKeyPath, passphrase);
-    if (!rsaPriv) {
-        cerr << "Failed to load private key from " << privateKeyPath << endl;
-        return false;
-    }
     string decrypted;
     try {
-        decrypted = rsa_decrypt(rsaPriv, encrypted);
+        decrypted = rsa_decrypt(privateKey, encrypted);
     } catch (const exception &ex) {
         cerr << "Decryption failed: " << ex.what() << endl;
-        RSA_free(rsaPriv);
         return false;
     }
-    RSA_free(rsaPriv);
 
     return (decrypted == testStr);
 }
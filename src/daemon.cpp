@@ -0,0 +1,382 @@
+#include "daemon.h"
+#include "session.h"
+#include "shell.h"
+#include "envelope_store.h"
+#include "fs_utils.h"
+#include "thread_pool.h"
+
+#include <openssl/crypto.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Longest request line accepted; mkfile carries the file contents on its line.
+static const size_t kMaxLineLen = 1 << 20;
+// Logins spend most of their time in RSA operations, so even on a small machine a few
+// workers keep one slow login from holding up everyone else's commands.
+static const size_t kMinWorkers = 4;
+// A client that stops reading its replies is dropped after this long.
+static const int kSendTimeoutSec = 30;
+
+static volatile sig_atomic_t gStopRequested = 0;
+static int gWakeFd = -1;
+
+static void requestStop(int) {
+    gStopRequested = 1;
+    ssize_t n = write(gWakeFd, "s", 1);
+    (void)n;
+}
+
+// Helper: trim whitespace.
+static string trim(const string &s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if(start == string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+static void wipe(string &secret) {
+    if (!secret.empty())
+        OPENSSL_cleanse(&secret[0], secret.size());
+    secret.clear();
+}
+
+// Same resolution as the command-line argument: the file name without directory
+// or ".pem", looked up in public_keys/.
+static string loginPublicKeyPath(string name) {
+    size_t lastSlash = name.find_last_of('/');
+    if (lastSlash != string::npos)
+        name = name.substr(lastSlash + 1);
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".pem") == 0)
+        name = name.substr(0, name.size() - 4);
+    return "public_keys/" + name + ".pem";
+}
+
+enum class LoginStage { Username, Passphrase, PublicKey, LoggedIn };
+
+// One connection. 'input', 'busy' and 'hungUp' belong to the polling thread; the rest
+// belongs to the worker running the client's current line (there is at most one).
+struct DaemonClient {
+    int fd;
+    string input;          // received bytes not yet handed to a worker
+    bool busy;
+    bool hungUp;
+
+    LoginStage stage;
+    string username;
+    string passphrase;
+    UserSession session;
+    string base;
+    string currentRelative;
+    size_t seq;
+    bool finished;         // close once the current reply is sent
+
+    explicit DaemonClient(int fd)
+        : fd(fd), busy(false), hungUp(false), stage(LoginStage::Username), seq(0), finished(false) {}
+    ~DaemonClient() {
+        wipe(input);
+        wipe(passphrase);
+        close(fd);
+    }
+};
+
+static void login(DaemonClient &client, const string &keyName, string &reply) {
+    const string &username = client.username;
+    bool ok = !username.empty() && username.find('/') == string::npos && !client.passphrase.empty() &&
+              openUserSession(username, client.passphrase, loginPublicKeyPath(keyName), client.session);
+    wipe(client.passphrase);
+    if (ok) {
+        client.base = username == "admin" ? "filesystem" : "filesystem/" + username;
+        ok = directoryExists(client.base);
+    }
+    if (!ok) {
+        reply = "%login status=error\n";
+        client.finished = true;
+        return;
+    }
+    client.stage = LoginStage::LoggedIn;
+    reply = "%login status=ok user=" + username + "\n";
+}
+
+// Runs on a worker: advances the login or runs one command, then sends the reply.
+static void handleLine(DaemonClient &client, string &line) {
+    string reply;
+    switch (client.stage) {
+    case LoginStage::Username:
+        client.username = trim(line);
+        client.stage = LoginStage::Passphrase;
+        break;
+    case LoginStage::Passphrase:
+        client.passphrase = trim(line);
+        client.stage = LoginStage::PublicKey;
+        break;
+    case LoginStage::PublicKey:
+        login(client, trim(line), reply);
+        break;
+    case LoginStage::LoggedIn: {
+        string command = trim(line);
+        if (command.empty() || command[0] == '#')
+            break;
+        ostringstream out;
+        CommandStatus status = runScriptCommand(out, command, client.base, client.currentRelative,
+                                                client.session, client.seq + 1);
+        if (status == CommandStatus::Exit) {
+            client.finished = true;
+            break;
+        }
+        client.seq++;
+        reply = out.str();
+        break;
+    }
+    }
+    if (!reply.empty() && !writeFull(client.fd, reply.data(), reply.size()))
+        client.finished = true;
+}
+
+static int openListenSocket(const string &socketPath) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(addr.sun_path)) {
+        cerr << "Invalid socket path " << socketPath << endl;
+        return -1;
+    }
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+
+    // Replace a socket left behind by a previous run, but nothing else.
+    struct stat st;
+    if (lstat(socketPath.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            cerr << socketPath << " exists and is not a socket" << endl;
+            return -1;
+        }
+        unlink(socketPath.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        cerr << "Cannot create socket: " << strerror(errno) << endl;
+        return -1;
+    }
+    mode_t oldMask = umask(0077);
+    int bound = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    umask(oldMask);
+    if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+        cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+class Daemon {
+public:
+    Daemon(int listenFd, int wakeRead, int wakeWrite, size_t workers)
+        : listenFd_(listenFd), wakeRead_(wakeRead), wakeWrite_(wakeWrite), pool_(workers) {}
+
+    void run();
+    // Lets every running line finish and closes all connections.
+    void shutdown();
+
+private:
+    void acceptClients();
+    void receive(const shared_ptr<DaemonClient> &client);
+    void dispatch(const shared_ptr<DaemonClient> &client);
+    void collectFinished();
+    void drop(const DaemonClient &client) { clients_.erase(client.fd); }
+
+    int listenFd_;
+    int wakeRead_;
+    int wakeWrite_;
+    ThreadPool pool_;
+    map<int, shared_ptr<DaemonClient>> clients_;
+
+    mutex doneLock_;
+    vector<int> done_;     // clients whose line a worker has finished
+};
+
+void Daemon::run() {
+    vector<pollfd> fds;
+    vector<shared_ptr<DaemonClient>> polled;
+    while (!gStopRequested) {
+        fds.clear();
+        polled.clear();
+        fds.push_back(pollfd{listenFd_, POLLIN, 0});
+        fds.push_back(pollfd{wakeRead_, POLLIN, 0});
+        // Busy clients aren't read from until their line is done, so a client that
+        // floods requests only fills its socket buffer.
+        for (auto &entry : clients_) {
+            if (entry.second->busy)
+                continue;
+            fds.push_back(pollfd{entry.first, POLLIN, 0});
+            polled.push_back(entry.second);
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            cerr << "poll failed: " << strerror(errno) << endl;
+            break;
+        }
+        if (fds[1].revents)
+            collectFinished();
+        if (fds[0].revents)
+            acceptClients();
+        for (size_t i = 0; i < polled.size(); i++)
+            if (fds[i + 2].revents)
+                receive(polled[i]);
+    }
+}
+
+void Daemon::shutdown() {
+    pool_.wait();
+    clients_.clear();
+}
+
+void Daemon::acceptClients() {
+    while (true) {
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                cerr << "accept failed: " << strerror(errno) << endl;
+            return;
+        }
+        timeval timeout{kSendTimeoutSec, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        clients_[fd] = make_shared<DaemonClient>(fd);
+    }
+}
+
+void Daemon::receive(const shared_ptr<DaemonClient> &client) {
+    char buf[64 * 1024];
+    while (true) {
+        ssize_t n = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            client->input.append(buf, n);
+            if (client->input.size() > kMaxLineLen)
+                break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            client->hungUp = true;
+        break;
+    }
+    dispatch(client);
+}
+
+// Hands the next complete line of an idle client to a worker. A client that hung up
+// still gets its remaining lines run (the last one may lack its newline) and is
+// closed after them.
+void Daemon::dispatch(const shared_ptr<DaemonClient> &client) {
+    string &input = client->input;
+    size_t end = input.find('\n');
+    if (end == string::npos) {
+        if (input.size() > kMaxLineLen || (client->hungUp && input.empty())) {
+            drop(*client);
+            return;
+        }
+        if (!client->hungUp)
+            return;
+        end = input.size();
+    }
+    string line = input.substr(0, end);
+    OPENSSL_cleanse(&input[0], min(end + 1, input.size()));
+    input.erase(0, min(end + 1, input.size()));
+
+    client->busy = true;
+    pool_.submit([this, client, line]() mutable {
+        handleLine(*client, line);
+        wipe(line);
+        {
+            lock_guard<mutex> guard(doneLock_);
+            done_.push_back(client->fd);
+        }
+        ssize_t n = write(wakeWrite_, "d", 1);
+        (void)n;
+    });
+}
+
+void Daemon::collectFinished() {
+    char buf[256];
+    while (read(wakeRead_, buf, sizeof(buf)) > 0) {}
+    vector<int> done;
+    {
+        lock_guard<mutex> guard(doneLock_);
+        done.swap(done_);
+    }
+    for (int fd : done) {
+        auto it = clients_.find(fd);
+        if (it == clients_.end())
+            continue;
+        shared_ptr<DaemonClient> client = it->second;
+        client->busy = false;
+        if (client->finished)
+            drop(*client);
+        else
+            dispatch(client);
+    }
+}
+
+bool runDaemon(const string &socketPath, size_t workers) {
+    int wake[2];
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+        cerr << "Cannot create wake-up pipe: " << strerror(errno) << endl;
+        return false;
+    }
+    int listenFd = openListenSocket(socketPath);
+    if (listenFd < 0) {
+        close(wake[0]);
+        close(wake[1]);
+        return false;
+    }
+
+    // Replies to a client that went away must fail the write, not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    gWakeFd = wake[1];
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = requestStop;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+
+    if (workers == 0)
+        workers = max<size_t>(kMinWorkers, thread::hardware_concurrency());
+    cout << "Listening on " << socketPath << " with " << workers << " workers" << endl;
+    {
+        Daemon daemon(listenFd, wake[0], wake[1], workers);
+        daemon.run();
+        close(listenFd);
+        unlink(socketPath.c_str());
+        daemon.shutdown();
+    }
+    flushEnvelopeStores();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    gWakeFd = -1;
+    close(wake[0]);
+    close(wake[1]);
+    cout << "Daemon stopped" << endl;
+    return true;
+}
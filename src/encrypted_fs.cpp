@@ -10,35 +10,213 @@
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <string_view>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 
-// Write a file with encryption.
-// The file format is: [4 bytes keyLen][4 bytes ivLen][encrypted AES key][encrypted IV][AES-encrypted file content]
-bool encryptedWriteFile(const string &path, const string &plaintext, const string &ownerUsername, const string &ownerDerivedKey, const string &globalSharingKey) {
-    // Load owner's public key (stored outside the filesystem as "<ownerUsername>_keyfile.pem").
-    string publicKeyPath = "public_keys/" + ownerUsername + "_keyfile.pem";
-    RSA* rsa = load_public_key(publicKeyPath);
-    if (!rsa) {
-        cerr << "Failed to load public key for " << ownerUsername << endl;
-        return false;
+// Segmented file format (version 2):
+//   [4 bytes magic "BFSG"][1 byte version][1 byte reserved][2 bytes escrow length (BE)]
+//   [4 bytes segment size (BE)][4 bytes reserved][escrow slot]
+//   followed by segments of [ciphertext (<= segment size)][16 byte GCM tag].
+// The escrow slot holds the file's key/IV wrapped with admin's public key, so admin can
+// read every file without any per-file metadata. Version 1 files have no escrow slot.
+// The whole header is authenticated as AAD of every segment. Files that start with the
+// legacy "GCM" prefix are single-message aes_encrypt() output and are still readable.
+static const char kSegmentMagic[4] = {'B', 'F', 'S', 'G'};
+static const unsigned char kSegmentFormatVersion = 2;
+static const size_t kSegmentHeaderLen = 16; // fixed part, before the escrow slot
+static const size_t kMaxSegmentSize = 16 * 1024 * 1024;
+static const size_t kMaxEscrowLen = 1024;
+// Sealed segments collected per pwrite() when writing (about 1 MiB).
+static const size_t kWriteBatchSegments = 16;
+// Ciphertext fetched per pread() when reading.
+static const size_t kReadBatchBytes = 1024 * 1024;
+
+enum SegmentHeaderStatus { kNotSegmented, kSegmentHeaderOk, kSegmentHeaderBad };
+
+static string buildSegmentHeader(uint32_t segmentSize, const string &escrow) {
+    unsigned char fixed[kSegmentHeaderLen];
+    memset(fixed, 0, kSegmentHeaderLen);
+    memcpy(fixed, kSegmentMagic, sizeof(kSegmentMagic));
+    fixed[4] = kSegmentFormatVersion;
+    fixed[6]  = static_cast<unsigned char>(escrow.size() >> 8);
+    fixed[7]  = static_cast<unsigned char>(escrow.size());
+    fixed[8]  = static_cast<unsigned char>(segmentSize >> 24);
+    fixed[9]  = static_cast<unsigned char>(segmentSize >> 16);
+    fixed[10] = static_cast<unsigned char>(segmentSize >> 8);
+    fixed[11] = static_cast<unsigned char>(segmentSize);
+    return string(reinterpret_cast<char*>(fixed), kSegmentHeaderLen) + escrow;
+}
+
+// Parses the header at the start of 'file'. 'header' is set to the raw header bytes
+// (the AAD, pointing into 'file') and 'escrow' to a copy of the escrow slot.
+static SegmentHeaderStatus parseSegmentHeader(string_view file, string_view &header,
+                                              uint32_t &segmentSize, string &escrow) {
+    const unsigned char *fixed = reinterpret_cast<const unsigned char*>(file.data());
+    if (file.size() < kSegmentHeaderLen || memcmp(fixed, kSegmentMagic, sizeof(kSegmentMagic)) != 0)
+        return kNotSegmented;
+    unsigned char version = fixed[4];
+    size_t escrowLen = (size_t(fixed[6]) << 8) | fixed[7];
+    if (version != 1 && version != kSegmentFormatVersion) {
+        cerr << "Unsupported encrypted file version: " << (int)version << endl;
+        return kSegmentHeaderBad;
     }
-    // Generate random AES key and IV.
-    unsigned char aes_key[AES_KEYLEN], aes_iv[AES_IVLEN];
-    if (!generate_aes_key_iv(aes_key, aes_iv)) {
-        RSA_free(rsa);
+    segmentSize = (uint32_t(fixed[8]) << 24) | (uint32_t(fixed[9]) << 16) |
+                  (uint32_t(fixed[10]) << 8) | uint32_t(fixed[11]);
+    if (segmentSize == 0 || segmentSize > kMaxSegmentSize) {
+        cerr << "Invalid segment size in encrypted file header." << endl;
+        return kSegmentHeaderBad;
+    }
+    if ((version == 1 && escrowLen != 0) || escrowLen > kMaxEscrowLen ||
+        file.size() < kSegmentHeaderLen + escrowLen) {
+        cerr << "Invalid escrow slot in encrypted file header." << endl;
+        return kSegmentHeaderBad;
+    }
+    header = file.substr(0, kSegmentHeaderLen + escrowLen);
+    escrow.assign(header.data() + kSegmentHeaderLen, escrowLen);
+    return kSegmentHeaderOk;
+}
+
+// Pull from 'source' until 'buf' holds 'cap' bytes or the source is exhausted.
+static long fillSegment(const ChunkSource &source, unsigned char *buf, size_t cap) {
+    size_t filled = 0;
+    while (filled < cap) {
+        long n = source(reinterpret_cast<char*>(buf) + filled, cap - filled);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        filled += n;
+    }
+    return static_cast<long>(filled);
+}
+
+// Recover the clear AES key/IV of 'path' for the session user, either from the user's own
+// RSA envelope or from a shared envelope wrapped with the global sharing key.
+// Admin opens the escrow slot of the file header directly, without any metadata lookup.
+static bool unwrapFileKey(const string &path, const UserSession &session, const string &escrow, string &keyIV) {
+    if (session.isAdmin && !escrow.empty()) {
+        if (unwrapAdminEscrow(session.privateKey, escrow, keyIV))
+            return true;
+        cerr << "Admin escrow slot of " << path << " could not be opened" << endl;
+    }
+
+    string envelope;
+    bool isShared = false;
+    // First, try to get the envelope from the user's own metadata.
+    if (!findUserEnvelope(session.username, path, session.derivedKey, envelope)) {
+        // If not found, try the shared envelope.
+        if (!findUserSharedEnvelope(session.username, path, session.globalSharingKey, envelope)) {
+            cerr << "No envelope found for " << session.username << " for file " << path << endl;
+            return false;
+        }
+        isShared = true;
+    }
+
+    if (!isShared) {
+        // For owner's envelope: use RSA decryption with the session's unlocked key.
+        try {
+            keyIV = rsa_decrypt(session.privateKey, envelope);
+        } catch (const exception &ex) {
+            cerr << "RSA decryption failed: " << ex.what() << endl;
+            return false;
+        }
+    } else {
+        // For shared envelope: the envelope is symmetrically encrypted using the global sharing key.
+        try {
+            aes_decrypt_blob(envelope, reinterpret_cast<const unsigned char*>(session.globalSharingKey.data()), keyIV);
+        } catch (const exception &ex) {
+            cerr << "AES decryption of shared envelope failed: " << ex.what() << endl;
+            return false;
+        }
+    }
+
+    if (keyIV.size() != AES_KEYLEN + AES_IVLEN) {
+        cerr << "Invalid key/IV length." << endl;
         return false;
     }
-    // Encrypt plaintext with AES.
-    string encryptedContent;
-    try {
-        encryptedContent = aes_encrypt(plaintext, aes_key, aes_iv);
-    } catch (const exception &ex) {
-        cerr << "AES encryption failed: " << ex.what() << endl;
-        RSA_free(rsa);
+    return true;
+}
+
+bool recoverFileKey(const string &path, const UserSession &session, string &keyIV) {
+    return unwrapFileKey(path, session, "", keyIV);
+}
+
+// Opens an unnamed file in the directory of 'path' to stage new contents in, so the old
+// ones stay intact until the new ones are complete.
+static int openStagingFile(const string &path) {
+    size_t slash = path.find_last_of('/');
+    string dir = slash == string::npos ? "." : path.substr(0, slash);
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+    if (fd >= 0)
+        return fd;
+#endif
+    // No O_TMPFILE here: a named file that is unlinked at once.
+    string tmpPath = path + ".XXXXXX";
+    fd = mkstemp(&tmpPath[0]);
+    if (fd < 0)
+        return -1;
+    unlink(tmpPath.c_str());
+    fchmod(fd, 0644);
+    return fd;
+}
+
+// Puts the 'size' staged bytes in place at 'path'. A new file gets the staging inode
+// itself; an existing one, which may be hard-linked into shared/ folders, is
+// overwritten in place so every link sees the new contents.
+static bool installStagedFile(int staged, uint64_t size, const string &path) {
+#ifdef O_TMPFILE
+    string stagedPath = "/proc/self/fd/" + to_string(staged);
+    if (linkat(AT_FDCWD, stagedPath.c_str(), AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0)
+        return true;
+#endif
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
         return false;
+    loff_t in = 0, out = 0;
+    bool ok = true;
+    while (ok && static_cast<uint64_t>(in) < size) {
+        ssize_t n = copy_file_range(staged, &in, fd, &out, size - in, 0);
+        if (n > 0 || (n < 0 && errno == EINTR))
+            continue;
+        if (n == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)) {
+            ok = false;
+            break;
+        }
+        // Not supported between these files: copy through a buffer.
+        vector<char> buffer(kReadBatchBytes);
+        while (ok && static_cast<uint64_t>(in) < size) {
+            long got = preadFull(staged, buffer.data(), min<uint64_t>(buffer.size(), size - in), in);
+            ok = got > 0 && pwriteFull(fd, buffer.data(), got, out);
+            in += max(got, 0L);
+            out += max(got, 0L);
+        }
     }
+    ok = ok && ftruncate(fd, static_cast<off_t>(size)) == 0;
+    return close(fd) == 0 && ok;
+}
+
+// Write a file with encryption using the segmented format above.
+bool encryptedWriteStream(const string &path, const ChunkSource &source, const UserSession &owner,
+                          uint64_t sizeHint) {
+    const string &ownerUsername = owner.username;
+    const string &ownerDerivedKey = owner.derivedKey;
+    const string &globalSharingKey = owner.globalSharingKey;
+    // Generate random AES key and IV.
+    unsigned char aes_key[AES_KEYLEN], aes_iv[AES_IVLEN];
+    if (!generate_aes_key_iv(aes_key, aes_iv))
+        return false;
 
     // Create the envelope: concatenate AES key and IV.
     string keyIV(reinterpret_cast<char*>(aes_key), AES_KEYLEN);
@@ -47,20 +225,92 @@ bool encryptedWriteFile(const string &path, const string &plaintext, const strin
     // explicit copy
     string clearIV = keyIV;
 
-    // RSA-wrap the envelope for the owner.
+    // RSA-wrap the envelope for the owner with the session's public key.
     string envelope;
     try {
-        envelope = rsa_encrypt(rsa, keyIV);
+        envelope = rsa_encrypt(owner.publicKey, keyIV);
     } catch (const exception &ex) {
         cerr << "RSA encryption failed: " << ex.what() << endl;
-        RSA_free(rsa);
         return false;
     }
-    RSA_free(rsa);
 
-    // Write the AES-encrypted file content.
-    if (!writeFile(path, encryptedContent))
+    // Escrow the key for admin in the file header: O(1) per write, no shared metadata.
+    string escrow;
+    if (!wrapAdminEscrow(clearIV, escrow)) {
+        cerr << "Warning: failed to update admin access for file: " << path << endl;
         return false;
+    }
+
+    // Write the AES-encrypted file content, one segment at a time, into a staging file:
+    // a source, sealing or write error leaves the old contents (and the envelope that
+    // opens them) untouched. Only a complete file is put in place.
+    int fd = openStagingFile(path);
+    if (fd < 0)
+        return false;
+    const string header = buildSegmentHeader(ENC_SEGMENT_SIZE, escrow);
+    const unsigned char *aad = reinterpret_cast<const unsigned char*>(header.data());
+    if (sizeHint > 0) {
+        uint64_t segments = (sizeHint + ENC_SEGMENT_SIZE - 1) / ENC_SEGMENT_SIZE;
+        preallocate(fd, header.size() + sizeHint + segments * GCM_TAGLEN);
+    }
+
+    // Sealed segments are staged and written kWriteBatchSegments at a time with pwrite().
+    const size_t stride = ENC_SEGMENT_SIZE + GCM_TAGLEN;
+    vector<unsigned char> staged(header.size() + kWriteBatchSegments * stride);
+    memcpy(staged.data(), header.data(), header.size());
+    size_t stagedLen = header.size();
+    uint64_t fileOffset = 0;
+    bool writeOk = true;
+
+    // Read one segment ahead so the final segment can be flagged as such.
+    vector<unsigned char> current(ENC_SEGMENT_SIZE), next(ENC_SEGMENT_SIZE);
+    long currentLen = fillSegment(source, current.data(), ENC_SEGMENT_SIZE);
+    uint32_t index = 0;
+    try {
+        while (currentLen >= 0) {
+            long nextLen = 0;
+            if (static_cast<size_t>(currentLen) == ENC_SEGMENT_SIZE)
+                nextLen = fillSegment(source, next.data(), ENC_SEGMENT_SIZE);
+            if (nextLen < 0) {
+                currentLen = -1;
+                break;
+            }
+            bool last = (nextLen == 0);
+            unsigned char nonce[GCM_NONCELEN];
+            aes_gcm_segment_nonce(aes_iv, index, last, nonce);
+            unsigned char *sealed = staged.data() + stagedLen;
+            aes_gcm_seal(aes_key, nonce, aad, header.size(),
+                         current.data(), currentLen, sealed, sealed + currentLen);
+            stagedLen += currentLen + GCM_TAGLEN;
+            if (last || staged.size() - stagedLen < stride) {
+                writeOk = pwriteFull(fd, reinterpret_cast<char*>(staged.data()), stagedLen, fileOffset);
+                fileOffset += stagedLen;
+                stagedLen = 0;
+            }
+            if (!writeOk || last)
+                break;
+            if (index == UINT32_MAX) {
+                cerr << "File too large for segmented encryption." << endl;
+                currentLen = -1;
+                break;
+            }
+            current.swap(next);
+            currentLen = nextLen;
+            index++;
+        }
+    } catch (const exception &ex) {
+        cerr << "AES encryption failed: " << ex.what() << endl;
+        close(fd);
+        return false;
+    }
+    // Drop any preallocated space the source did not fill.
+    writeOk = writeOk && currentLen >= 0 && ftruncate(fd, static_cast<off_t>(fileOffset)) == 0;
+    writeOk = writeOk && installStagedFile(fd, fileOffset, path);
+    writeOk = close(fd) == 0 && writeOk;
+    if (currentLen < 0 || !writeOk) {
+        cerr << "Failed to write encrypted file: " << path << endl;
+        return false;
+    }
 
     // Update the owner's metadata (stored in their encrypted envelope metadata file)
     // with the new envelope for this file.
@@ -69,15 +319,6 @@ bool encryptedWriteFile(const string &path, const string &plaintext, const strin
         return false;
     }
 
-    // Now update admin access
-    // Call the function to re-wrap the clear keyIV for admin using the global sharing key.
-    if (ownerUsername != "admin") {
-        if (!updateAdminAccessForFile(ownerUsername, ownerDerivedKey, globalSharingKey, path, clearIV)) {
-            cerr << "Warning: failed to update admin access for file: " << path << endl;
-            return false;
-        }
-    }
-
     if (!updateRecursiveShare(ownerUsername, ownerDerivedKey, path, globalSharingKey, clearIV)) {
         cerr << "Recursive share update failed for file " << path << endl;
     }
@@ -85,74 +326,163 @@ bool encryptedWriteFile(const string &path, const string &plaintext, const strin
     return true;
 }
 
+bool encryptedWriteFile(const string &path, const string &plaintext, const UserSession &owner) {
+    size_t offset = 0;
+    ChunkSource source = [&](char *buf, size_t cap) -> long {
+        size_t n = min(cap, plaintext.size() - offset);
+        memcpy(buf, plaintext.data() + offset, n);
+        offset += n;
+        return static_cast<long>(n);
+    };
+    return encryptedWriteStream(path, source, owner, plaintext.size());
+}
 
-// Read and decrypt a file.
-bool encryptedReadFile(const string &path, string &plaintext, const string &username, const string &passphrase, const string &derivedKey, const string &globalKey) {
 
-    string encryptedContent;
-    if (!readFile(path, encryptedContent))
+// Body of encryptedReadRange on an open file.
+static bool decryptRange(int fd, const string &path, uint64_t offset, uint64_t length,
+                         const ChunkSink &sink, const UserSession &reader) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+    const uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+
+    char head[kSegmentHeaderLen + kMaxEscrowLen];
+    long headLen = preadFull(fd, head, min<uint64_t>(sizeof(head), fileSize), 0);
+    if (headLen < 0)
+        return false;
+    string_view header;
+    string escrow;
+    uint32_t segmentSize = 0;
+    SegmentHeaderStatus status = parseSegmentHeader(string_view(head, headLen), header, segmentSize, escrow);
+    if (status == kSegmentHeaderBad)
         return false;
 
-    string envelope;
-    bool isShared = false;
-    // First, try to get the envelope from the user's own metadata.
-    if (!findUserEnvelope(username, path, derivedKey, envelope)) {
-        // If not found, try the shared envelope.
-        if (!findUserSharedEnvelope(username, path, globalKey, envelope)) {
-            cerr << "No envelope found for " << username << " for file " << path << endl;
-            return false;
-        }
-        isShared = true;
-    }
-    
     string keyIV;
-    if (!isShared) {
-        // For owner's envelope: use RSA decryption.
-        string privateKeyPath = "filesystem/keyfiles/" + username + "_keyfile.pem";
-        RSA* rsa = load_private_key(privateKeyPath, passphrase);
-        if (!rsa) {
-            cerr << "Failed to load private key for " << username << endl;
+    if (!unwrapFileKey(path, reader, escrow, keyIV))
+        return false;
+    const unsigned char *aes_key = reinterpret_cast<const unsigned char*>(keyIV.data());
+    const unsigned char *aes_iv  = reinterpret_cast<const unsigned char*>(keyIV.data() + AES_KEYLEN);
+
+    if (status == kNotSegmented) {
+        // Legacy single-message file: it has to be decrypted as a whole.
+        string ciphertext(fileSize, '\0');
+        long n = preadFull(fd, &ciphertext[0], ciphertext.size(), 0);
+        if (n < 0)
             return false;
-        }
+        ciphertext.resize(n);
+        string plaintext;
         try {
-            keyIV = rsa_decrypt(rsa, envelope);
+            plaintext = aes_decrypt(ciphertext, aes_key, aes_iv);
         } catch (const exception &ex) {
-            cerr << "RSA decryption failed: " << ex.what() << endl;
-            RSA_free(rsa);
+            cerr << "AES decryption failed: " << ex.what() << endl;
             return false;
         }
-        RSA_free(rsa);
+        if (offset >= plaintext.size())
+            return true;
+        return sink(plaintext.data() + offset, min<uint64_t>(length, plaintext.size() - offset));
+    }
+    // Work out the segment count from the file size; the final segment must carry
+    // at least a tag, anything else means the file was truncated mid-segment.
+    const uint64_t stride = uint64_t(segmentSize) + GCM_TAGLEN;
+    uint64_t body = fileSize - header.size();
+    uint64_t segments = (body + stride - 1) / stride;
+    if (segments == 0 || body - (segments - 1) * stride < GCM_TAGLEN || segments - 1 > UINT32_MAX) {
+        cerr << "AES decryption failed: encrypted file is truncated" << endl;
+        return false;
+    }
+    uint64_t plaintextSize = body - segments * GCM_TAGLEN;
+
+    // Clamp the range to the plaintext and map it onto segments.
+    uint64_t end = (length > plaintextSize - min(offset, plaintextSize)) ? plaintextSize : offset + length;
+    uint64_t firstSegment = 0, lastSegment = segments - 1;
+    if (offset < end) {
+        firstSegment = offset / segmentSize;
+        lastSegment = (end - 1) / segmentSize;
+    } else if (end == plaintextSize) {
+        // Empty range at end of file (or an empty file): authenticate the final segment only.
+        firstSegment = lastSegment;
     } else {
-        // For shared envelope: the envelope is symmetrically encrypted using the global sharing key.
-        if (envelope.size() < AES_IVLEN) {
-            cerr << "Shared envelope is too short." << endl;
+        // Empty range inside the file: nothing to read.
+        return true;
+    }
+
+    if (lastSegment > firstSegment)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Per-thread buffers: ciphertext is read a batch of segments (about 1 MiB) per
+    // pread(), and repeated reads make no heap allocation.
+    static thread_local vector<unsigned char> sealedBatch;
+    static thread_local vector<unsigned char> plain;
+    const uint64_t batchSegments = max<uint64_t>(1, kReadBatchBytes / stride);
+    if (sealedBatch.size() < batchSegments * stride)
+        sealedBatch.resize(batchSegments * stride);
+    if (plain.size() < segmentSize)
+        plain.resize(segmentSize);
+    for (uint64_t batchStart = firstSegment; batchStart <= lastSegment; batchStart += batchSegments) {
+        uint64_t batchEnd = min(lastSegment + 1, batchStart + batchSegments);
+        uint64_t batchOffset = header.size() + batchStart * stride;
+        size_t batchLen = static_cast<size_t>(min(fileSize, header.size() + batchEnd * stride) - batchOffset);
+        long got = preadFull(fd, reinterpret_cast<char*>(sealedBatch.data()), batchLen, batchOffset);
+        if (got < 0)
             return false;
-        }
-        string symIV = envelope.substr(0, AES_IVLEN);
-        string symCiphertext = envelope.substr(AES_IVLEN);
-        try {
-            keyIV = aes_decrypt(symCiphertext,
-                                reinterpret_cast<const unsigned char*>(globalKey.data()),
-                                reinterpret_cast<const unsigned char*>(symIV.data()));
-        } catch (const exception &ex) {
-            cerr << "AES decryption of shared envelope failed: " << ex.what() << endl;
+        if (static_cast<size_t>(got) != batchLen) {
+            cerr << "AES decryption failed: encrypted file is truncated" << endl;
             return false;
         }
+        for (uint64_t index = batchStart; index < batchEnd; index++) {
+            bool last = (index == segments - 1);
+            size_t sealedLen = last ? body - index * stride : stride;
+            size_t plainLen = sealedLen - GCM_TAGLEN;
+            const unsigned char *sealed = sealedBatch.data() + (index - batchStart) * stride;
+            unsigned char nonce[GCM_NONCELEN];
+            aes_gcm_segment_nonce(aes_iv, static_cast<uint32_t>(index), last, nonce);
+            try {
+                aes_gcm_open(aes_key, nonce, reinterpret_cast<const unsigned char*>(header.data()), header.size(),
+                             sealed, plainLen, sealed + plainLen, plain.data());
+            } catch (const exception &ex) {
+                cerr << "AES decryption failed: " << ex.what() << endl;
+                return false;
+            }
+            // Emit only the part of this segment that falls inside the range.
+            uint64_t segmentStart = index * segmentSize;
+            uint64_t from = max(offset, segmentStart) - segmentStart;
+            uint64_t to = min(end, segmentStart + plainLen) - segmentStart;
+            if (from < to && !sink(reinterpret_cast<const char*>(plain.data()) + from, to - from))
+                return false;
+        }
     }
-    
-    if (keyIV.size() != AES_KEYLEN + AES_IVLEN) {
-        cerr << "Invalid key/IV length." << endl;
+    return true;
+}
+
+// Read and decrypt the plaintext bytes [offset, offset + length) of a file.
+// Only the segments overlapping the range are read and authenticated; a range that
+// reaches the end of the file always includes the final (flagged) segment, so a
+// truncated file is still detected.
+bool encryptedReadRange(const string &path, uint64_t offset, uint64_t length, const ChunkSink &sink, const UserSession &reader) {
+
+    // The ciphertext is read with pread() into bounded per-thread buffers. It is not
+    // mapped: files are rewritten in place (to keep hard links), and a mapping that
+    // another session truncates would fault instead of failing authentication.
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         return false;
-    }
-    const unsigned char *aes_key = reinterpret_cast<const unsigned char*>(keyIV.data());
-    const unsigned char *aes_iv  = reinterpret_cast<const unsigned char*>(keyIV.data() + AES_KEYLEN);
-    
-    try {
-        plaintext = aes_decrypt(encryptedContent, aes_key, aes_iv);
-    } catch (const exception &ex) {
-        cerr << "AES decryption failed: " << ex.what() << endl;
+    bool ok = decryptRange(fd, path, offset, length, sink, reader);
+    close(fd);
+    return ok;
+}
+
+bool encryptedReadStream(const string &path, const ChunkSink &sink, const UserSession &reader) {
+    return encryptedReadRange(path, 0, UINT64_MAX, sink, reader);
+}
+
+bool encryptedReadFile(const string &path, string &plaintext, const UserSession &reader) {
+    string buffered;
+    ChunkSink sink = [&](const char *data, size_t len) {
+        buffered.append(data, len);
+        return true;
+    };
+    if (!encryptedReadStream(path, sink, reader))
         return false;
-    }
+    plaintext.swap(buffered);
     return true;
 }
 
@@ -160,17 +490,11 @@ bool encryptedReadFile(const string &path, string &plaintext, const string &user
 // Unused: Reads and decrypts a global metadata file (like global_sharing.key or a shared_envelopes.enc file)
 // using the global sharing key. Returns true on success.
 bool readGlobalMetadataFile(const string &path, const string &globalKey, string &plaintext) {
-    string fileData;
-    if (!readFile(path, fileData))
-        return false;
-    if (fileData.size() < AES_IVLEN)
+    MappedFile mapped;
+    if (!mapped.open(path))
         return false;
-    string iv = fileData.substr(0, AES_IVLEN);
-    string ciphertext = fileData.substr(AES_IVLEN);
     try {
-        plaintext = aes_decrypt(ciphertext,
-                                reinterpret_cast<const unsigned char*>(globalKey.data()),
-                                reinterpret_cast<const unsigned char*>(iv.data()));
+        aes_decrypt_blob(mapped.view(), reinterpret_cast<const unsigned char*>(globalKey.data()), plaintext);
     } catch (const exception &ex) {
         cerr << "Global metadata decryption failed: " << ex.what() << endl;
         return false;
@@ -0,0 +1,290 @@
+#include "envelope_store.h"
+#include "shared_metadata.h"
+#include "metadata_lock.h"
+#include "metadata_log.h"
+
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+using namespace std;
+
+// Stores this thread has changed since its last sync point.
+static thread_local unordered_set<EnvelopeStore*> tDirtied;
+
+// Stamp of 'path', or an all-zero stamp if it does not exist.
+static FileStamp stampOf(const string &path) {
+    FileStamp stamp = FileStamp();
+    if (!path.empty() && !getFileStamp(path, stamp))
+        stamp = FileStamp();
+    return stamp;
+}
+
+EnvelopeStore::EnvelopeStore(const string &username, const string &metaPath,
+                             MetadataLoadFn load, MetadataSaveFn save,
+                             const string &journalPath,
+                             MetadataAppendFn append,
+                             MetadataCompactCheckFn needsCompaction)
+    : username_(username), metaPath_(metaPath), load_(load), save_(save),
+      journalPath_(journalPath), append_(append), needsCompaction_(needsCompaction),
+      loaded_(false), stamp_(), journalStamp_(), awaitingCommit_(false), journalPending_(false) {}
+
+void EnvelopeStore::apply(const EnvelopeUpdate &update) {
+    auto it = index_.find(update.filePath);
+    if (update.removed) {
+        if (it == index_.end())
+            return;
+        size_t pos = it->second;
+        index_.erase(it);
+        if (pos != entries_.size() - 1) {
+            entries_[pos] = std::move(entries_.back());
+            index_[entries_[pos].filePath] = pos;
+        }
+        entries_.pop_back();
+        return;
+    }
+    if (it != index_.end()) {
+        entries_[it->second].envelope = update.envelope;
+        return;
+    }
+    index_[update.filePath] = entries_.size();
+    entries_.push_back(EnvelopeEntry{update.filePath, update.envelope});
+}
+
+bool EnvelopeStore::unchangedOnDisk() {
+    return stampOf(metaPath_) == stamp_ && stampOf(journalPath_) == journalStamp_;
+}
+
+void EnvelopeStore::restamp() {
+    stamp_ = stampOf(metaPath_);
+    journalStamp_ = stampOf(journalPath_);
+}
+
+// After a write-back: stamps the files once the write is on disk, which inside a
+// transaction is when it commits. Until then the files still match the old stamps and
+// the table, which is ahead of them, keeps being used. Called with lock_ held.
+void EnvelopeStore::written(bool journal) {
+    if (!metadataTransactionOpen()) {
+        restamp();
+        return;
+    }
+    journalPending_ = journalPending_ || journal;
+    if (awaitingCommit_)
+        return;
+    awaitingCommit_ = true;
+    onMetadataTransactionEnd([this](bool committed) {
+        lock_guard<mutex> guard(lock_);
+        awaitingCommit_ = false;
+        journalPending_ = false;
+        if (committed)
+            restamp();
+        else
+            loaded_ = false;    // the write was dropped; start again from the files
+    });
+}
+
+// (Re)load the table if it was never loaded, the key changed, or the files changed on disk.
+// Callers hold at least a shared MetadataLock on metaPath_.
+bool EnvelopeStore::ensureLoaded(const string &key) {
+    if (loaded_ && key == key_ && unchangedOnDisk())
+        return true;
+
+    if (loaded_ && key != key_ && !dirty_.empty()) {
+        cerr << "Discarding unsaved metadata for " << username_ << " after key change" << endl;
+        dirty_.clear();
+    }
+
+    vector<EnvelopeEntry> entries;
+    if (!load_(username_, key, entries)) {
+        loaded_ = false;
+        return false;
+    }
+    entries_.swap(entries);
+    index_.clear();
+    for (size_t i = 0; i < entries_.size(); i++)
+        index_[entries_[i].filePath] = i;
+    // Updates made in this session but not yet written win over the reloaded copy.
+    for (const auto &pending : dirty_)
+        apply(pending.second);
+
+    key_ = key;
+    loaded_ = true;
+    restamp();
+    return true;
+}
+
+bool EnvelopeStore::find(const string &key, const string &filePath, string &envelope) {
+    MetadataLock fileLock(metaPath_, LockMode::Shared);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (!ensureLoaded(key)) {
+        cerr << "Failed to load metadata for user " << username_ << endl;
+        return false;
+    }
+    auto it = index_.find(filePath);
+    if (it == index_.end())
+        return false;
+    envelope = entries_[it->second].envelope;
+    return true;
+}
+
+bool EnvelopeStore::upsert(const string &key, const string &filePath, const string &envelope) {
+    MetadataLock fileLock(metaPath_, LockMode::Shared);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (!ensureLoaded(key)) {
+        cerr << "Failed to load metadata for user " << username_ << endl;
+        return false;
+    }
+    EnvelopeUpdate update{filePath, envelope, false};
+    apply(update);
+    dirty_[filePath] = update;
+    tDirtied.insert(this);
+    return true;
+}
+
+bool EnvelopeStore::applyBatch(const string &key, const vector<EnvelopeUpdate> &updates) {
+    MetadataLock fileLock(metaPath_, LockMode::Shared);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (!ensureLoaded(key)) {
+        cerr << "Failed to load metadata for user " << username_ << endl;
+        return false;
+    }
+    for (const auto &update : updates) {
+        apply(update);
+        dirty_[update.filePath] = update;
+    }
+    tDirtied.insert(this);
+    return true;
+}
+
+bool EnvelopeStore::remove(const string &key, const string &filePath) {
+    MetadataLock fileLock(metaPath_, LockMode::Shared);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (!ensureLoaded(key)) {
+        cerr << "Failed to load metadata for user " << username_ << endl;
+        return false;
+    }
+    EnvelopeUpdate update{filePath, "", true};
+    apply(update);
+    dirty_[filePath] = update;
+    tDirtied.insert(this);
+    return true;
+}
+
+bool EnvelopeStore::flush() {
+    {
+        lock_guard<mutex> guard(lock_);
+        if (dirty_.empty())
+            return true;
+    }
+    // Other sessions' writes are excluded from the reload below until ours is on disk.
+    MetadataLock fileLock(metaPath_, LockMode::Exclusive);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (dirty_.empty())
+        return true;
+    // Pick up concurrent changes from other sessions before writing.
+    if (!ensureLoaded(key_))
+        return false;
+
+    // The journal is appended to at the size the file has now, so a transaction appends
+    // to it once and rewrites the whole file on later flushes. So does a journal that
+    // has outgrown the snapshot: the rewrite folds it in (compaction).
+    if (append_ && !journalPending_ && !(needsCompaction_ && needsCompaction_(username_))) {
+        vector<EnvelopeUpdate> updates;
+        updates.reserve(dirty_.size());
+        for (const auto &pending : dirty_)
+            updates.push_back(pending.second);
+        if (append_(username_, key_, updates)) {
+            dirty_.clear();
+            written(true);
+            return true;
+        }
+        // Fall back to rewriting the whole file.
+    }
+    if (!save_(username_, key_, entries_))
+        return false;
+    dirty_.clear();
+    written(false);
+    return true;
+}
+
+bool EnvelopeStore::dirty() {
+    lock_guard<mutex> guard(lock_);
+    return !dirty_.empty();
+}
+
+static mutex gStoresLock;
+static map<string, unique_ptr<EnvelopeStore>> gStores;
+
+static EnvelopeStore &storeFor(const string &name, const function<EnvelopeStore*()> &create) {
+    lock_guard<mutex> guard(gStoresLock);
+    unique_ptr<EnvelopeStore> &store = gStores[name];
+    if (!store)
+        store.reset(create());
+    return *store;
+}
+
+EnvelopeStore &userEnvelopeStore(const string &username) {
+    return storeFor("user:" + username, [&] {
+        string metaDir = "filesystem/metadata/" + username;
+        return new EnvelopeStore(username, userMetadataPath(username),
+                                 loadUserMetadata, saveUserMetadata,
+                                 metaDir + "/envelopes.log",
+                                 appendUserMetadataJournal, userMetadataNeedsCompaction);
+    });
+}
+
+EnvelopeStore &sharedEnvelopeStore(const string &username) {
+    return storeFor("shared:" + username, [&] {
+        return new EnvelopeStore(username, sharedMetadataPath(username),
+                                 loadSharedMetadata, saveSharedMetadata);
+    });
+}
+
+bool flushEnvelopeStores() {
+    vector<pair<string, EnvelopeStore*>> stores;
+    {
+        lock_guard<mutex> guard(gStoresLock);
+        for (auto &entry : gStores) {
+            // A command holding metadata locks of its own would need other sessions'
+            // files out of order: it only writes back what it changed itself.
+            if (!metadataLocksHeld() || tDirtied.count(entry.second.get()))
+                stores.push_back(make_pair(entry.first, entry.second.get()));
+        }
+    }
+    tDirtied.clear();
+    // All files to be written are locked at once, in order, rather than one by one
+    // inside flush(): inside a transaction each stays locked until the commit.
+    // A store that gets dirty after this point is written back by the sync point of the
+    // command that changed it, not here, where its file isn't locked.
+    MetadataLock fileLock;
+    vector<pair<string, EnvelopeStore*>> dirtyStores;
+    for (auto &entry : stores) {
+        if (entry.second->dirty()) {
+            fileLock.add(entry.second->metadataPath(), LockMode::Exclusive);
+            dirtyStores.push_back(entry);
+        }
+    }
+    if (!fileLock.lock())
+        return false;
+    bool ok = true;
+    for (auto &entry : dirtyStores) {
+        if (!entry.second->flush()) {
+            cerr << "Failed to write back metadata (" << entry.first << ")" << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,141 @@
+#include "framed_protocol.h"
+#include "shell.h"
+#include "envelope_store.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+using namespace std;
+
+static void putU32(unsigned char *p, uint32_t value) {
+    p[0] = static_cast<unsigned char>(value >> 24);
+    p[1] = static_cast<unsigned char>(value >> 16);
+    p[2] = static_cast<unsigned char>(value >> 8);
+    p[3] = static_cast<unsigned char>(value);
+}
+
+static uint32_t getU32(const unsigned char *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint32_t frameStatus(CommandStatus status) {
+    switch (status) {
+    case CommandStatus::Ok:
+    case CommandStatus::Exit:
+        return 0;
+    case CommandStatus::Failed:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+// Runs the requests of one framed session. Requests are taken in arrival order;
+// read-only ones are submitted to the pool with a copy of the current directory and
+// answered whenever they finish, while any other request first drains the pool and
+// then runs on the reading thread, where it may change the current directory.
+class RequestScheduler {
+public:
+    RequestScheduler(const string &base, const UserSession &session, ostream &out, size_t maxInFlight)
+        : base_(base), session_(session), out_(out), maxInFlight_(max<size_t>(maxInFlight, 1)),
+          inFlight_(0), pool_(0) {}
+    ~RequestScheduler() { drain(); }
+
+    // Returns false once the request was "exit".
+    bool schedule(uint32_t id, const string &line);
+    void drain();
+
+private:
+    void respond(uint32_t id, CommandStatus status, const string &payload);
+
+    const string &base_;
+    const UserSession &session_;
+    ostream &out_;
+    mutex outLock_;
+    string currentRelative_;
+
+    size_t maxInFlight_;
+    mutex lock_;
+    condition_variable changed_;
+    size_t inFlight_;
+    ThreadPool pool_;
+};
+
+bool RequestScheduler::schedule(uint32_t id, const string &line) {
+    if (commandIsReadOnly(line)) {
+        {
+            unique_lock<mutex> guard(lock_);
+            changed_.wait(guard, [this] { return inFlight_ < maxInFlight_; });
+            inFlight_++;
+        }
+        pool_.submit([this, id, line, currentRelative = currentRelative_]() mutable {
+            ostringstream output;
+            CommandStatus status = runCommandLine(output, line, base_, currentRelative, session_);
+            respond(id, status, output.str());
+            {
+                lock_guard<mutex> guard(lock_);
+                inFlight_--;
+            }
+            changed_.notify_all();
+        });
+        return true;
+    }
+    drain();
+    ostringstream output;
+    CommandStatus status = runCommandLine(output, line, base_, currentRelative_, session_);
+    respond(id, status, output.str());
+    return status != CommandStatus::Exit;
+}
+
+void RequestScheduler::drain() {
+    unique_lock<mutex> guard(lock_);
+    changed_.wait(guard, [this] { return inFlight_ == 0; });
+}
+
+void RequestScheduler::respond(uint32_t id, CommandStatus status, const string &payload) {
+    unsigned char header[FRAME_RESPONSE_HEADER_LEN];
+    putU32(header, id);
+    putU32(header + 4, frameStatus(status));
+    putU32(header + 8, static_cast<uint32_t>(payload.size()));
+    lock_guard<mutex> guard(outLock_);
+    out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+    out_.write(payload.data(), payload.size());
+    out_.flush();
+}
+
+bool runFramed(const string &base, const UserSession &session, istream &in, ostream &out,
+               size_t maxInFlight) {
+    bool ok = true;
+    {
+        RequestScheduler scheduler(base, session, out, maxInFlight);
+        unsigned char header[FRAME_HEADER_LEN];
+        string line;
+        while (in.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            uint32_t id = getU32(header);
+            uint32_t length = getU32(header + 4);
+            if (length > FRAME_MAX_PAYLOAD) {
+                cerr << "Request " << id << " is too large (" << length << " bytes)" << endl;
+                ok = false;
+                break;
+            }
+            line.resize(length);
+            if (length > 0 && !in.read(&line[0], length)) {
+                cerr << "Truncated request " << id << endl;
+                ok = false;
+                break;
+            }
+            if (!scheduler.schedule(id, line))
+                break;
+        }
+        if (ok && in.gcount() != 0 && in.eof() && !in.bad()) {
+            cerr << "Truncated request header" << endl;
+            ok = false;
+        }
+    }
+    flushEnvelopeStores();
+    return ok;
+}
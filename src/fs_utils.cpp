@@ -1,12 +1,15 @@
 #include "fs_utils.h"
 #include "crypto_utils.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
-#include <fstream>
+#include <mutex>
 #include <sstream>
 #include <vector>
 #include <iostream>
@@ -66,38 +69,178 @@ bool createDirectories(const string &path) {
     return true;
 }
 
-bool listDirectory(const string &path, vector<string> &entries) {
-    DIR *dir = opendir(path.c_str());
-    if (!dir)
+// Layout of the records returned by getdents64(2).
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const size_t kDirBufferSize = 64 * 1024;
+
+bool DirReader::open(const string &path) {
+    close();
+    fd_ = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return start();
+}
+
+bool DirReader::openAt(int dirFd, const char *name) {
+    close();
+    fd_ = ::openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    return start();
+}
+
+bool DirReader::start() {
+    if (fd_ < 0)
         return false;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        // Skip the "." and ".." entries if you wish, but here we return them.
-        entries.push_back(string(entry->d_name));
+    buf_.resize(kDirBufferSize);
+    pos_ = len_ = 0;
+    failed_ = false;
+    return true;
+}
+
+void DirReader::close() {
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+}
+
+int DirReader::release() {
+    int fd = fd_;
+    fd_ = -1;
+    vector<char>().swap(buf_);
+    return fd;
+}
+
+bool DirReader::next(DirEntry &entry) {
+    if (fd_ < 0)
+        return false;
+    if (pos_ >= len_) {
+        long n;
+        do {
+            n = syscall(SYS_getdents64, fd_, buf_.data(), buf_.size());
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            failed_ = n < 0;
+            return false;
+        }
+        pos_ = 0;
+        len_ = static_cast<size_t>(n);
+    }
+    const LinuxDirent64 *dirent = reinterpret_cast<const LinuxDirent64*>(buf_.data() + pos_);
+    pos_ += dirent->d_reclen;
+    entry.name = string_view(dirent->d_name);
+    switch (dirent->d_type) {
+    case DT_DIR:
+        entry.type = DirEntryType::Directory;
+        break;
+    case DT_REG:
+        entry.type = DirEntryType::File;
+        break;
+    case DT_LNK:
+    case DT_UNKNOWN: {
+        struct stat st;
+        if (fstatat(fd_, dirent->d_name, &st, 0) != 0)
+            entry.type = DirEntryType::Missing;
+        else if (S_ISDIR(st.st_mode))
+            entry.type = DirEntryType::Directory;
+        else
+            entry.type = S_ISREG(st.st_mode) ? DirEntryType::File : DirEntryType::Other;
+        break;
+    }
+    default:
+        entry.type = DirEntryType::Other;
+        break;
     }
-    closedir(dir);
     return true;
 }
 
+bool listDirectory(const string &path, vector<string> &entries) {
+    DirReader reader;
+    if (!reader.open(path))
+        return false;
+    DirEntry entry;
+    while (reader.next(entry))
+        entries.emplace_back(entry.name);
+    return !reader.failed();
+}
+
 bool isDirectory(const string &path) {
     return directoryExists(path);
 }
 
-bool readFile(const string &path, string &contents) {
-    ifstream infile(path);
-    if (!infile)
+bool MappedFile::open(const string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
         return false;
-    ostringstream oss;
-    oss << infile.rdbuf();
-    contents = oss.str();
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ == 0) {
+        // mmap() rejects empty lengths; an empty file is an empty view.
+        static char empty = 0;
+        data_ = &empty;
+        ::close(fd);
+        return true;
+    }
+    void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        size_ = 0;
+        return false;
+    }
+    data_ = static_cast<char*>(mapped);
     return true;
 }
 
-bool writeFile(const string &path, const string &contents) {
-    ofstream outfile(path, ios::trunc);
-    if (!outfile)
+void MappedFile::close() {
+    if (data_ && size_ > 0)
+        munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+}
+
+void MappedFile::adviseSequential() const {
+    if (data_ && size_ > 0)
+        madvise(data_, size_, MADV_SEQUENTIAL);
+}
+
+bool readFile(const string &path, string &contents) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         return false;
-    outfile << contents;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        contents.resize(static_cast<size_t>(st.st_size));
+        long n = readFull(fd, &contents[0], contents.size());
+        ok = n >= 0;
+        if (ok)
+            contents.resize(static_cast<size_t>(n));
+    }
+    close(fd);
+    return ok;
+}
+
+bool writeFile(const string &path, string_view contents) {
+    string tmpPath = path + ".XXXXXX";
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0)
+        return false;
+    fchmod(fd, 0644);
+    preallocate(fd, contents.size());
+    bool ok = pwriteFull(fd, contents.data(), contents.size(), 0);
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
     return true;
 }
 
@@ -109,6 +252,80 @@ bool createHardLink(const string &existing, const string &newLink) {
     return (link(existing.c_str(), newLink.c_str()) == 0);
 }
 
+bool getFileStamp(const string &path, FileStamp &stamp) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    stamp.device = st.st_dev;
+    stamp.inode = st.st_ino;
+    stamp.size = st.st_size;
+    stamp.mtimeNs = int64_t(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+}
+
+long readFull(int fd, char *buf, size_t cap) {
+    size_t filled = 0;
+    while (filled < cap) {
+        ssize_t n = read(fd, buf + filled, cap - filled);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        filled += static_cast<size_t>(n);
+    }
+    return static_cast<long>(filled);
+}
+
+bool writeFull(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+long preadFull(int fd, char *buf, size_t cap, uint64_t offset) {
+    size_t filled = 0;
+    while (filled < cap) {
+        ssize_t n = pread(fd, buf + filled, cap - filled, static_cast<off_t>(offset + filled));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        filled += static_cast<size_t>(n);
+    }
+    return static_cast<long>(filled);
+}
+
+bool pwriteFull(int fd, const char *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+void preallocate(int fd, uint64_t size) {
+    // Mode 0 extends the file size too; callers write every byte or trim with ftruncate().
+    if (size > 0)
+        fallocate(fd, 0, 0, static_cast<off_t>(size));
+}
+
 // Normalize path by handling '.' and '..'.  base is not modified but is the prefix used for absolute paths.
 string normalizePath(const string &base, const string &currentRelative, const string &inputPath) {
     vector<string> tokens;
@@ -5,11 +5,20 @@
 #include "sharing_key_manager.h"
 #include "shared_metadata.h"
 #include "user_metadata.h"
+#include "session.h"
+#include "daemon.h"
+#include "framed_protocol.h"
+#include "metadata_log.h"
+
+#include <openssl/crypto.h>
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <termios.h>
 #include <unistd.h>
 #include "password_utils.h" // Add this line
@@ -52,6 +61,22 @@ static void initializeUserFilesystem(const string &userDir) {
 
 int main(int argc, char* argv[]) {
 
+    // ./fileserver [--batch <file|->|--framed] <public_key_file>
+    string batchScript;
+    bool framed = false;
+    if (argc == 4 && string(argv[1]) == "--batch") {
+        batchScript = argv[2];
+        argv += 2;
+        argc -= 2;
+        // Batch output is read by programs, not people: flush it in large blocks
+        // instead of line by line.
+        setvbuf(stdout, nullptr, _IOFBF, 1 << 16);
+    } else if (argc == 3 && string(argv[1]) == "--framed") {
+        framed = true;
+        argv += 1;
+        argc -= 1;
+    }
+
     // Ensure required directories exist.
     if (!directoryExists("filesystem")) {
         if (!createDirectory("filesystem")) {
@@ -77,6 +102,9 @@ int main(int argc, char* argv[]) {
             return 1;
         }
     }
+    // Before anything reads metadata: finishes what a crashed session left half done.
+    if (!openMetadataLog())
+        return 1;
     
     // Admin creation:
     // If admin does not exist, create admin.
@@ -108,6 +136,28 @@ int main(int argc, char* argv[]) {
         return 0;
     }
     
+    // ./fileserver --daemon <socket_path> [workers]: serve many users over a local socket.
+    if ((argc == 3 || argc == 4) && string(argv[1]) == "--daemon") {
+        size_t workers = 0;
+        if (argc == 4) {
+            char *end = nullptr;
+            workers = strtoul(argv[3], &end, 10);
+            if (*end != '\0' || workers == 0) {
+                cerr << "Invalid worker count " << argv[3] << endl;
+                return 1;
+            }
+        }
+        bool served = runDaemon(argv[2], workers);
+        closeMetadataLog();
+        return served ? 0 : 1;
+    }
+
+    if (argc != 2) {
+        cerr << "Usage: ./fileserver [--batch <file|->|--framed] <public_key_file>" << endl;
+        cerr << "       ./fileserver --daemon <socket_path> [workers]" << endl;
+        return 1;
+    }
+
     // Prompt for login.
     cout << "Enter username: ";
     string username;
@@ -125,71 +175,15 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    // Load the user's private key using the entered passphrase.
-    string userPrivKeyPath = "filesystem/keyfiles/" + username + "_keyfile.pem";
-    RSA* rsa = load_private_key(userPrivKeyPath, userPass);
-    if (!rsa) {
-        cout << "Failed to load your private key. Possibly incorrect user or incorrect passphrase." << endl;
-        return 1;
-    }
-    RSA_free(rsa);
-    
-    // Perform challenge-response authentication.
-    if (argc != 2) {
-        cerr << "Usage: ./fileserver <public_key_file>" << endl;
-        return 1;
-    }
+    // Unlock the user's credentials once: private key, challenge-response against the
+    // presented public key and the global sharing key. Every command reuses them.
     string loginPublicKeyFile = "public_keys/" + get_filename(string(argv[1])) + ".pem";
-    ifstream pubKeyStream(loginPublicKeyFile);
-    if (!pubKeyStream) {
-        cout << "Invalid public key file" << endl;
-        return 1;
-    }
-    string pubKeyContent, line;
-    while (getline(pubKeyStream, line))
-        pubKeyContent += line + "\n";
-    pubKeyStream.close();
-    
-    // Verify if public and private key match
-    if (!verifyKeyPair(loginPublicKeyFile, userPrivKeyPath, userPass)) {
-        cout << "The provided public and private keys do not match." << endl;
-        return 1;
-    }
-    
-    if (!authenticateUser(username, loginPublicKeyFile, userPrivKeyPath, userPass)) {
-        cout << "Authentication failed: public and private keys do not match." << endl;
+    UserSession session;
+    bool opened = openUserSession(username, userPass, loginPublicKeyFile, session);
+    OPENSSL_cleanse(&userPass[0], userPass.size());
+    if (!opened)
         return 1;
-    }
-    
-    // Derive a key from the user's password to decrypt their metadata.
-    string userDerivedKey = deriveKeyFromPassword(userPass);
-    
-    // Ensure the user's metadata directory exists.
-    string metaDir = "filesystem/metadata/" + username;
-    if (!directoryExists(metaDir))
-        createDirectory(metaDir);
-
-    // Global Sharing Key:
-    // For admin, initialize the global key using admin credentials.
-    // For non-admin users, the global key file should already exist wrapped.
-    string globalSharingKey;
-    if (username == "admin") {
-        if (!initGlobalSharingKey("public_keys/admin_keyfile.pem", "filesystem/keyfiles/admin_keyfile.pem", userPass, globalSharingKey)) {
-            cerr << "Failed to initialize global sharing key." << endl;
-            return 1;
-        }
-        // For admin, retrieve the global key by unwrapping it.
-        if (!retrieveGlobalSharingKey("admin", "public_keys/admin_keyfile.pem", "filesystem/keyfiles/admin_keyfile.pem", userPass, globalSharingKey)) {
-            cerr << "Failed to retrieve global sharing key for admin." << endl;
-            return 1;
-        }
-    } else {
-        // For non-admin users, retrieve their wrapped copy.
-        if (!retrieveGlobalSharingKey(username, loginPublicKeyFile, userPrivKeyPath, userPass, globalSharingKey)) {
-            cerr << "Failed to retrieve global sharing key for user " << username << endl;
-            return 1;
-        }
-    }
+    const string &userDerivedKey = session.derivedKey;
 
     // Load the user's envelope metadata.
     vector<EnvelopeEntry> userEnvelopes;
@@ -211,11 +205,28 @@ int main(int argc, char* argv[]) {
     }
     
     cout << "Logged in as " << username << endl;
-    cout << "Available commands: cd, pwd, ls, cat, share, mkdir, mkfile, changepass, exit";
-    if (username == "admin")
-        cout << ", adduser";
-    cout << endl;
+    bool ok = true;
+    if (framed) {
+        // Framed requests follow the credentials on standard input (see framed_protocol.h).
+        ok = runFramed(base, session, cin, cout);
+    } else if (batchScript == "-") {
+        // With "-" the script follows the credentials on standard input.
+        ok = runBatch(base, session, cin);
+    } else if (!batchScript.empty()) {
+        ifstream script(batchScript);
+        if (!script) {
+            cerr << "Cannot open batch script " << batchScript << endl;
+            return 1;
+        }
+        ok = runBatch(base, session, script);
+    } else {
+        cout << "Available commands: cd, pwd, ls, find, tree, du, cat, share, mkdir, mkfile, put, get, import, changepass, exit";
+        if (username == "admin")
+            cout << ", adduser, namemode";
+        cout << endl;
 
-    shellLoop(base, (username == "admin"), username, userPass, globalSharingKey, userDerivedKey);
-    return 0;
+        shellLoop(base, session);
+    }
+    closeMetadataLog();
+    return ok ? 0 : 1;
 }
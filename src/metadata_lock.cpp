@@ -0,0 +1,217 @@
+#include "metadata_lock.h"
+#include "metadata_log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+
+using namespace std;
+
+static const char kLockFilePath[] = "filesystem/metadata/.locks";
+static const size_t kLockStripes = 256;
+
+#ifdef F_OFD_SETLK
+static const int kSetLock = F_OFD_SETLK;
+static const int kSetLockWait = F_OFD_SETLKW;
+#else
+// Process-owned locks work as well here: each process holds at most one lock per
+// stripe, because its readers share theirs, and the lock file is never closed.
+static const int kSetLock = F_SETLK;
+static const int kSetLockWait = F_SETLKW;
+#endif
+
+struct LockStripe {
+    shared_mutex holders;     // threads of this process
+    mutex readersLock;
+    size_t readers = 0;       // shared holders in this process; the first takes the file lock
+};
+
+static LockStripe gStripes[kLockStripes];
+static int gLockFd = -1;
+static once_flag gLockFileOnce;
+static thread_local map<size_t, LockMode> tHeld;   // stripes this thread has taken
+static thread_local vector<size_t> tRetained;      // released inside a transaction, held to its end
+
+static bool openLockFile() {
+    call_once(gLockFileOnce, [] {
+        gLockFd = open(kLockFilePath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (gLockFd < 0)
+            cerr << "Cannot open metadata lock file " << kLockFilePath << ": " << strerror(errno) << endl;
+    });
+    return gLockFd >= 0;
+}
+
+// FNV-1a, so every process maps a path to the same stripe.
+static size_t stripeOf(const string &path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : path) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash % kLockStripes;
+}
+
+static bool fileLock(size_t stripe, short type, bool wait) {
+    struct flock region;
+    memset(&region, 0, sizeof(region));
+    region.l_type = type;
+    region.l_whence = SEEK_SET;
+    region.l_start = static_cast<off_t>(stripe);
+    region.l_len = 1;
+    while (fcntl(gLockFd, wait ? kSetLockWait : kSetLock, &region) != 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static bool lockStripe(size_t index, LockMode mode, bool wait) {
+    LockStripe &stripe = gStripes[index];
+    if (mode == LockMode::Exclusive) {
+        if (wait)
+            stripe.holders.lock();
+        else if (!stripe.holders.try_lock())
+            return false;
+        if (!fileLock(index, F_WRLCK, wait)) {
+            stripe.holders.unlock();
+            return false;
+        }
+        return true;
+    }
+    if (wait)
+        stripe.holders.lock_shared();
+    else if (!stripe.holders.try_lock_shared())
+        return false;
+    lock_guard<mutex> guard(stripe.readersLock);
+    if (stripe.readers == 0 && !fileLock(index, F_RDLCK, wait)) {
+        stripe.holders.unlock_shared();
+        return false;
+    }
+    stripe.readers++;
+    return true;
+}
+
+static void unlockStripe(size_t index, LockMode mode) {
+    LockStripe &stripe = gStripes[index];
+    if (mode == LockMode::Exclusive) {
+        fileLock(index, F_UNLCK, false);
+        stripe.holders.unlock();
+        return;
+    }
+    {
+        lock_guard<mutex> guard(stripe.readersLock);
+        if (--stripe.readers == 0)
+            fileLock(index, F_UNLCK, false);
+    }
+    stripe.holders.unlock_shared();
+}
+
+MetadataLock::MetadataLock() : locked_(false) {}
+
+MetadataLock::MetadataLock(const string &path, LockMode mode) : locked_(false) {
+    add(path, mode);
+    lock();
+}
+
+MetadataLock::~MetadataLock() {
+    unlock();
+}
+
+void MetadataLock::add(const string &path, LockMode mode) {
+    size_t stripe = stripeOf(path);
+    auto it = lower_bound(stripes_.begin(), stripes_.end(), make_pair(stripe, LockMode::Shared),
+                          [](const pair<size_t, LockMode> &a, const pair<size_t, LockMode> &b) {
+                              return a.first < b.first;
+                          });
+    if (it != stripes_.end() && it->first == stripe) {
+        if (mode == LockMode::Exclusive)
+            it->second = mode;
+        return;
+    }
+    stripes_.insert(it, make_pair(stripe, mode));
+}
+
+bool MetadataLock::lock() {
+    return acquire(true);
+}
+
+bool MetadataLock::tryLock() {
+    return acquire(false);
+}
+
+// Takes stripes this thread doesn't hold yet. A stripe below one already held, or one
+// held shared that is now wanted exclusive, can't be waited for without risking a
+// deadlock, so it is only tried.
+bool MetadataLock::acquire(bool wait) {
+    if (locked_)
+        return true;
+    if (!openLockFile())
+        return false;
+    for (const auto &request : stripes_) {
+        auto held = tHeld.find(request.first);
+        bool upgrade = held != tHeld.end() && held->second == LockMode::Shared &&
+                       request.second == LockMode::Exclusive;
+        if (held != tHeld.end() && !upgrade) {
+            // A stripe kept for the transaction belongs to whoever locks it next.
+            auto retained = find(tRetained.begin(), tRetained.end(), request.first);
+            if (retained != tRetained.end()) {
+                tRetained.erase(retained);
+                taken_.push_back(request.first);
+            }
+            continue;
+        }
+        bool inOrder = !upgrade && (tHeld.empty() || tHeld.rbegin()->first < request.first);
+        if (!upgrade && lockStripe(request.first, request.second, wait && inOrder)) {
+            tHeld[request.first] = request.second;
+            taken_.push_back(request.first);
+            continue;
+        }
+        if (wait && inOrder)
+            cerr << "Cannot lock metadata: " << strerror(errno) << endl;
+        else if (wait)
+            cerr << "Metadata is busy, try again" << endl;
+        unlock();
+        return false;
+    }
+    locked_ = true;
+    return true;
+}
+
+void MetadataLock::unlock() {
+    bool retain = metadataTransactionOpen();
+    for (auto it = taken_.rbegin(); it != taken_.rend(); ++it) {
+        auto held = tHeld.find(*it);
+        if (held == tHeld.end())
+            continue;
+        if (retain && held->second == LockMode::Exclusive) {
+            tRetained.push_back(held->first);
+            continue;
+        }
+        unlockStripe(held->first, held->second);
+        tHeld.erase(held);
+    }
+    taken_.clear();
+    locked_ = false;
+}
+
+bool metadataLocksHeld() {
+    return !tHeld.empty();
+}
+
+void releaseRetainedMetadataLocks() {
+    for (auto it = tRetained.rbegin(); it != tRetained.rend(); ++it) {
+        auto held = tHeld.find(*it);
+        if (held == tHeld.end())
+            continue;
+        unlockStripe(held->first, held->second);
+        tHeld.erase(held);
+    }
+    tRetained.clear();
+}
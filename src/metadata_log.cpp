@@ -0,0 +1,528 @@
+#include "metadata_log.h"
+#include "fs_utils.h"
+#include "metadata_lock.h"
+
+#include <openssl/sha.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+
+using namespace std;
+
+static const char kLogPath[] = "filesystem/metadata/.wal";
+
+// Record layout: "MWAL" magic, 1 byte type, 4 byte payload length (BE), the payload and
+// a SHA-256 of everything before it, so a record cut short by a crash is recognized.
+// A commit record holds a 4 byte change count and the changes, each
+// [1 byte kind][4 byte path length][path][8 byte offset][4 byte data length][data];
+// done and abort records hold the 8 byte log offset of the commit record they close.
+static const char kRecordMagic[4] = {'M', 'W', 'A', 'L'};
+static const size_t kRecordHeaderLen = sizeof(kRecordMagic) + 1 + 4;
+static const unsigned char kRecordCommit = 1;
+static const unsigned char kRecordDone = 2;     // the changes have been applied
+static const unsigned char kRecordAbort = 3;    // the log sync failed; nothing was applied
+
+// Byte-range locks on the log file itself. Appends and checkpoints hold the first byte
+// exclusively. Every process holds the second one shared while it has the log open,
+// so a process that gets it exclusively knows nobody else is mid-transaction.
+static const off_t kAppendLockByte = 0;
+static const off_t kOpenLockByte = 1;
+
+// Try to empty the log whenever it has grown past this.
+static const uint64_t kCheckpointBytes = 4 * 1024 * 1024;
+
+#ifdef F_OFD_SETLK
+static const int kSetLock = F_OFD_SETLK;
+static const int kSetLockWait = F_OFD_SETLKW;
+#else
+// The log is only ever read through the descriptor that holds the locks, and that is
+// never closed, so process-owned locks hold up as well.
+static const int kSetLock = F_SETLK;
+static const int kSetLockWait = F_SETLKW;
+#endif
+
+struct MetadataLog {
+    int fd = -1;
+    mutex lock;                     // appends, reads, checkpoints and the counters below
+    condition_variable synced;
+    uint64_t appended = 0;          // commit records this process has appended
+    uint64_t durable = 0;           // how many of them a finished fdatasync covers
+    uint64_t failed = 0;            // how many of them a failed fdatasync covered
+    bool syncing = false;
+    uint64_t checkpointAt = kCheckpointBytes;
+};
+
+static MetadataLog gLog;
+static thread_local MetadataTransaction *tOpen = nullptr;
+
+struct LogRecord {
+    unsigned char type;
+    uint64_t offset;
+    string payload;
+};
+
+static bool lockByte(off_t byte, short type, bool wait) {
+    struct flock region;
+    memset(&region, 0, sizeof(region));
+    region.l_type = type;
+    region.l_whence = SEEK_SET;
+    region.l_start = byte;
+    region.l_len = 1;
+    while (fcntl(gLog.fd, wait ? kSetLockWait : kSetLock, &region) != 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static void putU32(string &out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>(value >> shift));
+}
+
+static void putU64(string &out, uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>(value >> shift));
+}
+
+static uint64_t getBigEndian(const char *p, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+        value = (value << 8) | static_cast<unsigned char>(p[i]);
+    return value;
+}
+
+static bool encodeChanges(const vector<MetadataChange> &changes, string &payload) {
+    putU32(payload, static_cast<uint32_t>(changes.size()));
+    for (const auto &change : changes) {
+        if (change.path.size() > UINT32_MAX || change.data.size() > UINT32_MAX)
+            return false;
+        payload.push_back(static_cast<char>(change.kind));
+        putU32(payload, static_cast<uint32_t>(change.path.size()));
+        payload += change.path;
+        putU64(payload, change.offset);
+        putU32(payload, static_cast<uint32_t>(change.data.size()));
+        payload += change.data;
+    }
+    return true;
+}
+
+static bool decodeChanges(const string &payload, vector<MetadataChange> &changes) {
+    size_t pos = 0;
+    auto take = [&](size_t bytes) {
+        if (payload.size() - pos < bytes)
+            return false;
+        pos += bytes;
+        return true;
+    };
+    if (!take(4))
+        return false;
+    uint64_t count = getBigEndian(payload.data(), 4);
+    changes.clear();
+    for (uint64_t i = 0; i < count; i++) {
+        MetadataChange change;
+        if (!take(5))
+            return false;
+        change.kind = static_cast<MetadataChangeKind>(payload[pos - 5]);
+        size_t pathLen = getBigEndian(payload.data() + pos - 4, 4);
+        if (!take(pathLen))
+            return false;
+        change.path = payload.substr(pos - pathLen, pathLen);
+        if (!take(12))
+            return false;
+        change.offset = getBigEndian(payload.data() + pos - 12, 8);
+        size_t dataLen = getBigEndian(payload.data() + pos - 4, 4);
+        if (!take(dataLen))
+            return false;
+        change.data = payload.substr(pos - dataLen, dataLen);
+        changes.push_back(std::move(change));
+    }
+    return pos == payload.size();
+}
+
+static string makeRecord(unsigned char type, const string &payload) {
+    string record(kRecordMagic, sizeof(kRecordMagic));
+    record.push_back(static_cast<char>(type));
+    putU32(record, static_cast<uint32_t>(payload.size()));
+    record += payload;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(record.data()), record.size(), hash);
+    record.append(reinterpret_cast<char*>(hash), sizeof(hash));
+    return record;
+}
+
+// Appends a record at the end of the log and returns where it starts. A failed write
+// is cut off again, so no damaged record sits in front of later ones.
+// Caller holds gLog.lock.
+static bool appendRecord(const string &record, uint64_t &offset) {
+    if (!lockByte(kAppendLockByte, F_WRLCK, true))
+        return false;
+    struct stat st;
+    bool ok = fstat(gLog.fd, &st) == 0;
+    if (ok) {
+        offset = static_cast<uint64_t>(st.st_size);
+        ok = pwriteFull(gLog.fd, record.data(), record.size(), offset);
+        if (!ok && ftruncate(gLog.fd, st.st_size) != 0)
+            cerr << "Cannot cut damaged record from metadata log" << endl;
+    }
+    lockByte(kAppendLockByte, F_UNLCK, false);
+    return ok;
+}
+
+// Reads every intact record. A damaged one (the tail a crashed process was writing) is
+// skipped up to the next record that checks out. Caller holds gLog.lock.
+static bool readLog(vector<LogRecord> &records, uint64_t &size) {
+    records.clear();
+    struct stat st;
+    if (fstat(gLog.fd, &st) != 0 || lseek(gLog.fd, 0, SEEK_SET) != 0)
+        return false;
+    string data(static_cast<size_t>(st.st_size), '\0');
+    long n = readFull(gLog.fd, &data[0], data.size());
+    if (n < 0)
+        return false;
+    data.resize(static_cast<size_t>(n));
+    size = data.size();
+
+    string_view magic(kRecordMagic, sizeof(kRecordMagic));
+    size_t pos = 0;
+    while (pos + kRecordHeaderLen + SHA256_DIGEST_LENGTH <= data.size()) {
+        size_t payloadLen = getBigEndian(data.data() + pos + sizeof(kRecordMagic) + 1, 4);
+        size_t bodyLen = kRecordHeaderLen + payloadLen;
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        bool intact = data.compare(pos, magic.size(), magic) == 0 &&
+                      data.size() - pos >= bodyLen + SHA256_DIGEST_LENGTH;
+        if (intact) {
+            SHA256(reinterpret_cast<const unsigned char*>(data.data() + pos), bodyLen, hash);
+            intact = memcmp(hash, data.data() + pos + bodyLen, sizeof(hash)) == 0;
+        }
+        if (!intact) {
+            size_t next = data.find(magic.data(), pos + 1, magic.size());
+            if (next == string::npos)
+                break;
+            pos = next;
+            continue;
+        }
+        records.push_back(LogRecord{static_cast<unsigned char>(data[pos + sizeof(kRecordMagic)]), pos,
+                                    data.substr(pos + kRecordHeaderLen, payloadLen)});
+        pos += bodyLen + SHA256_DIGEST_LENGTH;
+    }
+    return true;
+}
+
+static void createParentDirectory(const string &path) {
+    size_t slash = path.find_last_of('/');
+    if (slash != string::npos && slash > 0 && !directoryExists(path.substr(0, slash)))
+        createDirectories(path.substr(0, slash));
+}
+
+// Applying a change twice leaves the same result as applying it once. On replay a
+// link whose source has gone since is skipped, and missing directories are recreated.
+static bool applyChange(const MetadataChange &change, bool replay) {
+    if (replay && change.kind != MetadataChangeKind::Remove)
+        createParentDirectory(change.path);
+    switch (change.kind) {
+    case MetadataChangeKind::Write:
+        return writeFile(change.path, change.data);
+    case MetadataChangeKind::WriteAt: {
+        int fd = open(change.path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = pwriteFull(fd, change.data.data(), change.data.size(), change.offset) &&
+                  ftruncate(fd, static_cast<off_t>(change.offset + change.data.size())) == 0;
+        return close(fd) == 0 && ok;
+    }
+    case MetadataChangeKind::Remove:
+        return unlink(change.path.c_str()) == 0 || errno == ENOENT;
+    case MetadataChangeKind::Link: {
+        struct stat source, target;
+        if (stat(change.data.c_str(), &source) != 0)
+            return replay;
+        if (lstat(change.path.c_str(), &target) == 0) {
+            if (target.st_dev == source.st_dev && target.st_ino == source.st_ino)
+                return true;
+            unlink(change.path.c_str());
+        }
+        return createHardLink(change.data, change.path);
+    }
+    }
+    return false;
+}
+
+// Empties the log once every transaction in it has been applied: syncfs() puts the
+// changed files on disk, after which their records are no longer needed.
+// Caller holds gLog.lock.
+static bool checkpointLog() {
+    if (!lockByte(kAppendLockByte, F_WRLCK, true))
+        return false;
+    vector<LogRecord> records;
+    uint64_t size = 0;
+    bool ok = readLog(records, size);
+    if (ok && size > 0) {
+        set<uint64_t> unfinished;
+        for (const auto &record : records) {
+            if (record.type == kRecordCommit)
+                unfinished.insert(record.offset);
+            else if (record.payload.size() == 8)
+                unfinished.erase(getBigEndian(record.payload.data(), 8));
+        }
+        ok = unfinished.empty() && syncfs(gLog.fd) == 0 && ftruncate(gLog.fd, 0) == 0;
+    }
+    lockByte(kAppendLockByte, F_UNLCK, false);
+    return ok;
+}
+
+// Replays every logged transaction except aborted ones, in log order, and empties the
+// log. Applied ones are replayed too: after a power loss their changes may not have
+// reached the disk even though their done record did. Only called while this process
+// holds the log alone. Caller holds gLog.lock.
+static void recoverLog() {
+    vector<LogRecord> records;
+    uint64_t size = 0;
+    if (!readLog(records, size) || size == 0)
+        return;
+    set<uint64_t> applied, aborted;
+    for (const auto &record : records) {
+        if (record.type == kRecordCommit || record.payload.size() != 8)
+            continue;
+        uint64_t commitOffset = getBigEndian(record.payload.data(), 8);
+        (record.type == kRecordDone ? applied : aborted).insert(commitOffset);
+    }
+    size_t interrupted = 0;
+    bool ok = true;
+    vector<MetadataChange> changes;
+    for (const auto &record : records) {
+        if (record.type != kRecordCommit || aborted.count(record.offset))
+            continue;
+        if (!decodeChanges(record.payload, changes)) {
+            cerr << "Skipping malformed metadata log record at " << record.offset << endl;
+            continue;
+        }
+        if (!applied.count(record.offset))
+            interrupted++;
+        for (const auto &change : changes) {
+            if (!applyChange(change, true)) {
+                cerr << "Cannot replay metadata change to " << change.path << ": " << strerror(errno) << endl;
+                ok = false;
+            }
+        }
+    }
+    if (interrupted > 0)
+        cerr << "Completed " << interrupted << " interrupted metadata transaction(s)" << endl;
+    // A log that could not be replayed in full is kept for the next attempt.
+    if (ok && syncfs(gLog.fd) == 0 && ftruncate(gLog.fd, 0) != 0)
+        cerr << "Cannot empty metadata log: " << strerror(errno) << endl;
+}
+
+// Returns once commit record number 'ticket' is on disk. The first waiter syncs the
+// log for everyone who appended before it started; the others wait for that sync, or
+// for the next one if they appended while it ran.
+static bool waitDurable(uint64_t ticket) {
+    unique_lock<mutex> guard(gLog.lock);
+    while (true) {
+        // A sync that failed may have dropped the record's pages; later ones don't help.
+        if (gLog.failed >= ticket)
+            return false;
+        if (gLog.durable >= ticket)
+            return true;
+        if (gLog.syncing) {
+            gLog.synced.wait(guard);
+            continue;
+        }
+        gLog.syncing = true;
+        uint64_t target = gLog.appended;
+        guard.unlock();
+        bool ok = fdatasync(gLog.fd) == 0;
+        guard.lock();
+        gLog.syncing = false;
+        if (ok)
+            gLog.durable = max(gLog.durable, target);
+        else
+            gLog.failed = max(gLog.failed, target);
+        gLog.synced.notify_all();
+    }
+}
+
+// Logs, syncs and applies 'changes'. False if they could not be made durable (nothing
+// was changed) or applying them failed.
+static bool commitChanges(const vector<MetadataChange> &changes) {
+    if (gLog.fd < 0) {
+        cerr << "Metadata log is not open" << endl;
+        return false;
+    }
+    string payload;
+    if (!encodeChanges(changes, payload)) {
+        cerr << "Metadata transaction is too large" << endl;
+        return false;
+    }
+    string record = makeRecord(kRecordCommit, payload);
+    uint64_t offset = 0;
+    uint64_t ticket;
+    {
+        lock_guard<mutex> guard(gLog.lock);
+        if (!appendRecord(record, offset)) {
+            cerr << "Cannot write metadata log: " << strerror(errno) << endl;
+            return false;
+        }
+        ticket = ++gLog.appended;
+    }
+    string commitRef;
+    putU64(commitRef, offset);
+
+    bool synced = waitDurable(ticket);
+    bool ok = synced;
+    if (!synced)
+        cerr << "Cannot sync metadata log" << endl;
+    for (size_t i = 0; synced && i < changes.size(); i++) {
+        if (!applyChange(changes[i], false)) {
+            cerr << "Cannot update " << changes[i].path << ": " << strerror(errno) << endl;
+            ok = false;
+            break;
+        }
+    }
+
+    lock_guard<mutex> guard(gLog.lock);
+    uint64_t closedAt = 0;
+    if (appendRecord(makeRecord(synced ? kRecordDone : kRecordAbort, commitRef), closedAt) &&
+        closedAt >= gLog.checkpointAt) {
+        // Records of transactions still running elsewhere keep the log from being
+        // emptied; look again once it has grown some more.
+        gLog.checkpointAt = checkpointLog() ? kCheckpointBytes : closedAt * 2;
+    }
+    return ok;
+}
+
+MetadataTransaction *MetadataTransaction::outermost(MetadataTransaction *transaction) {
+    while (transaction->outer_)
+        transaction = transaction->outer_;
+    return transaction;
+}
+
+MetadataTransaction::MetadataTransaction() : outer_(tOpen), mark_(0), endersMark_(0), finished_(false) {
+    if (outer_) {
+        MetadataTransaction *root = outermost(outer_);
+        mark_ = root->changes_.size();
+        endersMark_ = root->enders_.size();
+    }
+    tOpen = this;
+}
+
+MetadataTransaction::~MetadataTransaction() {
+    if (!finished_) {
+        if (outer_) {
+            // Drop what this transaction added; the outer ones go on.
+            MetadataTransaction *root = outermost(outer_);
+            root->changes_.resize(min(mark_, root->changes_.size()));
+            vector<function<void(bool)>> enders(root->enders_.begin() + min(endersMark_, root->enders_.size()),
+                                                root->enders_.end());
+            root->enders_.resize(min(endersMark_, root->enders_.size()));
+            for (auto &ender : enders)
+                ender(false);
+        } else {
+            changes_.clear();
+            end(false);
+        }
+    }
+    tOpen = outer_;
+}
+
+void MetadataTransaction::add(MetadataChange change) {
+    outermost(this)->changes_.push_back(std::move(change));
+}
+
+void MetadataTransaction::end(bool committed) {
+    vector<function<void(bool)>> enders;
+    enders.swap(enders_);
+    for (auto &ender : enders)
+        ender(committed);
+    releaseRetainedMetadataLocks();
+}
+
+bool MetadataTransaction::commit() {
+    if (finished_)
+        return true;
+    finished_ = true;
+    if (outer_)
+        return true;
+    vector<MetadataChange> changes;
+    changes.swap(changes_);
+    bool ok = changes.empty() || commitChanges(changes);
+    end(ok);
+    return ok;
+}
+
+bool metadataTransactionOpen() {
+    return tOpen != nullptr;
+}
+
+void onMetadataTransactionEnd(function<void(bool committed)> ender) {
+    if (!tOpen) {
+        ender(true);
+        return;
+    }
+    MetadataTransaction::outermost(tOpen)->enders_.push_back(std::move(ender));
+}
+
+static bool logChange(MetadataChangeKind kind, const string &path, string_view data, uint64_t offset) {
+    MetadataTransaction transaction;
+    transaction.add(MetadataChange{kind, path, string(data), offset});
+    return transaction.commit();
+}
+
+bool logWriteFile(const string &path, string_view contents) {
+    return logChange(MetadataChangeKind::Write, path, contents, 0);
+}
+
+bool logWriteAt(const string &path, uint64_t offset, string_view data) {
+    return logChange(MetadataChangeKind::WriteAt, path, data, offset);
+}
+
+bool logRemoveFile(const string &path) {
+    return logChange(MetadataChangeKind::Remove, path, "", 0);
+}
+
+bool logHardLink(const string &existing, const string &newLink) {
+    return logChange(MetadataChangeKind::Link, newLink, existing, 0);
+}
+
+bool openMetadataLog() {
+    lock_guard<mutex> guard(gLog.lock);
+    if (gLog.fd >= 0)
+        return true;
+    gLog.fd = open(kLogPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (gLog.fd < 0) {
+        cerr << "Cannot open metadata log " << kLogPath << ": " << strerror(errno) << endl;
+        return false;
+    }
+    // Alone with the log, nothing can be mid-transaction: replay what a crash left.
+    // Others that start meanwhile wait below until the replay is done.
+    if (lockByte(kOpenLockByte, F_WRLCK, false))
+        recoverLog();
+    if (!lockByte(kOpenLockByte, F_RDLCK, true)) {
+        cerr << "Cannot lock metadata log: " << strerror(errno) << endl;
+        close(gLog.fd);
+        gLog.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void closeMetadataLog() {
+    lock_guard<mutex> guard(gLog.lock);
+    if (gLog.fd < 0 || checkpointLog())
+        return;
+    // What keeps the log from being emptied was left by a process that died mid-way;
+    // the last one to leave replays it.
+    if (lockByte(kOpenLockByte, F_WRLCK, false)) {
+        recoverLog();
+        lockByte(kOpenLockByte, F_RDLCK, false);
+    }
+}
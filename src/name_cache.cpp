@@ -0,0 +1,264 @@
+#include "name_cache.h"
+#include "fs_utils.h"
+#include "metadata_lock.h"
+#include "metadata_log.h"
+#include "utils.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+static const char kNameModePath[] = "filesystem/metadata/name_mode";
+
+// Longest directory entry most filesystems accept; an encrypted name is the hex of
+// SIV + ciphertext, so plain names of up to 111 bytes fit.
+static const size_t kMaxDiskNameLen = 255;
+// Both maps are dropped once either grows past this many names.
+static const size_t kMaxCachedNames = 16384;
+
+const char *nameModeName(NameMode mode) {
+    return mode == NameMode::Siv ? "siv" : "plain";
+}
+
+bool parseNameMode(const string &name, NameMode &mode) {
+    if (name == "plain")
+        mode = NameMode::Plain;
+    else if (name == "siv")
+        mode = NameMode::Siv;
+    else
+        return false;
+    return true;
+}
+
+// Reads the mode and the stamp of the file it came from (all zero if there is none).
+static NameMode readNameMode(FileStamp &stamp) {
+    NameMode mode = NameMode::Plain;
+    MetadataLock fileLock(kNameModePath, LockMode::Shared);
+    stamp = FileStamp();
+    string contents;
+    if (!getFileStamp(kNameModePath, stamp) || !readFile(kNameModePath, contents)) {
+        stamp = FileStamp();
+        return mode;
+    }
+    size_t end = contents.find_first_of(" \t\r\n");
+    if (!parseNameMode(contents.substr(0, end), mode))
+        cerr << "Unknown name mode in " << kNameModePath << ", using plain names" << endl;
+    return mode;
+}
+
+NameMode loadNameMode() {
+    FileStamp stamp;
+    return readNameMode(stamp);
+}
+
+// True if no user has anything in their personal/ or shared/ directory.
+static bool userTreesEmpty() {
+    vector<string> users;
+    if (!listDirectory("filesystem", users))
+        return false;
+    for (const auto &user : users) {
+        if (user == "." || user == ".." || user == "metadata" || user == "keyfiles")
+            continue;
+        for (const char *area : {"/personal", "/shared"}) {
+            vector<string> entries;
+            string dir = "filesystem/" + user + area;
+            if (!directoryExists(dir))
+                continue;
+            if (!listDirectory(dir, entries))
+                return false;
+            for (const auto &entry : entries)
+                if (entry != "." && entry != "..")
+                    return false;
+        }
+    }
+    return true;
+}
+
+bool storeNameMode(NameMode mode) {
+    // Held from the check to the write, so two sessions can't both find the trees
+    // empty and record different modes.
+    MetadataLock fileLock(kNameModePath, LockMode::Exclusive);
+    if (!fileLock.locked())
+        return false;
+    if (loadNameMode() == mode)
+        return true;
+    if (!userTreesEmpty()) {
+        cerr << "Name mode can only change while all user directories are empty" << endl;
+        return false;
+    }
+    return logWriteFile(kNameModePath, string(nameModeName(mode)) + "\n");
+}
+
+static vector<string> splitPath(const string &path) {
+    vector<string> parts;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t slash = path.find('/', start);
+        if (slash == string::npos)
+            slash = path.size();
+        parts.push_back(path.substr(start, slash - start));
+        start = slash + 1;
+    }
+    return parts;
+}
+
+// Index of the first encrypted component of a path split at '/', or 0 if nothing in
+// it is encrypted: filesystem/<user>/personal/<names...> and
+// filesystem/<user>/shared/<owner>/<names...>.
+static size_t firstEncryptedIndex(const vector<string> &parts) {
+    if (parts.size() < 3 || parts[0] != "filesystem" || parts[1] == "metadata" || parts[1] == "keyfiles")
+        return 0;
+    if (parts[2] == "personal")
+        return 3;
+    if (parts[2] == "shared")
+        return 4;
+    return 0;
+}
+
+NameCache::NameCache() : mode_(NameMode::Plain), modeStamp_() {}
+
+void NameCache::init(const string &globalKey) {
+    FileStamp stamp;
+    NameMode mode = readNameMode(stamp);
+    lock_guard<mutex> guard(lock_);
+    globalKey_ = globalKey;
+    mode_ = mode;
+    modeStamp_ = stamp;
+    toDisk_.clear();
+    toPlain_.clear();
+}
+
+// Picks up a mode another session has recorded since it was last read; names cached
+// under the old mode are dropped.
+NameMode NameCache::refreshMode() {
+    FileStamp current = FileStamp();
+    if (!getFileStamp(kNameModePath, current))
+        current = FileStamp();
+    {
+        lock_guard<mutex> guard(lock_);
+        if (current == modeStamp_)
+            return mode_;
+    }
+    FileStamp stamp;
+    NameMode mode = readNameMode(stamp);
+    lock_guard<mutex> guard(lock_);
+    if (mode != mode_) {
+        toDisk_.clear();
+        toPlain_.clear();
+    }
+    mode_ = mode;
+    modeStamp_ = stamp;
+    return mode_;
+}
+
+NameMode NameCache::mode() {
+    return refreshMode();
+}
+
+NameMode NameCache::currentMode() {
+    lock_guard<mutex> guard(lock_);
+    return mode_;
+}
+
+bool NameCache::encrypt(const string &name, string &out) {
+    string key;
+    {
+        lock_guard<mutex> guard(lock_);
+        auto it = toDisk_.find(name);
+        if (it != toDisk_.end()) {
+            out = it->second;
+            return true;
+        }
+        key = globalKey_;
+    }
+    out = encryptName(name, key);
+    if (out.size() > kMaxDiskNameLen) {
+        cerr << "Name too long to store encrypted: " << name << endl;
+        return false;
+    }
+    lock_guard<mutex> guard(lock_);
+    if (toDisk_.size() >= kMaxCachedNames || toPlain_.size() >= kMaxCachedNames) {
+        toDisk_.clear();
+        toPlain_.clear();
+    }
+    toDisk_[name] = out;
+    toPlain_[out] = name;
+    return true;
+}
+
+string NameCache::decrypt(const string &diskName) {
+    string key;
+    {
+        lock_guard<mutex> guard(lock_);
+        auto it = toPlain_.find(diskName);
+        if (it != toPlain_.end())
+            return it->second;
+        key = globalKey_;
+    }
+    string name;
+    try {
+        name = decryptName(diskName, key);
+    } catch (const exception &) {
+        return diskName;
+    }
+    lock_guard<mutex> guard(lock_);
+    if (toDisk_.size() >= kMaxCachedNames || toPlain_.size() >= kMaxCachedNames) {
+        toDisk_.clear();
+        toPlain_.clear();
+    }
+    toPlain_[diskName] = name;
+    toDisk_[name] = diskName;
+    return name;
+}
+
+bool NameCache::diskPath(const string &plainPath, string &out) {
+    if (refreshMode() == NameMode::Plain) {
+        out = plainPath;
+        return true;
+    }
+    vector<string> parts = splitPath(plainPath);
+    size_t first = firstEncryptedIndex(parts);
+    if (first == 0 || parts.size() <= first) {
+        out = plainPath;
+        return true;
+    }
+    out.clear();
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (i > 0)
+            out += '/';
+        string name;
+        if (i < first)
+            out += parts[i];
+        else if (encrypt(parts[i], name))
+            out += name;
+        else
+            return false;
+    }
+    return true;
+}
+
+bool NameCache::diskChild(const string &diskDir, const string &name, string &out) {
+    vector<string> parts = splitPath(diskDir);
+    size_t first = firstEncryptedIndex(parts);
+    if (currentMode() == NameMode::Plain || first == 0 || parts.size() < first) {
+        out = diskDir + "/" + name;
+        return true;
+    }
+    string diskName;
+    if (!encrypt(name, diskName))
+        return false;
+    out = diskDir + "/" + diskName;
+    return true;
+}
+
+string NameCache::plainChild(const string &diskDir, const string &diskName) {
+    if (currentMode() == NameMode::Plain || diskName == "." || diskName == "..")
+        return diskName;
+    vector<string> parts = splitPath(diskDir);
+    size_t first = firstEncryptedIndex(parts);
+    if (first == 0 || parts.size() < first)
+        return diskName;
+    return decrypt(diskName);
+}
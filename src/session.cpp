@@ -0,0 +1,144 @@
+#include "session.h"
+#include "crypto_utils.h"
+#include "sharing_key_manager.h"
+#include "fs_utils.h"
+
+#include <openssl/crypto.h>
+
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+// Size of OpenSSL's secure heap; must be a power of two. Private key BIGNUMs are
+// allocated from it when it is available and fall back to the normal heap otherwise.
+static const size_t kSecureHeapSize = 64 * 1024;
+
+static void initSecureHeap() {
+    static once_flag once;
+    call_once(once, [] {
+        if (CRYPTO_secure_malloc_init(kSecureHeapSize, 32) == 0)
+            cerr << "Warning: secure heap unavailable, private keys stay in regular memory" << endl;
+    });
+}
+
+// Overwrite a secret before its storage is released.
+static void wipe(string &secret) {
+    if (!secret.empty())
+        OPENSSL_cleanse(&secret[0], secret.size());
+    secret.clear();
+}
+
+// Public keys presented at login, parsed once per process and shared by all of its
+// sessions (a daemon serves many logins). An entry is re-read when its file changes.
+struct CachedPublicKey {
+    FileStamp stamp;
+    RSA *key;
+};
+static mutex gPublicKeysLock;
+static map<string, CachedPublicKey> gPublicKeys;
+
+// Returns a new reference to the key in 'path', to be released with RSA_free().
+static RSA *loadLoginPublicKey(const string &path) {
+    FileStamp stamp;
+    if (!getFileStamp(path, stamp))
+        return nullptr;
+    lock_guard<mutex> guard(gPublicKeysLock);
+    CachedPublicKey &cached = gPublicKeys[path];
+    if (!cached.key || !(cached.stamp == stamp)) {
+        RSA *key = load_public_key(path);
+        if (!key)
+            return nullptr;
+        if (cached.key)
+            RSA_free(cached.key);
+        cached.key = key;
+        cached.stamp = stamp;
+    }
+    RSA_up_ref(cached.key);
+    return cached.key;
+}
+
+UserSession::UserSession() : isAdmin(false), privateKey(nullptr), publicKey(nullptr) {}
+
+UserSession::~UserSession() {
+    if (privateKey)
+        RSA_free(privateKey);
+    if (publicKey)
+        RSA_free(publicKey);
+    wipe(derivedKey);
+    wipe(globalSharingKey);
+}
+
+bool openUserSession(const string &username,
+                     const string &passphrase,
+                     const string &loginPublicKeyPath,
+                     UserSession &session) {
+    initSecureHeap();
+
+    // Load the user's private key using the entered passphrase. This is the only
+    // time the PEM passphrase KDF runs for the whole session.
+    string userPrivKeyPath = "filesystem/keyfiles/" + username + "_keyfile.pem";
+    session.privateKey = load_private_key(userPrivKeyPath, passphrase);
+    if (!session.privateKey) {
+        cout << "Failed to load your private key. Possibly incorrect user or incorrect passphrase." << endl;
+        return false;
+    }
+    session.publicKey = RSAPublicKey_dup(session.privateKey);
+
+    RSA *loginPublicKey = loadLoginPublicKey(loginPublicKeyPath);
+    if (!loginPublicKey) {
+        cout << "Invalid public key file" << endl;
+        return false;
+    }
+
+    // Verify if public and private key match
+    if (!verifyKeyPair(loginPublicKey, session.privateKey)) {
+        cout << "The provided public and private keys do not match." << endl;
+        RSA_free(loginPublicKey);
+        return false;
+    }
+
+    // Perform challenge-response authentication.
+    if (!authenticateUser(username, loginPublicKey, session.privateKey)) {
+        cout << "Authentication failed: public and private keys do not match." << endl;
+        RSA_free(loginPublicKey);
+        return false;
+    }
+    RSA_free(loginPublicKey);
+
+    session.username = username;
+    session.isAdmin = (username == "admin");
+
+    // Derive a key from the user's password to decrypt their metadata.
+    session.derivedKey = deriveKeyFromPassword(passphrase);
+
+    // Ensure the user's metadata directory exists.
+    string metaDir = "filesystem/metadata/" + username;
+    if (!directoryExists(metaDir))
+        createDirectory(metaDir);
+
+    // Global Sharing Key:
+    // For admin, initialize the global key using admin credentials.
+    // For non-admin users, the global key file should already exist wrapped.
+    if (session.isAdmin) {
+        if (!initGlobalSharingKey(session.publicKey, session.privateKey, session.globalSharingKey)) {
+            cerr << "Failed to initialize global sharing key." << endl;
+            return false;
+        }
+        // For admin, retrieve the global key by unwrapping it.
+        if (!retrieveGlobalSharingKey("admin", session.privateKey, session.globalSharingKey)) {
+            cerr << "Failed to retrieve global sharing key for admin." << endl;
+            return false;
+        }
+    } else {
+        // For non-admin users, retrieve their wrapped copy.
+        if (!retrieveGlobalSharingKey(username, session.privateKey, session.globalSharingKey)) {
+            cerr << "Failed to retrieve global sharing key for user " << username << endl;
+            return false;
+        }
+    }
+    session.names.init(session.globalSharingKey);
+    return true;
+}
@@ -0,0 +1,322 @@
+#include "share_mapping_store.h"
+#include "crypto_utils.h"
+#include "metadata_lock.h"
+#include "metadata_log.h"
+#include "utils.h"
+
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+// Shard layout (inside IV + AES-GCM, like the other metadata files): "BSHM" magic,
+// 1 byte version, varint source count, then per source a varint-length path and a
+// varint recipient count, each recipient being a varint-length user and target path.
+static const char kShardMagic[4] = {'B', 'S', 'H', 'M'};
+static const unsigned char kShardVersion = 1;
+
+// Single file that held every user's mappings before sharding.
+static const string kLegacyMappingFile = "filesystem/metadata/share_mappings.mapping";
+
+typedef unordered_map<string, vector<ShareTarget>> ShareIndex;
+
+static bool decryptMetadataFile(const string &path, const string &key, string &plaintext) {
+    MappedFile mapped;
+    if (!mapped.open(path))
+        return false;
+    if (mapped.size() < AES_IVLEN) {
+        cerr << "Share mappings file corrupt: too small." << endl;
+        return false;
+    }
+    try {
+        aes_decrypt_blob(mapped.view(), reinterpret_cast<const unsigned char*>(key.data()), plaintext);
+    } catch (const exception &ex) {
+        cerr << "Failed to decrypt share mappings file: " << ex.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+static bool loadShard(const string &path, const string &key, ShareIndex &mappings) {
+    mappings.clear();
+    if (!fileExists(path))
+        return true;
+    string plaintext;
+    if (!decryptMetadataFile(path, key, plaintext))
+        return false;
+    if (plaintext.size() < sizeof(kShardMagic) + 1 ||
+        plaintext.compare(0, sizeof(kShardMagic), kShardMagic, sizeof(kShardMagic)) != 0 ||
+        static_cast<unsigned char>(plaintext[sizeof(kShardMagic)]) != kShardVersion) {
+        cerr << "Unsupported share mappings shard: " << path << endl;
+        return false;
+    }
+    const unsigned char *pos = reinterpret_cast<const unsigned char*>(plaintext.data()) + sizeof(kShardMagic) + 1;
+    const unsigned char *end = reinterpret_cast<const unsigned char*>(plaintext.data()) + plaintext.size();
+    auto readString = [&](string &out) {
+        uint64_t len;
+        if (!getVarint(pos, end, len) || len > uint64_t(end - pos))
+            return false;
+        out.assign(reinterpret_cast<const char*>(pos), len);
+        pos += len;
+        return true;
+    };
+    uint64_t sources;
+    if (!getVarint(pos, end, sources))
+        return false;
+    for (uint64_t i = 0; i < sources; i++) {
+        string source;
+        uint64_t count;
+        if (!readString(source) || !getVarint(pos, end, count) || count > uint64_t(end - pos))
+            return false;
+        vector<ShareTarget> &targets = mappings[source];
+        targets.resize(count);
+        for (auto &target : targets) {
+            if (!readString(target.recipient) || !readString(target.targetFile))
+                return false;
+        }
+    }
+    return pos == end;
+}
+
+static bool saveShard(const string &path, const string &key, const ShareIndex &mappings) {
+    string plaintext(kShardMagic, sizeof(kShardMagic));
+    plaintext.push_back(static_cast<char>(kShardVersion));
+    putVarint(plaintext, mappings.size());
+    for (const auto &mapping : mappings) {
+        putVarint(plaintext, mapping.first.size());
+        plaintext.append(mapping.first);
+        putVarint(plaintext, mapping.second.size());
+        for (const auto &target : mapping.second) {
+            putVarint(plaintext, target.recipient.size());
+            plaintext.append(target.recipient);
+            putVarint(plaintext, target.targetFile.size());
+            plaintext.append(target.targetFile);
+        }
+    }
+
+    unsigned char iv[AES_IVLEN];
+    if (RAND_bytes(iv, AES_IVLEN) != 1) {
+        cerr << "Failed to generate IV for share mappings." << endl;
+        return false;
+    }
+    string blob;
+    try {
+        blob = aes_encrypt_blob(plaintext, reinterpret_cast<const unsigned char*>(key.data()), iv);
+    } catch (const exception &ex) {
+        cerr << "Encryption of share mappings failed: " << ex.what() << endl;
+        return false;
+    }
+    return logWriteFile(path, blob);
+}
+
+static void addTarget(vector<ShareTarget> &targets, const ShareTarget &target) {
+    for (auto &existing : targets) {
+        if (existing.recipient == target.recipient) {
+            // Update target path in case it has changed.
+            existing.targetFile = target.targetFile;
+            return;
+        }
+    }
+    targets.push_back(target);
+}
+
+string shareMappingShardPath(const string &owner) {
+    return "filesystem/metadata/" + owner + "/share_mappings.mapping";
+}
+
+// Parses the old global mapping file ("<source> user:target ..." lines) into per-owner
+// shards. False if there is no legacy file or it can't be read.
+static bool readLegacyShareMappings(const string &key, map<string, ShareIndex> &shards) {
+    shards.clear();
+    if (!fileExists(kLegacyMappingFile))
+        return false;
+    string plaintext;
+    if (!decryptMetadataFile(kLegacyMappingFile, key, plaintext))
+        return false;
+    istringstream iss(plaintext);
+    string line;
+    while (getline(iss, line)) {
+        istringstream lineStream(line);
+        string source, token;
+        if (!(lineStream >> source))
+            continue;
+        string owner = shareMappingOwner(source);
+        if (owner.empty()) {
+            cerr << "Dropping share mapping with unrecognized source: " << source << endl;
+            continue;
+        }
+        vector<ShareTarget> &targets = shards[owner][source];
+        while (lineStream >> token) {
+            size_t pos = token.find(':');
+            if (pos != string::npos)
+                addTarget(targets, ShareTarget{token.substr(0, pos), token.substr(pos + 1)});
+        }
+    }
+    return true;
+}
+
+// Split the old global mapping file into per-owner shards. The owners are found from
+// an unlocked read first, so that the legacy file and all their shards can be locked
+// together; the file is then read again under the lock, which also makes concurrent
+// migrations find nothing left to do.
+void migrateLegacyShareMappings(const string &key) {
+    map<string, ShareIndex> shards;
+    if (!readLegacyShareMappings(key, shards))
+        return;
+    MetadataLock fileLock;
+    fileLock.add(kLegacyMappingFile, LockMode::Exclusive);
+    for (const auto &shard : shards)
+        fileLock.add(shareMappingShardPath(shard.first), LockMode::Exclusive);
+    if (!fileLock.lock() || !readLegacyShareMappings(key, shards))
+        return;
+
+    // All shards and the removal of the legacy file are committed together.
+    MetadataTransaction transaction;
+    for (const auto &shard : shards) {
+        string metaDir = "filesystem/metadata/" + shard.first;
+        if (!directoryExists(metaDir))
+            createDirectory(metaDir);
+        string path = shareMappingShardPath(shard.first);
+        ShareIndex merged;
+        if (!loadShard(path, key, merged))
+            return;
+        for (const auto &mapping : shard.second)
+            for (const auto &target : mapping.second)
+                addTarget(merged[mapping.first], target);
+        if (!saveShard(path, key, merged)) {
+            cerr << "Failed to migrate share mappings for " << shard.first << endl;
+            return;
+        }
+    }
+    transaction.add(MetadataChange{MetadataChangeKind::Remove, kLegacyMappingFile, "", 0});
+    if (!transaction.commit())
+        cerr << "Failed to migrate share mappings" << endl;
+}
+
+ShareMappingStore::ShareMappingStore(const string &owner, const string &shardPath)
+    : owner_(owner), shardPath_(shardPath), loaded_(false), stamp_(), awaitingCommit_(false) {}
+
+// Callers hold at least a shared MetadataLock on shardPath_.
+bool ShareMappingStore::ensureLoaded(const string &key) {
+    FileStamp current = FileStamp();
+    bool exists = getFileStamp(shardPath_, current);
+    if (loaded_ && key == key_ && (exists ? current == stamp_ : stamp_ == FileStamp()))
+        return true;
+    ShareIndex mappings;
+    if (!loadShard(shardPath_, key, mappings)) {
+        loaded_ = false;
+        return false;
+    }
+    mappings_.swap(mappings);
+    key_ = key;
+    stamp_ = exists ? current : FileStamp();
+    loaded_ = true;
+    return true;
+}
+
+bool ShareMappingStore::save() {
+    if (!saveShard(shardPath_, key_, mappings_))
+        return false;
+    // Inside a transaction the shard is written when it commits; the index, which is
+    // ahead of the file until then, is stamped then or dropped if the write is.
+    if (!metadataTransactionOpen()) {
+        restamp();
+    } else if (!awaitingCommit_) {
+        awaitingCommit_ = true;
+        onMetadataTransactionEnd([this](bool committed) {
+            lock_guard<mutex> guard(lock_);
+            awaitingCommit_ = false;
+            if (committed)
+                restamp();
+            else
+                loaded_ = false;
+        });
+    }
+    return true;
+}
+
+void ShareMappingStore::restamp() {
+    if (!getFileStamp(shardPath_, stamp_))
+        stamp_ = FileStamp();
+}
+
+bool ShareMappingStore::recipients(const string &key, const string &sourceFile, vector<ShareTarget> &targets) {
+    targets.clear();
+    migrateLegacyShareMappings(key);
+    MetadataLock fileLock(shardPath_, LockMode::Shared);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (!ensureLoaded(key))
+        return false;
+    auto it = mappings_.find(sourceFile);
+    if (it != mappings_.end())
+        targets = it->second;
+    return true;
+}
+
+bool ShareMappingStore::addRecipient(const string &key, const string &sourceFile, const ShareTarget &target) {
+    migrateLegacyShareMappings(key);
+    // Held from the reload to the rewrite, so no other session's recipient is lost.
+    MetadataLock fileLock(shardPath_, LockMode::Exclusive);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (!ensureLoaded(key))
+        return false;
+    addTarget(mappings_[sourceFile], target);
+    return save();
+}
+
+bool ShareMappingStore::describe(const string &key, string &text) {
+    migrateLegacyShareMappings(key);
+    MetadataLock fileLock(shardPath_, LockMode::Shared);
+    if (!fileLock.locked())
+        return false;
+    lock_guard<mutex> guard(lock_);
+    if (!ensureLoaded(key))
+        return false;
+    vector<string> sources;
+    for (const auto &mapping : mappings_)
+        sources.push_back(mapping.first);
+    sort(sources.begin(), sources.end());
+    ostringstream oss;
+    for (const auto &source : sources) {
+        oss << source;
+        for (const auto &target : mappings_[source])
+            oss << " " << target.recipient << ":" << target.targetFile;
+        oss << "\n";
+    }
+    text = oss.str();
+    return true;
+}
+
+string shareMappingOwner(const string &filePath) {
+    const string prefix = "filesystem/";
+    if (filePath.compare(0, prefix.size(), prefix) != 0)
+        return "";
+    size_t slash = filePath.find('/', prefix.size());
+    if (slash == string::npos || slash == prefix.size())
+        return "";
+    string owner = filePath.substr(prefix.size(), slash - prefix.size());
+    if (owner == "metadata" || owner == "keyfiles")
+        return "";
+    return owner;
+}
+
+ShareMappingStore &shareMappingShard(const string &owner) {
+    static mutex shardsLock;
+    static map<string, unique_ptr<ShareMappingStore>> shards;
+    lock_guard<mutex> guard(shardsLock);
+    unique_ptr<ShareMappingStore> &shard = shards[owner];
+    if (!shard)
+        shard.reset(new ShareMappingStore(owner, shareMappingShardPath(owner)));
+    return *shard;
+}
@@ -2,14 +2,24 @@
 #include "shared_metadata.h"
 #include "fs_utils.h"
 #include "crypto_utils.h"
+#include "envelope_store.h"
+#include "share_mapping_store.h"
+#include "metadata_log.h"
+#include "thread_pool.h"
 
 #include <openssl/rand.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
+#include <unordered_set>
 #include <stdexcept>
 #include <iomanip>
 #include <string>
@@ -19,36 +29,16 @@ using namespace std;
 // For simplicity, we assume AES_IVLEN is defined in crypto_utils.h
 extern const int AES_IVLEN;
 
-static string serializeEntries(const vector<EnvelopeEntry> &entries) {
-    ostringstream oss;
-    for (const auto &entry : entries) {
-        oss << entry.filePath << " " << toHex(entry.envelope) << "\n";
-    }
-    return oss.str();
-}
-
-static bool deserializeEntries(const string &data, vector<EnvelopeEntry> &entries) {
-    istringstream iss(data);
-    string line;
-    while (getline(iss, line)) {
-        if (line.empty()) continue;
-        istringstream linestream(line);
-        EnvelopeEntry entry;
-        if (!(linestream >> entry.filePath >> entry.envelope))
-            return false;
-
-        entry.envelope = fromHex(entry.envelope);
-        entries.push_back(entry);
-    }
-    return true;
+string sharedMetadataPath(const string &username) {
+    return "filesystem/metadata/" + username + "/shared_envelopes.enc";
 }
 
 bool loadSharedMetadata(const string &username,
                         const string &globalKey,
                         vector<EnvelopeEntry> &entries) {
-    string metaPath = "filesystem/metadata/" + username + "/shared_envelopes.enc";
-    string fileData;
-    if (!readFile(metaPath, fileData) || fileData.size() < AES_IVLEN) {
+    string metaPath = sharedMetadataPath(username);
+    MappedFile mapped;
+    if (!mapped.open(metaPath) || mapped.size() < AES_IVLEN) {
         // If the file does not exist or is too small, initialize it with a default entry.
         vector<EnvelopeEntry> defaultEntries;
         EnvelopeEntry defaultEntry;
@@ -58,74 +48,51 @@ bool loadSharedMetadata(const string &username,
             cerr << "Error initializing shared metadata for " << username << endl;
             return false;
         }
-        if (!readFile(metaPath, fileData)) {
-            cerr << "Failed to read shared metadata after initialization for " << username << endl;
-            return false;
-        }
+        // Not read back: inside a metadata transaction the file isn't written yet.
+        entries = defaultEntries;
+        return true;
     }
-    if (fileData.size() < AES_IVLEN) {
+    if (mapped.size() < AES_IVLEN) {
         cerr << "Shared metadata file corrupt (too small)." << endl;
         return false;
     }
     
-    string iv = fileData.substr(0, AES_IVLEN);
-    string ciphertext = fileData.substr(AES_IVLEN);
     string plaintext;
     try {
-        plaintext = aes_decrypt(ciphertext,
-                                reinterpret_cast<const unsigned char*>(globalKey.data()),
-                                reinterpret_cast<const unsigned char*>(iv.data()));
+        aes_decrypt_blob(mapped.view(), reinterpret_cast<const unsigned char*>(globalKey.data()), plaintext);
     } catch (const exception &ex) {
         cerr << "Failed to decrypt shared metadata: " << ex.what() << endl;
         return false;
     }
-    return deserializeEntries(plaintext, entries);
+    return deserializeEnvelopeEntries(plaintext, entries);
 }
 
 bool saveSharedMetadata(const string &username,
                         const string &globalKey,
                         const vector<EnvelopeEntry> &entries) {
-    string metaPath = "filesystem/metadata/" + username + "/shared_envelopes.enc";
-    string plaintext = serializeEntries(entries);
+    string metaPath = sharedMetadataPath(username);
+    string plaintext = serializeEnvelopeEntries(entries);
     unsigned char iv[AES_IVLEN];
     if (RAND_bytes(iv, AES_IVLEN) != 1) {
         cerr << "Failed to generate IV for shared metadata" << endl;
         return false;
     }
-    string ivStr(reinterpret_cast<char*>(iv), AES_IVLEN);
-    string ciphertext;
+    string blob;
     try {
-        ciphertext = aes_encrypt(plaintext,
-                                 reinterpret_cast<const unsigned char*>(globalKey.data()),
-                                 iv);
+        blob = aes_encrypt_blob(plaintext, reinterpret_cast<const unsigned char*>(globalKey.data()), iv);
     } catch (const exception &ex) {
         cerr << "Encryption of shared metadata failed: " << ex.what() << endl;
         return false;
     }
-    return writeFile(metaPath, ivStr + ciphertext);
+    return logWriteFile(metaPath, blob);
 }
 
+// Buffered in the user's shared envelope store; written back at the next flushEnvelopeStores().
 bool updateSharedEnvelopeEntry(const string &username,
                                const string &globalKey,
                                const string &filePath,
                                const string &envelope) {
-    vector<EnvelopeEntry> entries;
-    loadSharedMetadata(username, globalKey, entries);
-    bool found = false;
-    for (auto &entry : entries) {
-        if (entry.filePath == filePath) {
-            entry.envelope = envelope; // envelope should be hex encoded already
-            found = true;
-            break;
-        }
-    }
-    if (!found) {
-        EnvelopeEntry newEntry;
-        newEntry.filePath = filePath;
-        newEntry.envelope = envelope;
-        entries.push_back(newEntry);
-    }
-    return saveSharedMetadata(username, globalKey, entries);
+    return sharedEnvelopeStore(username).upsert(globalKey, filePath, envelope);
 }
 
 
@@ -133,193 +100,141 @@ bool findUserSharedEnvelope(const string &username,
                       const string &filePath,
                       const string &globalKey,
                       string &envelope) {
-    vector<EnvelopeEntry> entries;
-    // Load the user's metadata from the encrypted file.
-    if (!loadSharedMetadata(username, globalKey, entries)) {
-        cerr << "Failed to load metadata for user " << username << endl;
-        return false;
-    }
-    // Iterate over all entries and return the envelope for the matching filePath.
-    for (const auto &entry : entries) {
-        if (entry.filePath == filePath) {
-            envelope = entry.envelope;
-            return true;
-        }
-    }
-    // If no matching entry is found, return false.
-    return false;
+    // Served from the indexed store, which decrypts the metadata file only when it changes.
+    return sharedEnvelopeStore(username).find(globalKey, filePath, envelope);
 }
 
 
-// Updates (or creates) a mapping line for a file so that targetUser is added as a recipient.
-// The file is encrypted with the global key.
-bool updateShareMapping(const string &mappingFilePath,
-                        const string &sourceFile,        // source file path
+// Adds targetUser (and the hard link created for them) as a recipient of sourceFile.
+// Only the shard of sourceFile's owner is rewritten.
+bool updateShareMapping(const string &sourceFile,        // source file path
                         const string &targetUser,
                         const string &targetFile,        // the target file path
                         const string &sharingKey) {
-    // Read existing mapping file.
-    string fileData;
-    if (!readFile(mappingFilePath, fileData))
-        fileData = "";
-    
-    // Decrypt the mapping file if it exists.
-    string plaintext;
-    if (!fileData.empty()) {
-        if (fileData.size() < AES_IVLEN) {
-            cerr << "Share mappings file corrupt: too small." << endl;
-            return false;
-        }
-        string iv = fileData.substr(0, AES_IVLEN);
-        string ciphertext = fileData.substr(AES_IVLEN);
+    string owner = shareMappingOwner(sourceFile);
+    if (owner.empty()) {
+        cerr << "Cannot record share mapping for " << sourceFile << endl;
+        return false;
+    }
+    return shareMappingShard(owner).addRecipient(sharingKey, sourceFile, ShareTarget{targetUser, targetFile});
+}
+
+
+// get the users shared to for the file
+vector<ShareTarget> getSharedRecipientsForFile(const string &filePath,
+                                               const string &sharingKey) {
+    vector<ShareTarget> recipients;
+    string owner = shareMappingOwner(filePath);
+    if (!owner.empty())
+        shareMappingShard(owner).recipients(sharingKey, filePath, recipients);
+    return recipients;
+}
+
+// Envelopes sealed per task when a fan-out is split across the sealing pool.
+static const size_t kSealChunk = 256;
+
+// One pool for every fan-out in the process, so sealing from inside other pools (import
+// workers, daemon clients) doesn't start threads of its own.
+static ThreadPool &sealingPool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+// Wraps 'clearKeyIV' with the global sharing key for every target and groups the
+// updates per recipient, so each recipient's metadata is loaded and changed once
+// however many links they hold. Large fan-outs are sealed in chunks in parallel; the
+// caller applies the updates, on its own thread.
+bool sealSharedEnvelopes(const vector<ShareTarget> &targets,
+                         const string &globalKey,
+                         const string &clearKeyIV,
+                         map<string, vector<EnvelopeUpdate>> &byRecipient) {
+    byRecipient.clear();
+    if (targets.empty())
+        return true;
+
+    // All envelopes wrap the same key under the same global key, so each chunk is sealed
+    // in one batch (which also draws its wrapping IVs in a single RAND_bytes call).
+    vector<string> envelopes(targets.size());
+    atomic<bool> ok(true);
+    auto sealChunk = [&](size_t begin, size_t end) {
+        vector<string> sealed;
         try {
-            plaintext = aes_decrypt(ciphertext,
-                                    reinterpret_cast<const unsigned char*>(sharingKey.data()),
-                                    reinterpret_cast<const unsigned char*>(iv.data()));
+            vector<string_view> plaintexts(end - begin, string_view(clearKeyIV));
+            aes_gcm_encrypt_batch(plaintexts, reinterpret_cast<const unsigned char*>(globalKey.data()),
+                                  nullptr, sealed);
         } catch (const exception &ex) {
-            cerr << "Failed to decrypt share mappings file: " << ex.what() << endl;
-            return false;
-        }
-    }
-    
-    // The mapping is line-based.
-    // Each line: <source_file> recipient1:targetFile1 recipient2:targetFile2 ...
-    istringstream iss(plaintext);
-    vector<string> lines;
-    string line;
-    bool foundLine = false;
-    for (; getline(iss, line); ) {
-        if (!line.empty())
-            lines.push_back(line);
-    }
-    
-    // Try to find an existing mapping for the source file.
-    bool updated = false;
-    for (size_t i = 0; i < lines.size(); i++) {
-        istringstream lineStream(lines[i]);
-        string token;
-        vector<string> tokens;
-        while (lineStream >> token) {
-            tokens.push_back(token);
+            cerr << "Error encrypting shared envelopes: " << ex.what() << endl;
+            ok = false;
+            return;
         }
-        if (!tokens.empty() && tokens[0] == sourceFile) {
-            // Look for targetUser token.
-            bool alreadyPresent = false;
-            for (size_t j = 1; j < tokens.size(); j++) {
-                // Expect token of form "user:targetPath"
-                size_t pos = tokens[j].find(":");
-                if (pos != string::npos) {
-                    string user = tokens[j].substr(0, pos);
-                    if (user == targetUser) {
-                        // Update target path in case it has changed.
-                        tokens[j] = targetUser + ":" + targetFile;
-                        alreadyPresent = true;
-                        updated = true;
-                        break;
-                    }
-                }
-            }
-            if (!alreadyPresent) {
-                tokens.push_back(targetUser + ":" + targetFile);
-                updated = true;
-            }
-            // Reassemble the line.
-            ostringstream oss;
-            for (size_t j = 0; j < tokens.size(); j++) {
-                oss << tokens[j];
-                if (j < tokens.size() - 1)
-                    oss << " ";
-            }
-            lines[i] = oss.str();
-            foundLine = true;
-            break;
+        for (size_t i = begin; i < end; i++)
+            envelopes[i] = move(sealed[i - begin]);
+    };
+
+    if (targets.size() <= kSealChunk) {
+        sealChunk(0, targets.size());
+    } else {
+        mutex doneLock;
+        condition_variable allSealed;
+        size_t remaining = (targets.size() + kSealChunk - 1) / kSealChunk;
+        for (size_t begin = 0; begin < targets.size(); begin += kSealChunk) {
+            size_t end = min(targets.size(), begin + kSealChunk);
+            sealingPool().submit([&, begin, end] {
+                sealChunk(begin, end);
+                lock_guard<mutex> guard(doneLock);
+                if (--remaining == 0)
+                    allSealed.notify_one();
+            });
         }
+        unique_lock<mutex> guard(doneLock);
+        allSealed.wait(guard, [&] { return remaining == 0; });
     }
-    
-    // If no mapping exists for the source file, add a new line.
-    if (!foundLine) {
-        ostringstream oss;
-        oss << sourceFile << " " << targetUser << ":" << targetFile;
-        lines.push_back(oss.str());
-        updated = true;
-    }
-    
-    // Reassemble all lines.
-    ostringstream finalOss;
-    for (const auto &l : lines)
-        finalOss << l << "\n";
-    string newPlaintext = finalOss.str();
-    
-    // Encrypt newPlaintext with the sharing key.
-    unsigned char newIv[AES_IVLEN];
-    if (RAND_bytes(newIv, AES_IVLEN) != 1) {
-        cerr << "Failed to generate IV for share mappings." << endl;
+    if (!ok)
         return false;
-    }
-    string newIvStr(reinterpret_cast<char*>(newIv), AES_IVLEN);
-    string newCiphertext;
-    try {
-        newCiphertext = aes_encrypt(newPlaintext,
-                                    reinterpret_cast<const unsigned char*>(sharingKey.data()),
-                                    newIv);
-    } catch (const exception &ex) {
-        cerr << "Encryption of share mappings failed: " << ex.what() << endl;
-        return false;
-    }
-    string finalData = newIvStr + newCiphertext;
-    return writeFile(mappingFilePath, finalData);
-}
 
+    for (size_t i = 0; i < targets.size(); i++)
+        byRecipient[targets[i].recipient].push_back(
+            EnvelopeUpdate{targets[i].targetFile, move(envelopes[i]), false});
+    return true;
+}
 
-// get the users shread to for the file
-vector<string> getSharedRecipientsForFile(const string &mappingFilePath,
-                                                     const string &filePath,
-                                                     const string &sharingKey) {
-    vector<string> recipients;
-    string fileData;
-    if (!readFile(mappingFilePath, fileData)) {
-        return recipients;
-    }
-    if (fileData.size() < AES_IVLEN) {
-        cerr << "Share mappings file corrupt: too small." << endl;
-        return recipients;
-    }
-    string iv = fileData.substr(0, AES_IVLEN);
-    string ciphertext = fileData.substr(AES_IVLEN);
-    string plaintext;
-    try {
-        plaintext = aes_decrypt(ciphertext,
-                                reinterpret_cast<const unsigned char*>(sharingKey.data()),
-                                reinterpret_cast<const unsigned char*>(iv.data()));
-    } catch (const exception &ex) {
-        cerr << "Failed to decrypt share mappings file: " << ex.what() << endl;
-        return recipients;
-    }
-    istringstream iss(plaintext);
-    string line;
-    while (getline(iss, line)) {
-        if (line.empty())
-            continue;
-        istringstream lineStream(line);
-        vector<string> tokens;
-        string token;
-        while (lineStream >> token) {
-            tokens.push_back(token);
-        }
-        if (!tokens.empty() && tokens[0] == filePath) {
-            // All tokens after the first are recipients.
-            for (size_t i = 1; i < tokens.size(); i++) {
-                recipients.push_back(tokens[i]);
-            }
-            break;
+// Every link reachable from 'filePath' through the share graph: its direct recipients,
+// then the recipients of each re-shared link, and so on for any number of hops. Each
+// link is visited once (so cycles terminate and recipients are not updated twice), and
+// a link that no longer points at the same inode, because it was re-created since the
+// mapping was recorded, is neither updated nor followed.
+static vector<ShareTarget> collectShareClosure(const string &filePath, const string &sharingKey) {
+    vector<ShareTarget> closure;
+    FileStamp origin;
+    bool haveOrigin = getFileStamp(filePath, origin);
+    unordered_set<string> visited;
+    visited.insert(filePath);
+    deque<string> frontier;
+    frontier.push_back(filePath);
+    while (!frontier.empty()) {
+        string node = frontier.front();
+        frontier.pop_front();
+        for (auto &target : getSharedRecipientsForFile(node, sharingKey)) {
+            // Also drops the admin escrow entries of older trees (target == source),
+            // which the file header slot has superseded.
+            if (!visited.insert(target.targetFile).second)
+                continue;
+            FileStamp stamp;
+            if (haveOrigin && (!getFileStamp(target.targetFile, stamp) ||
+                               stamp.device != origin.device || stamp.inode != origin.inode))
+                continue;
+            frontier.push_back(target.targetFile);
+            closure.push_back(std::move(target));
         }
     }
-    return recipients;
+    return closure;
 }
 
 // This function performs a recursive update of shared envelopes for a given file.
-// It looks up all recipients for the file from the share mappings file (encrypted with the global sharing key)
-// and then re–wraps the owner’s current envelope using the global sharing key and updates each recipient's shared metadata.
+// It walks the share graph from the file (see collectShareClosure), reading each owner's
+// mapping shard (encrypted with the global sharing key), re-wraps the file's clear
+// key/IV for every reachable link in one batched fan-out and buffers the envelopes in
+// the recipients' shared stores, written back at the next flushEnvelopeStores().
 bool updateRecursiveShare(const string &owner,
                           const string &ownerDerivedKey,
                           const string &filePath,
@@ -332,94 +247,16 @@ bool updateRecursiveShare(const string &owner,
         return false;
     }
     
-    // Read share mappings.
-    const string shareMappingFile = "filesystem/metadata/share_mappings.mapping";
-    string fileData;
-    if (!readFile(shareMappingFile, fileData) || fileData.empty()) {
-        // No mapping exists: nothing to update.
-        return true;
-    }
-    if (fileData.size() < AES_IVLEN) {
-        cerr << "Share mappings file corrupt: too small." << endl;
-        return false;
-    }
-    string iv = fileData.substr(0, AES_IVLEN);
-    string ciphertext = fileData.substr(AES_IVLEN);
-    string mappingPlaintext;
-    try {
-        mappingPlaintext = aes_decrypt(ciphertext,
-                                       reinterpret_cast<const unsigned char*>(globalSharingKey.data()),
-                                       reinterpret_cast<const unsigned char*>(iv.data()));
-    } catch (const exception &ex) {
-        cerr << "Failed to decrypt share mappings file: " << ex.what() << endl;
+    map<string, vector<EnvelopeUpdate>> byRecipient;
+    if (!sealSharedEnvelopes(collectShareClosure(filePath, globalSharingKey), globalSharingKey, clearKeyIV,
+                             byRecipient))
         return false;
-    }
-    
-    // Find the mapping line corresponding to source file.
-    istringstream iss(mappingPlaintext);
-    vector<string> lines;
-    string line;
-    bool foundMappingLine = false;
-    string mappingLine;
-    while (getline(iss, line)) {
-        if (line.empty())
-            continue;
-        istringstream lineStream(line);
-        string key;
-        lineStream >> key;
-        if (key == filePath) {
-            mappingLine = line;
-            foundMappingLine = true;
-            break;
-        }
-    }
-    if (!foundMappingLine) {
-        // Nothing to update.
-        return true;
-    }
-    
-    // Parse the mapping line: each token after the first is of the form "recipient:targetFile".
-    istringstream lineStream(mappingLine);
-    string dummy;
-    lineStream >> dummy;  // consume filePath token
-    vector<pair<string,string>> mappings;
-    string token;
-    while (lineStream >> token) {
-        size_t pos = token.find(":");
-        if (pos != string::npos) {
-            string recipient = token.substr(0, pos);
-            string targetFile = token.substr(pos+1);
-            mappings.push_back(make_pair(recipient, targetFile));
-        }
-    }
-    
-    // For each mapping, re-wrap the clear keyIV using the global sharing key.
-    for (const auto &mapping : mappings) {
-        const string &recipient = mapping.first;
-        const string &targetFile = mapping.second;
-        unsigned char symIV[AES_IVLEN];
-        if (RAND_bytes(symIV, AES_IVLEN) != 1) {
-            cerr << "Failed to generate IV for sharing encryption for recipient: " << recipient << endl;
-            continue;
+    bool ok = true;
+    for (const auto &group : byRecipient) {
+        if (!sharedEnvelopeStore(group.first).applyBatch(globalSharingKey, group.second)) {
+            cerr << "Failed to update shared envelope for recipient: " << group.first << endl;
+            ok = false;
         }
-        string symIVStr(reinterpret_cast<char*>(symIV), AES_IVLEN);
-        string newWrappedEnvelope;
-        try {
-            newWrappedEnvelope = aes_encrypt(clearKeyIV,
-                                             reinterpret_cast<const unsigned char*>(globalSharingKey.data()),
-                                             symIV);
-        } catch (const exception &ex) {
-            cerr << "Error encrypting envelope for recipient " << recipient << ": " << ex.what() << endl;
-            continue;
-        }
-        string finalEnvelope = symIVStr + newWrappedEnvelope;
-        // Update the recipient's shared metadata using the target file path from the mapping.
-        if (!updateSharedEnvelopeEntry(recipient, globalSharingKey, targetFile, finalEnvelope)) {
-            cerr << "Failed to update shared envelope for recipient: " << recipient << endl;
-        }/* else {
-            cout << "Updated shared envelope for " << recipient << endl;
-        }*/
     }
-    
-    return true;
+    return ok;
 }
@@ -4,7 +4,9 @@
 #include "encrypted_fs.h"
 #include "user_metadata.h"
 #include "shared_metadata.h"
+#include "metadata_log.h"
 
+#include <openssl/crypto.h>
 #include <openssl/rand.h>
 
 #include <iostream>
@@ -13,21 +15,25 @@
 #include <vector>
 #include <stdexcept>
 #include <string>
+#include <mutex>
 
 
 using namespace std;
 
-// We'll store the global sharing key in memory here.
+// We'll store the global sharing key in memory here. Sessions of one daemon process
+// share it, so it is only touched under gGlobalKeyMutex.
+static mutex gGlobalKeyMutex;
 static string gGlobalSharingKey = "";
 
 // File where the global sharing key (wrapped by admin) is stored.
 static const string kGlobalKeyFile = "filesystem/metadata/admin/globalKey.enc";
 
 // Initializes the global sharing key.
-bool initGlobalSharingKey(const string &adminPublicKeyPath,
-                          const string &adminPrivateKeyPath,
-                          const string &adminPassphrase, 
+bool initGlobalSharingKey(RSA *adminPublicKey,
+                          RSA *adminPrivateKey,
                           string &globalKey) {
+    // Held throughout so that two admin logins can't both create the key file.
+    lock_guard<mutex> guard(gGlobalKeyMutex);
     string encryptedKey;
     if (!fileExists(kGlobalKeyFile)) {
         // First time: generate a new 32-byte key.
@@ -38,21 +44,14 @@ bool initGlobalSharingKey(const string &adminPublicKeyPath,
         }
         gGlobalSharingKey = string(reinterpret_cast<char*>(buf), 32);
         // Encrypt it with admin's public key.
-        RSA *rsaPub = load_public_key(adminPublicKeyPath);
-        if (!rsaPub) {
-            cerr << "Failed to load admin public key from " << adminPublicKeyPath << endl;
-            return false;
-        }
         try {
-            encryptedKey = rsa_encrypt(rsaPub, gGlobalSharingKey);
+            encryptedKey = rsa_encrypt(adminPublicKey, gGlobalSharingKey);
         } catch (const exception &ex) {
             cerr << "Error encrypting global sharing key: " << ex.what() << endl;
-            RSA_free(rsaPub);
             return false;
         }
-        RSA_free(rsaPub);
         // Save the wrapped key to disk.
-        if (!writeFile(kGlobalKeyFile, encryptedKey)) {
+        if (!logWriteFile(kGlobalKeyFile, encryptedKey)) {
             cerr << "Failed to write global sharing key file" << endl;
             return false;
         }
@@ -62,19 +61,12 @@ bool initGlobalSharingKey(const string &adminPublicKeyPath,
             cerr << "Failed to read global sharing key file" << endl;
             return false;
         }
-        RSA *rsaPriv = load_private_key(adminPrivateKeyPath, adminPassphrase);
-        if (!rsaPriv) {
-            cerr << "Failed to load admin private key from " << adminPrivateKeyPath << endl;
-            return false;
-        }
         try {
-            gGlobalSharingKey = rsa_decrypt(rsaPriv, encryptedKey);
+            gGlobalSharingKey = rsa_decrypt(adminPrivateKey, encryptedKey);
         } catch (const exception &ex) {
             cerr << "Error decrypting global sharing key: " << ex.what() << endl;
-            RSA_free(rsaPriv);
             return false;
         }
-        RSA_free(rsaPriv);
     }
     return true;
 }
@@ -82,7 +74,12 @@ bool initGlobalSharingKey(const string &adminPublicKeyPath,
 // Grants a user access to the global sharing key.
 bool grantUserAccessToGlobalKey(const string &username,
                                 const string &userPublicKeyPath) {
-    if (gGlobalSharingKey.empty()) {
+    string globalKey;
+    {
+        lock_guard<mutex> guard(gGlobalKeyMutex);
+        globalKey = gGlobalSharingKey;
+    }
+    if (globalKey.empty()) {
         cerr << "Global sharing key is not initialized." << endl;
         return false;
     }
@@ -93,27 +90,27 @@ bool grantUserAccessToGlobalKey(const string &username,
     }
     string wrappedKey;
     try {
-        wrappedKey = rsa_encrypt(rsaUser, gGlobalSharingKey);
+        wrappedKey = rsa_encrypt(rsaUser, globalKey);
     } catch (const exception &ex) {
         cerr << "Error wrapping global sharing key for user: " << ex.what() << endl;
+        OPENSSL_cleanse(&globalKey[0], globalKey.size());
         RSA_free(rsaUser);
         return false;
     }
+    OPENSSL_cleanse(&globalKey[0], globalKey.size());
     RSA_free(rsaUser);
     // Save wrapped key into user's metadata directory.
     string userMetaDir = "filesystem/metadata/" + username;
     if (!directoryExists(userMetaDir))
         createDirectory(userMetaDir);
     string targetFile = userMetaDir + "/globalKey.enc";
-    return writeFile(targetFile, wrappedKey);
+    return logWriteFile(targetFile, wrappedKey);
 }
 
 // Retrieves the global sharing key for a user.
-// The user provides their private key (unlocked with their pass) to unwrap it.
+// The user provides their private key (unlocked at login) to unwrap it.
 bool retrieveGlobalSharingKey(const string &username,
-                              const string &userPublicKeyPath,
-                              const string &userPrivateKeyPath,
-                              const string &userPass,
+                              RSA *userPrivateKey,
                               string &globalKey) {
     string wrappedKey;
     string userMetaDir = "filesystem/metadata/" + username;
@@ -122,69 +119,60 @@ bool retrieveGlobalSharingKey(const string &username,
         cerr << "Failed to read wrapped global key" << endl;
         return false;
     }
-    RSA *rsa = load_private_key(userPrivateKeyPath, userPass);
-    if (!rsa) {
-        cerr << "Failed to load user's private key" << endl;
-        return false;
-    }
     try {
-        globalKey = rsa_decrypt(rsa, wrappedKey);
+        globalKey = rsa_decrypt(userPrivateKey, wrappedKey);
     } catch (const exception &ex) {
         cerr << "Error unwrapping global sharing key: " << ex.what() << endl;
-        RSA_free(rsa);
         return false;
     }
-    RSA_free(rsa);
     return true;
 }
 
-// Every file should be read only to admin
-bool updateAdminAccessForFile(const string &owner,
-                              const string &ownerDerivedKey,
-                              const string &globalSharingKey,
-                              const string &filePath,
-                              const string &clearKeyIV) {
+// Admin's public key, loaded once per process for escrowing file keys.
+static const string kAdminPublicKeyFile = "public_keys/admin_keyfile.pem";
+static mutex gAdminKeyMutex;
+static RSA *gAdminPublicKey = nullptr;
+
+// Every file should be readable by admin. Instead of recording an envelope in admin's
+// shared metadata on every write, the file key is wrapped with admin's public key and
+// stored in the file header, so the cost is one RSA operation and no metadata I/O.
+bool wrapAdminEscrow(const string &clearKeyIV, string &escrow) {
     // clearKeyIV should be the concatenation of the AES key (AES_KEYLEN bytes)
     // and the AES IV (AES_IVLEN bytes) used to encrypt the file.
     if (clearKeyIV.size() != AES_KEYLEN + AES_IVLEN) {
         cerr << "Invalid clearKeyIV length." << endl;
         return false;
     }
-    
-    // Generate a fresh IV for wrapping with the global sharing key.
-    unsigned char symIV[AES_IVLEN];
-    if (RAND_bytes(symIV, AES_IVLEN) != 1) {
-        cerr << "Failed to generate IV for admin wrapping." << endl;
-        return false;
+    lock_guard<mutex> lock(gAdminKeyMutex);
+    if (!gAdminPublicKey) {
+        gAdminPublicKey = load_public_key(kAdminPublicKeyFile);
+        if (!gAdminPublicKey) {
+            cerr << "Failed to load admin public key from " << kAdminPublicKeyFile << endl;
+            return false;
+        }
     }
-    string symIVStr(reinterpret_cast<char*>(symIV), AES_IVLEN);
-    
-    string adminWrappedEnvelope;
     try {
-        // Encrypt clearKeyIV using AES with the global sharing key.
-        adminWrappedEnvelope = aes_encrypt(clearKeyIV,
-                                           reinterpret_cast<const unsigned char*>(globalSharingKey.data()),
-                                           symIV);
+        escrow = rsa_encrypt(gAdminPublicKey, clearKeyIV);
     } catch (const exception &ex) {
-        cerr << "Error encrypting admin envelope: " << ex.what() << endl;
+        cerr << "Error encrypting admin escrow: " << ex.what() << endl;
         return false;
     }
-    // Prepend the IV to the ciphertext.
-    string finalAdminEnvelope = symIVStr + adminWrappedEnvelope;
+    return true;
+}
 
-    // Update the admin's shared metadata for this file.
-    if (!updateSharedEnvelopeEntry("admin", globalSharingKey, filePath, finalAdminEnvelope)) {
-        cerr << "Failed to update admin's shared envelope for file " << filePath << endl;
+// Opens an escrow slot with admin's private key.
+bool unwrapAdminEscrow(RSA *adminPrivateKey, const string &escrow, string &clearKeyIV) {
+    try {
+        clearKeyIV = rsa_decrypt(adminPrivateKey, escrow);
+    } catch (const exception &ex) {
+        cerr << "Error decrypting admin escrow: " << ex.what() << endl;
         return false;
     }
-
-    // Update share mapping
-    const string mappingFilePath = "filesystem/metadata/share_mappings.mapping";
-    if (!updateShareMapping(mappingFilePath, filePath, "admin", filePath, globalSharingKey)) {
-        cout << "Failed to update share mappings." << endl;
+    if (clearKeyIV.size() != AES_KEYLEN + AES_IVLEN) {
+        OPENSSL_cleanse(&clearKeyIV[0], clearKeyIV.size());
+        clearKeyIV.clear();
+        cerr << "Invalid admin escrow length." << endl;
         return false;
     }
-
     return true;
 }
-
@@ -7,20 +7,36 @@
 #include "shared_metadata.h"
 #include "user_metadata.h"
 #include "password_utils.h"
+#include "envelope_store.h"
+#include "thread_pool.h"
+#include "name_cache.h"
+#include "tree_walk.h"
+#include "metadata_lock.h"
+#include "metadata_log.h"
+#include "share_mapping_store.h"
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/pem.h>
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <set>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <string>
+#include <cstdint>
+#include <cstdlib>
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 using namespace std;
 
@@ -50,21 +66,15 @@ static bool endsWith(const string &str, const string &suffix) {
     return (0 == str.compare(str.length()-suffix.length(), suffix.length(), suffix));
 }
 
-// hex encode byte stream
-static string serializeEntries(const vector<EnvelopeEntry> &entries) {
-    ostringstream oss;
-    for (const auto &entry : entries) {
-        oss << entry.filePath << " " << toHex(entry.envelope) << "\n";
-    }
-    return oss.str();
-}
-
 // Given a base and a currentRelative (both as strings), compute the actual directory path on disk.
-static string computeActualPath(const string &base, const string &currentRelative) {
-    if (currentRelative.empty())
-        return base;
-    else
-        return base + "/" + currentRelative;
+// With encrypted names the components are mapped through the session's name cache; an
+// empty string is returned if a name cannot be stored (it is too long once encrypted).
+static string computeActualPath(const string &base, const string &currentRelative, const UserSession &session) {
+    string plainPath = currentRelative.empty() ? base : base + "/" + currentRelative;
+    string diskPath;
+    if (!session.names.diskPath(plainPath, diskPath))
+        return "";
+    return diskPath;
 }
 
 // Check if the current relative directory is forbidden for creation commands.
@@ -102,249 +112,693 @@ static bool isForbiddenShareDir(const string &normPath, const bool &isAdmin) {
 }
 
 // Command implementations
-static void command_cd(const string &base, string &currentRelative, const string &dirArg) {
+// Each command writes its output to 'out' and returns whether it succeeded.
+static bool command_cd(ostream &out, const string &base, string &currentRelative, const string &dirArg,
+                       const UserSession &session) {
     string newRel = normalizePath(base, currentRelative, dirArg);
     if (newRel == "XXXFORBIDDENXXX") {
-        cout << "Forbidden" << endl;
-        return;
+        out << "Forbidden\n";
+        return false;
     }
-    string actual = computeActualPath(base, newRel);
-    if (directoryExists(actual)) {
-        currentRelative = newRel;
+    string actual = computeActualPath(base, newRel, session);
+    if (!directoryExists(actual)) {
+        out << "Path does Not exist, or is inaccessible.\n";
+        return false;
     }
-    else
-        cout << "Path does Not exist, or is inaccessible." << endl;
+    currentRelative = newRel;
+    return true;
 }
 
-static void command_pwd(const string &base, const string &currentRelative) {
+static bool command_pwd(ostream &out, const string &base, const string &currentRelative) {
     if (currentRelative.empty())
-        cout << "/" << endl;
+        out << "/\n";
     else
-        cout << "/" << currentRelative << endl;
+        out << "/" << currentRelative << '\n';
+    return true;
+}
+
+// Options of ls: --sort orders entries by name; --offset/--limit page through the
+// listing (in name order with --sort, otherwise in directory order).
+struct LsOptions {
+    bool sort = false;
+    uint64_t offset = 0;
+    uint64_t limit = UINT64_MAX;
+};
+
+static void printLsLine(ostream &out, bool isDir, const string &name) {
+    out << (isDir ? "d -> " : "f -> ") << name << '\n';
+}
+
+// Entries are streamed from the directory as they are read; the type comes from the
+// directory entry itself, so listing costs no stat() per file.
+static bool command_ls(ostream &out, const string &base, const string &currentRelative, const string &dirArg,
+                       const UserSession &session, const LsOptions &options = LsOptions()) {
+    string normPath = normalizePath(base, currentRelative, dirArg);
+    if (normPath == "XXXFORBIDDENXXX") {
+        out << "Forbidden\n";
+        return false;
+    }
+    string dirPath = computeActualPath(base, normPath, session);
+    DirReader reader;
+    if (!reader.open(dirPath)) {
+        out << "Directory doesn't exist\n";
+        return false;
+    }
+
+    DirEntry entry;
+    if (!options.sort) {
+        uint64_t index = 0, printed = 0;
+        while (printed < options.limit && reader.next(entry)) {
+            if (entry.type == DirEntryType::Missing || index++ < options.offset)
+                continue;
+            string name(entry.name);
+            printLsLine(out, entry.type == DirEntryType::Directory, session.names.plainChild(dirPath, name));
+            printed++;
+        }
+    } else {
+        vector<pair<string, bool>> entries;   // plain name, is directory
+        while (reader.next(entry)) {
+            if (entry.type != DirEntryType::Missing)
+                entries.emplace_back(session.names.plainChild(dirPath, string(entry.name)),
+                                     entry.type == DirEntryType::Directory);
+        }
+        uint64_t begin = min<uint64_t>(options.offset, entries.size());
+        uint64_t end = begin + min<uint64_t>(options.limit, entries.size() - begin);
+        // Only the requested page needs to be in order.
+        partial_sort(entries.begin(), entries.begin() + end, entries.end());
+        for (uint64_t i = begin; i < end; i++)
+            printLsLine(out, entries[i].second, entries[i].first);
+    }
+    return !reader.failed();
 }
 
-static void command_ls(const string &base, const string &currentRelative, const string &dirArg) {
+// Entries of every directory below a walk root, keyed by path relative to the root
+// ("" for the root itself); each list is sorted by name.
+typedef map<string, vector<WalkEntry>> TreeListing;
+
+// Walks 'dirArg' in parallel (see walkTree) and collects its listing. 'label' is the
+// root's path as shown to the user. Prints the reason and returns false if the walk
+// can't start; unreadable subdirectories are reported and left out.
+static bool collectTree(ostream &out, const string &base, const string &currentRelative, const string &dirArg,
+                        const UserSession &session, bool sizes, TreeListing &listing, string &label) {
     string normPath = normalizePath(base, currentRelative, dirArg);
     if (normPath == "XXXFORBIDDENXXX") {
-        cout << "Forbidden" << endl;
+        out << "Forbidden\n";
+        return false;
+    }
+    string root = computeActualPath(base, normPath, session);
+    if (!directoryExists(root)) {
+        out << "Directory doesn't exist\n";
+        return false;
+    }
+    label = "/" + normPath;
+
+    mutex listingLock;
+    WalkOptions options;
+    options.sizes = sizes;
+    options.displayName = [&session](const string &diskDir, const string &diskName) {
+        return session.names.plainChild(diskDir, diskName);
+    };
+    walkTree(root, options, [&](const string &path, int, vector<WalkEntry> &entries) {
+        sort(entries.begin(), entries.end(),
+             [](const WalkEntry &a, const WalkEntry &b) { return a.name < b.name; });
+        lock_guard<mutex> guard(listingLock);
+        listing[path] = move(entries);
+    });
+    return true;
+}
+
+static string childPath(const string &path, const string &name) {
+    return path.empty() ? name : path + "/" + name;
+}
+
+static string joinLabel(const string &label, const string &path) {
+    if (path.empty())
+        return label;
+    return label == "/" ? label + path : label + "/" + path;
+}
+
+static void printFindEntries(ostream &out, const TreeListing &listing, const string &path, const string &label,
+                             const string &pattern) {
+    auto dir = listing.find(path);
+    if (dir == listing.end())
         return;
+    for (const auto &entry : dir->second) {
+        string entryPath = childPath(path, entry.name);
+        if (pattern.empty() || fnmatch(pattern.c_str(), entry.name.c_str(), 0) == 0)
+            out << joinLabel(label, entryPath) << '\n';
+        if (entry.isDir)
+            printFindEntries(out, listing, entryPath, label, pattern);
     }
-    string dirPath = computeActualPath(base, normPath);
-    vector<string> entries;
-    if (!listDirectory(dirPath, entries)) {
-        cout << "Directory doesn't exist" << endl;
+}
+
+// find [directory] [-name <pattern>]: every path below the directory, in name order,
+// optionally only those whose name matches the shell pattern.
+static bool command_find(ostream &out, const string &base, const string &currentRelative, const string &dirArg,
+                         const string &pattern, const UserSession &session) {
+    TreeListing listing;
+    string label;
+    if (!collectTree(out, base, currentRelative, dirArg, session, false, listing, label))
+        return false;
+    if (pattern.empty())
+        out << label << '\n';
+    printFindEntries(out, listing, "", label, pattern);
+    return true;
+}
+
+static void printTreeEntries(ostream &out, const TreeListing &listing, const string &path, const string &indent,
+                             uint64_t &dirs, uint64_t &files) {
+    auto dir = listing.find(path);
+    if (dir == listing.end())
         return;
+    const vector<WalkEntry> &entries = dir->second;
+    for (size_t i = 0; i < entries.size(); i++) {
+        bool last = i + 1 == entries.size();
+        out << indent << (last ? "`-- " : "|-- ") << entries[i].name << '\n';
+        if (entries[i].isDir) {
+            dirs++;
+            printTreeEntries(out, listing, childPath(path, entries[i].name), indent + (last ? "    " : "|   "),
+                             dirs, files);
+        } else {
+            files++;
+        }
     }
+}
 
-    for (const auto &name : entries) {
+// tree [directory]: the directory's subtree drawn as an indented tree.
+static bool command_tree(ostream &out, const string &base, const string &currentRelative, const string &dirArg,
+                         const UserSession &session) {
+    TreeListing listing;
+    string label;
+    if (!collectTree(out, base, currentRelative, dirArg, session, false, listing, label))
+        return false;
+    out << label << '\n';
+    uint64_t dirs = 0, files = 0;
+    printTreeEntries(out, listing, "", "", dirs, files);
+    out << '\n' << dirs << " directories, " << files << " files\n";
+    return true;
+}
 
-        string fullPath = dirPath + "/" + name;
-        struct stat st;
-        
-        if (name == "." || name == "..")
-            cout << "d -> " << name << endl;
-        else if (stat(fullPath.c_str(), &st) == 0) {
-            if (S_ISDIR(st.st_mode))
-                cout << "d -> " << name << endl;
-            else
-                cout << "f -> " << name << endl;
+// Prints the total of every directory after those of its subdirectories, like du(1),
+// and returns the total of 'path'. A file with several links is counted where it is
+// first met in name order.
+static uint64_t printDuEntries(ostream &out, const TreeListing &listing, const string &path, const string &label,
+                               set<pair<uint64_t, uint64_t>> &countedLinks) {
+    uint64_t total = 0;
+    auto dir = listing.find(path);
+    if (dir != listing.end()) {
+        for (const auto &entry : dir->second) {
+            if (entry.isDir)
+                total += printDuEntries(out, listing, childPath(path, entry.name), label, countedLinks);
+            else if (!entry.linked || countedLinks.insert(make_pair(entry.device, entry.inode)).second)
+                total += entry.bytes;
         }
     }
+    out << (total + 1023) / 1024 << '\t' << joinLabel(label, path) << '\n';
+    return total;
+}
+
+// du [directory]: disk space used by the encrypted files below each directory, in KiB.
+// Hard links (shared files) are counted once.
+static bool command_du(ostream &out, const string &base, const string &currentRelative, const string &dirArg,
+                       const UserSession &session) {
+    TreeListing listing;
+    string label;
+    if (!collectTree(out, base, currentRelative, dirArg, session, true, listing, label))
+        return false;
+    set<pair<uint64_t, uint64_t>> countedLinks;
+    printDuEntries(out, listing, "", label, countedLinks);
+    return true;
+}
+
+// Helper: parse a non-negative decimal count (ranged cat offsets, ls paging).
+static bool parseByteCount(const string &token, uint64_t &value) {
+    if (token.empty() || token.size() > 19 || token.find_first_not_of("0123456789") != string::npos)
+        return false;
+    value = stoull(token);
+    return true;
 }
 
-static void command_cat(const string &base, const string &currentRelative, const string &filename, const string &username, const string &passphrase, const string &userDerivedKey, const string &globalSharingKey) {
+static bool command_cat(ostream &out, const string &base, const string &currentRelative, const string &filename,
+                        const UserSession &session, uint64_t offset = 0, uint64_t length = UINT64_MAX) {
+    const string &username = session.username;
+    const string &userDerivedKey = session.derivedKey;
+    const string &globalSharingKey = session.globalSharingKey;
     string normPath = normalizePath(base, currentRelative, filename);
     if (normPath == "XXXFORBIDDENXXX") {
-        cout << filename << "Forbidden" << endl;
-        return;
+        out << filename << "Forbidden\n";
+        return false;
     }
-    string filePath = computeActualPath(base, normPath);
+    string filePath = computeActualPath(base, normPath, session);
     
     
     // If admin is logged in, check if filePath matches one of our global metadata files.
     if (username == "admin") {
         if (endsWith(filePath, "admin/globalKey.enc")) {
             string plaintext;
-            if (!retrieveGlobalSharingKey("admin",
-                              "public_keys/admin_keyfile.pem",
-                              "filesystem/keyfiles/admin_keyfile.pem",
-                              passphrase,
-                              plaintext))
+            if (!retrieveGlobalSharingKey("admin", session.privateKey, plaintext)) {
                 cerr << "Failed to decrypt " << filePath << endl;
-            else
-                cout << toHex(plaintext) << endl;
-            return;
+                return false;
+            }
+            out << toHex(plaintext) << '\n';
+            return true;
         } 
         if (filePath == "filesystem/metadata/admin/envelopes.enc") {
             vector<EnvelopeEntry> entries;
-            loadUserMetadata("admin", userDerivedKey,entries);
-            cout << serializeEntries(entries) << endl;
-            return;
+            bool loaded = loadUserMetadata("admin", userDerivedKey,entries);
+            out << formatEnvelopeEntries(entries) << '\n';
+            return loaded;
         }
-        if (endsWith(filePath, "share_mappings.mapping") && filePath.find("filesystem/metadata/") == 0) {
-            string fileData;
-            if (!readFile(filePath, fileData) || fileData.empty())
-                return;
-            if (fileData.size() < AES_IVLEN) {
-                cerr << "Failed to decrypt " << filePath << endl;
-                return;
-            }
-            string iv = fileData.substr(0, AES_IVLEN);
-            string ciphertext = fileData.substr(AES_IVLEN);
+        if (endsWith(filePath, "/share_mappings.mapping") && filePath.find("filesystem/metadata/") == 0) {
+            // Per-owner shard: filesystem/metadata/<owner>/share_mappings.mapping
+            string owner = filePath.substr(string("filesystem/metadata/").size());
+            owner = owner.substr(0, owner.find('/'));
             string mappingPlaintext;
-            try {
-                mappingPlaintext = aes_decrypt(ciphertext,
-                                            reinterpret_cast<const unsigned char*>(globalSharingKey.data()),
-                                            reinterpret_cast<const unsigned char*>(iv.data()));
-            } catch (const exception &ex) {
+            // describe() runs the legacy migration first, which may create this shard.
+            if (!shareMappingShard(owner).describe(globalSharingKey, mappingPlaintext) || !fileExists(filePath)) {
                 cerr << "Failed to decrypt " << filePath << endl;
-                return;
+                return false;
             }
-            cout << mappingPlaintext << endl;
-            return;
+            out << mappingPlaintext << '\n';
+            return true;
         }
         if (endsWith(filePath, "shared_envelopes.enc") && filePath.find("filesystem/metadata/") == 0) {
             vector<EnvelopeEntry> entries;
-            loadSharedMetadata(username, globalSharingKey,entries);
-            cout << serializeEntries(entries) << endl;
-            return;
+            bool loaded = loadSharedMetadata(username, globalSharingKey,entries);
+            out << formatEnvelopeEntries(entries) << '\n';
+            return loaded;
         }
         // For any other file in sensitive directories (like metadata or keyfiles), do not attempt decryption.
         if (filePath.find("filesystem/metadata/") == 0 || filePath.find("filesystem/keyfiles/") == 0) {
-            cout << "Forbidden: keys and key data are private, displaying raw encrypted contents:" << endl;
+            out << "Forbidden: keys and key data are private, displaying raw encrypted contents:\n";
             string raw;
-            if (readFile(filePath, raw))
-                cout << raw << endl;
-            else
-                cout << "Unable to read file." << endl;
-            return;
+            if (!readFile(filePath, raw)) {
+                out << "Unable to read file.\n";
+                return false;
+            }
+            out << raw << '\n';
+            return true;
         }
     }
 
-    // Otherwise, proceed with normal decryption.
-    string decryptedContent;
-    bool success = encryptedReadFile(filePath, decryptedContent, username, passphrase, userDerivedKey, globalSharingKey);
+    // Otherwise, proceed with normal decryption, streaming each verified segment to the output.
+    ChunkSink toOut = [&out](const char *data, size_t len) {
+        out.write(data, len);
+        return static_cast<bool>(out);
+    };
+    bool success = encryptedReadRange(filePath, offset, length, toOut, session);
     if (success) {
-        cout << decryptedContent << endl;
+        out << '\n';
     } else {
-        cout << filename << " doesn't exist or decryption failed" << endl;
+        out << filename << " doesn't exist or decryption failed\n";
     }
+    return success;
 }
 
-static void command_mkfile(const string &base, const string &currentRelative, const string &filename, 
-                           const string &contents, const bool &isAdmin, const string &username, const string &password, 
-                           const string &userDerivedKey, const string &globalSharingKey) {
-    
+static bool command_mkfile(ostream &out, const string &base, const string &currentRelative, const string &filename, 
+                           const string &contents, const UserSession &session) {
+
     string normPath = normalizePath(base, currentRelative, filename);
     if (normPath == "XXXFORBIDDENXXX") {
-        cout << filename << "Forbidden" << endl;
-        return;
+        out << filename << "Forbidden\n";
+        return false;
     }
     
-    if (isForbiddenCreationDir(normPath, isAdmin)) {
-        cout << "Forbidden" << endl;
-        return;
+    if (isForbiddenCreationDir(normPath, session.isAdmin)) {
+        out << "Forbidden\n";
+        return false;
     }
     
-    string filePath = computeActualPath(base, normPath);
-    if (!encryptedWriteFile(filePath, contents, username, userDerivedKey, globalSharingKey)) {
-        cout << "Error creating file" << endl;
+    string filePath = computeActualPath(base, normPath, session);
+    if (!encryptedWriteFile(filePath, contents, session)) {
+        out << "Error creating file\n";
+        return false;
+    }
+    return true;
+}
+
+// Host directory that put, get and import may use, from FILESERVER_TRANSFER_DIR; local
+// paths are taken relative to it. Empty (transfers disabled) if it is unset or overlaps
+// the server's own files: its working directory, filesystem/, public_keys/ and the
+// directory of its executable.
+static const char kTransferDirVariable[] = "FILESERVER_TRANSFER_DIR";
+
+// True if 'path' is 'dir' or below it; both are canonical.
+static bool pathWithin(const string &path, const string &dir) {
+    if (dir == "/")
+        return true;
+    return path.compare(0, dir.size(), dir) == 0 && (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+static string canonicalPath(const string &path) {
+    char *resolved = realpath(path.c_str(), nullptr);
+    if (!resolved)
+        return "";
+    string canonical = resolved;
+    free(resolved);
+    return canonical;
+}
+
+static const string &transferRoot() {
+    static const string root = [] {
+        const char *configured = getenv(kTransferDirVariable);
+        if (!configured || !*configured)
+            return string();
+        string dir = canonicalPath(configured);
+        if (dir.empty()) {
+            cerr << kTransferDirVariable << " " << configured << " doesn't exist" << endl;
+            return string();
+        }
+        char *cwd = getcwd(nullptr, 0);
+        vector<string> serverTrees = {cwd ? string(cwd) : string("/"), canonicalPath("filesystem"),
+                                      canonicalPath("public_keys"), canonicalPath("/proc/self/exe")};
+        free(cwd);
+        serverTrees.back() = serverTrees.back().substr(0, serverTrees.back().find_last_of('/'));
+        for (const auto &tree : serverTrees) {
+            if (!tree.empty() && (pathWithin(dir, tree) || pathWithin(tree, dir))) {
+                cerr << kTransferDirVariable << " must not overlap the server's files (" << tree << ")" << endl;
+                return string();
+            }
+        }
+        return dir;
+    }();
+    return root;
+}
+
+// Resolves the local path 'path' inside the transfer directory. For 'forWrite' the file
+// need not exist, only its directory. False, after telling the user, if transfers are
+// disabled or the path leads outside the directory (through "..", a symlink, ...).
+static bool resolveLocalPath(ostream &out, const string &path, bool forWrite, string &resolved) {
+    const string &root = transferRoot();
+    if (root.empty()) {
+        out << "Local file transfer is disabled; set " << kTransferDirVariable << '\n';
+        return false;
+    }
+    string joined = root + "/" + path;
+    if (forWrite) {
+        size_t slash = joined.find_last_of('/');
+        string name = joined.substr(slash + 1);
+        string dir = canonicalPath(joined.substr(0, slash));
+        if (name.empty() || name == "." || name == ".." || dir.empty()) {
+            out << "Invalid local path " << path << '\n';
+            return false;
+        }
+        resolved = dir + "/" + name;
+    } else {
+        resolved = canonicalPath(joined);
+        if (resolved.empty()) {
+            out << "Cannot open local path " << path << '\n';
+            return false;
+        }
+    }
+    if (!pathWithin(resolved, root)) {
+        out << "Forbidden\n";
+        return false;
+    }
+    return true;
+}
+
+// Opens a local file for a sequential read into the encryption layer. 'path' comes
+// resolved, so a symlink in its last component was swapped in since; it is refused.
+static int openLocalSource(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+// Feeds the encryption layer straight from a descriptor: each call fills the caller's
+// segment buffer, so no intermediate copy or stream buffer is involved.
+static ChunkSource fdSource(int fd) {
+    return [fd](char *buf, size_t cap) { return readFull(fd, buf, cap); };
+}
+
+// put: encrypts the local file 'localFile' into 'filename', one segment at a time.
+static bool command_put(ostream &out, const string &base, const string &currentRelative, const string &localFile,
+                        const string &filename, const UserSession &session) {
+    string normPath = normalizePath(base, currentRelative, filename);
+    if (normPath == "XXXFORBIDDENXXX" || isForbiddenCreationDir(normPath, session.isAdmin)) {
+        out << "Forbidden\n";
+        return false;
+    }
+    string localPath;
+    if (!resolveLocalPath(out, localFile, false, localPath))
+        return false;
+    int fd = openLocalSource(localPath);
+    if (fd < 0) {
+        out << "Cannot open local file " << localFile << '\n';
+        return false;
+    }
+    struct stat st;
+    uint64_t sizeHint = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? static_cast<uint64_t>(st.st_size) : 0;
+    bool ok = encryptedWriteStream(computeActualPath(base, normPath, session), fdSource(fd), session, sizeHint);
+    close(fd);
+    if (!ok)
+        out << "Error creating file\n";
+    return ok;
+}
+
+// get: decrypts 'filename' into the local file 'localFile'. Output goes to a ".part"
+// file that is renamed into place only once every segment has been authenticated.
+static bool command_get(ostream &out, const string &base, const string &currentRelative, const string &filename,
+                        const string &localFile, const UserSession &session) {
+    string normPath = normalizePath(base, currentRelative, filename);
+    if (normPath == "XXXFORBIDDENXXX") {
+        out << "Forbidden\n";
+        return false;
+    }
+    string filePath = computeActualPath(base, normPath, session);
+    if (filePath.find("filesystem/metadata/") == 0 || filePath.find("filesystem/keyfiles/") == 0) {
+        out << "Forbidden\n";
+        return false;
+    }
+    string localPath;
+    if (!resolveLocalPath(out, localFile, true, localPath))
+        return false;
+    string partPath = localPath + ".part";
+    int fd = open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        out << "Cannot create local file " << localFile << '\n';
+        return false;
+    }
+    ChunkSink toFd = [fd](const char *data, size_t len) { return writeFull(fd, data, len); };
+    bool ok = encryptedReadStream(filePath, toFd, session);
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(partPath.c_str(), localPath.c_str()) != 0) {
+        unlink(partPath.c_str());
+        out << filename << " doesn't exist or decryption failed\n";
+        return false;
+    }
+    return true;
+}
+
+// One regular file found under the import source and where it goes.
+struct ImportItem {
+    string localPath;
+    string destPath;
+    uint64_t size;
+};
+
+// Walks the local tree under 'localDir' (resolved inside the transfer directory),
+// creating the matching directories under 'destDir' and collecting every regular file.
+// Symlinks, special files and names the shell would reject are skipped with a warning,
+// so the walk never leaves 'localDir'.
+static bool collectImportItems(ostream &out, const string &localDir, const string &destDir, NameCache &names,
+                               vector<ImportItem> &items) {
+    vector<pair<string, string>> pending;
+    pending.push_back(make_pair(localDir, destDir));
+    while (!pending.empty()) {
+        pair<string, string> dir = pending.back();
+        pending.pop_back();
+        if (!directoryExists(dir.second) && !createDirectories(dir.second)) {
+            out << "Failed to create directory " << dir.second << '\n';
+            return false;
+        }
+        // Not followed if it was swapped for a symlink after the walk found it.
+        int dirFd = open(dir.first.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *handle = dirFd >= 0 ? fdopendir(dirFd) : nullptr;
+        if (!handle) {
+            if (dirFd >= 0)
+                close(dirFd);
+            out << "Cannot open local directory " << dir.first << '\n';
+            return false;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(handle)) != nullptr) {
+            string name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+            string localPath = dir.first + "/" + name;
+            struct stat st;
+            if (lstat(localPath.c_str(), &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) ||
+                !is_valid_input(name)) {
+                out << "Skipping " << localPath << '\n';
+                continue;
+            }
+            string destPath;
+            if (!names.diskChild(dir.second, name, destPath)) {
+                out << "Skipping " << localPath << '\n';
+                continue;
+            }
+            if (S_ISDIR(st.st_mode))
+                pending.push_back(make_pair(localPath, destPath));
+            else
+                items.push_back(ImportItem{localPath, destPath, static_cast<uint64_t>(st.st_size)});
+        }
+        closedir(handle);
+    }
+    return true;
+}
+
+static void printImportProgress(ostream &out, size_t files, size_t total, uint64_t bytes, double seconds, bool done) {
+    double elapsed = max(seconds, 1e-3);
+    out << "\rImported " << files << "/" << total << " files ("
+        << static_cast<uint64_t>(files / elapsed) << " files/s, "
+        << static_cast<uint64_t>(bytes / elapsed / (1024 * 1024)) << " MB/s)";
+    if (done)
+        out << '\n';
+    else
+        out << flush;
+}
+
+// Bulk import: encrypts every file under the local directory 'localDir' into 'dest'.
+// Files are encrypted and wrapped in parallel on a work-stealing pool; their envelopes
+// are buffered in the user's envelope store and committed in one batch at the end.
+static bool command_import(ostream &out, const string &base, const string &currentRelative, const string &localDir,
+                           const string &dest, const UserSession &session) {
+    string normPath = normalizePath(base, currentRelative, dest);
+    if (normPath == "XXXFORBIDDENXXX" || isForbiddenCreationDir(normPath + "/", session.isAdmin)) {
+        out << "Forbidden\n";
+        return false;
+    }
+    string localRoot;
+    if (!resolveLocalPath(out, localDir, false, localRoot))
+        return false;
+    if (!directoryExists(localRoot)) {
+        out << "Local directory " << localDir << " doesn't exist\n";
+        return false;
     }
 
+    vector<ImportItem> items;
+    string destDir = computeActualPath(base, normPath, session);
+    if (destDir.empty() || !collectImportItems(out, localRoot, destDir, session.names, items))
+        return false;
+
+    atomic<size_t> filesDone(0);
+    atomic<uint64_t> bytesDone(0);
+    mutex failedLock;
+    vector<string> failed;
+    auto start = chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    {
+        ThreadPool pool(workerCountFor(items.size()));
+        for (const auto &item : items) {
+            pool.submit([&] {
+                int fd = openLocalSource(item.localPath);
+                bool ok = fd >= 0 && encryptedWriteStream(item.destPath, fdSource(fd), session, item.size);
+                if (fd >= 0)
+                    close(fd);
+                if (ok) {
+                    bytesDone += item.size;
+                    filesDone++;
+                } else {
+                    lock_guard<mutex> guard(failedLock);
+                    failed.push_back(item.localPath);
+                }
+            });
+        }
+        while (!pool.waitFor(chrono::milliseconds(500)))
+            printImportProgress(out, filesDone, items.size(), bytesDone, elapsed(), false);
+    }
+    // Commit the buffered envelopes of the whole import at once.
+    bool saved = flushEnvelopeStores();
+    if (!saved)
+        out << "Failed to save file metadata\n";
+    printImportProgress(out, filesDone, items.size(), bytesDone, elapsed(), true);
+    for (const auto &path : failed)
+        out << "Failed to import " << path << '\n';
+    return saved && failed.empty();
 }
 
-static void command_mkdir(const string &base, const string &currentRelative, const string &dirname, const bool &isAdmin) {
+static bool command_mkdir(ostream &out, const string &base, const string &currentRelative, const string &dirname,
+                          const UserSession &session) {
+    const bool &isAdmin = session.isAdmin;
     
     string normPath = normalizePath(base, currentRelative, dirname);
     if (normPath == "XXXFORBIDDENXXX") {
-        cout << "Forbidden" << endl;
-        return;
+        out << "Forbidden\n";
+        return false;
     }
 
     if (isForbiddenCreationDir(normPath, isAdmin)) {
-        cout << "Forbidden" << endl;
-        return;
+        out << "Forbidden\n";
+        return false;
     }
     
-    string dirPath = computeActualPath(base, normPath);
+    string dirPath = computeActualPath(base, normPath, session);
     if (directoryExists(dirPath)) {
-        cout << "Directory already exists" << endl;
-    } else {
-        if (!createDirectory(dirPath))
-            cout << "Error creating directory" << endl;
+        out << "Directory already exists\n";
+        return false;
+    }
+    if (!createDirectory(dirPath)) {
+        out << "Error creating directory\n";
+        return false;
     }
+    return true;
 }
 
 
 // Wrap the file's envelope using the global key (which is public)
 // and update a central shared envelope mapping (using the old global envelope mapping code).
-static void command_share(const string &base, const string &currentRelative,
+static bool command_share(ostream &out, const string &base, const string &currentRelative,
                           const string &filename, const string &targetUser, 
-                          const bool &isAdmin, const string &currentUser, const string &currentUserPass, 
-                          const string &senderDerivedKey, const string &globalSharingKey) {
-    
+                          const UserSession &session) {
+    const bool &isAdmin = session.isAdmin;
+    const string &currentUser = session.username;
+    const string &globalSharingKey = session.globalSharingKey;
+
     string normPath = normalizePath(base, currentRelative, filename);
     if (normPath == "XXXFORBIDDENXXX" || isForbiddenShareDir(normPath, isAdmin)) {
-        cout << "Forbidden" << endl;
-        return;
+        out << "Forbidden\n";
+        return false;
     }
 
     if (!directoryExists("filesystem/" + targetUser)) {
-        cout << "User: " + targetUser + " does not exist." << endl;
-        return;
+        out << "User: " + targetUser + " does not exist.\n";
+        return false;
     }
 
-    string sourceFile = computeActualPath(base, normPath);
+    string sourceFile = computeActualPath(base, normPath, session);
     if (!fileExists(sourceFile)) {
-        cout << "File " << filename << " doesn't exist" << endl;
-        return;
-    }
-    // Read file envelope for currentUser.
-    string currentEnvelope;
-    if (!findUserEnvelope(currentUser, sourceFile, senderDerivedKey, currentEnvelope)) {
-        cout << "Error: envelope mapping missing for current file" << endl;
-        return;
-    }
-    
-    // Decrypt it using current user's private key.
-    string currentPrivKeyPath = "filesystem/keyfiles/" + currentUser + "_keyfile.pem";
-    
-    RSA* rsaPriv = load_private_key(currentPrivKeyPath, currentUserPass);
-    if (!rsaPriv) {
-        cout << "Error: could not load your private key (perhaps incorrect passphrase)." << endl;
-        return;
+        out << "File " << filename << " doesn't exist\n";
+        return false;
     }
+    // Recover the file key from currentUser's own envelope, or from their shared
+    // envelope when re-sharing a file from their shared/ folder.
     string keyIV;
-    try {
-        keyIV = rsa_decrypt(rsaPriv, currentEnvelope);
-    } catch (const exception &ex) {
-        cout << "Error decrypting envelope: " << ex.what() << endl;
-        RSA_free(rsaPriv);
-        return;
+    if (!recoverFileKey(sourceFile, session, keyIV)) {
+        out << "Error: envelope mapping missing for current file\n";
+        return false;
     }
-    RSA_free(rsaPriv);
 
-    // clean copy
-    string clearIV = keyIV;
-    
     // we wrap keyIV symmetrically using the global sharing key. 
     // This means that the target user will later use their copy of the
     // global sharing key to unwrap the envelope.
     unsigned char symIV[AES_IVLEN];
     if (RAND_bytes(symIV, AES_IVLEN) != 1) {
-        cout << "Failed to generate IV for sharing encryption." << endl;
-        return;
+        out << "Failed to generate IV for sharing encryption.\n";
+        return false;
     }
-    string symIVStr(reinterpret_cast<char*>(symIV), AES_IVLEN);
-    string wrappedEnvelope;
+    // The IV is prepended to the ciphertext so that it can be used for decryption later.
+    string newEnvelope;
     try {
-        wrappedEnvelope = aes_encrypt(keyIV, reinterpret_cast<const unsigned char*>(globalSharingKey.data()), symIV);
+        newEnvelope = aes_encrypt_blob(keyIV, reinterpret_cast<const unsigned char*>(globalSharingKey.data()), symIV);
     } catch (const exception &ex) {
-        cout << "Error encrypting file key with global sharing key: " << ex.what() << endl;
-        return;
+        out << "Error encrypting file key with global sharing key: " << ex.what() << '\n';
+        return false;
     }
-    // Prepend the IV to the ciphertext so that it can be used for decryption later.
-    string newEnvelope = symIVStr + wrappedEnvelope;
 
     // Additionally, create a hard link in the target user's shared directory.
     // Target user's shared directory: "filesystem/<targetUser>/shared"
@@ -374,7 +828,11 @@ static void command_share(const string &base, const string &currentRelative,
     // Build target normalized path: "shared/<relativePath>"
     string targetNormPath = normalizePath("filesystem/" + targetUser, "", "shared/" + currentUser + "/" + relativePath);
     // Compute the actual target file path.
-    string targetFile = computeActualPath("filesystem/" + targetUser, targetNormPath);
+    string targetFile = computeActualPath("filesystem/" + targetUser, targetNormPath, session);
+    if (targetFile.empty()) {
+        out << "Cannot share " << filename << " with " << targetUser << '\n';
+        return false;
+    }
     
     // Ensure target directory exists.
     size_t lastSlash = targetFile.find_last_of('/');
@@ -382,42 +840,52 @@ static void command_share(const string &base, const string &currentRelative,
         string targetDir = targetFile.substr(0, lastSlash);
         if (!directoryExists(targetDir)) {
             if (!createDirectories(targetDir)) {
-                cout << "Failed to create target directory structure: " << targetDir << endl;
-                return;
+                out << "Failed to create target directory structure: " << targetDir << '\n';
+                return false;
             }
         }
     }
 
+    // The target's shared metadata and the owner's mapping shard change together, so
+    // both are locked up front (MetadataLock takes them in its fixed order) and stay
+    // locked until the envelope, the mapping and the link are all in place. Migrating
+    // old mappings first keeps every lock taken under these on the same two files.
+    migrateLegacyShareMappings(globalSharingKey);
+    MetadataLock metadataLock;
+    metadataLock.add(sharedMetadataPath(targetUser), LockMode::Exclusive);
+    metadataLock.add(shareMappingShardPath(shareMappingOwner(sourceFile)), LockMode::Exclusive);
+    if (!metadataLock.lock()) {
+        out << "Failed to lock share metadata\n";
+        return false;
+    }
+    // One transaction for all of it: after a crash the share is either complete or absent.
+    MetadataTransaction transaction;
+
     // Update the target's shared metadata.
     // This encrypts the shared envelope under the global sharing key.
-    if (updateSharedEnvelopeEntry(targetUser, globalSharingKey, targetFile, newEnvelope))
-        cout << "File shared with " << targetUser << endl;
-    else {
-        cout << "Failed to update shared envelope mapping for " << targetUser << endl;
-        return;
+    if (!updateSharedEnvelopeEntry(targetUser, globalSharingKey, targetFile, newEnvelope) ||
+        !sharedEnvelopeStore(targetUser).flush()) {
+        out << "Failed to update shared envelope mapping for " << targetUser << '\n';
+        return false;
     }
 
-    // Now update admin access
-    // Call the function to re-wrap the clear keyIV for admin using the global sharing key.
-    if (targetUser != "admin") {
-        if (!updateAdminAccessForFile(targetUser, senderDerivedKey, globalSharingKey, targetFile, clearIV)) {
-            cerr << "Warning: failed to update admin access for file: " << targetFile << endl;
-            return;
-        }
-    }
+    // Admin needs no extra entry: targetFile is a hard link, so it carries the
+    // admin escrow slot of the source file header.
 
     // Update share mapping
-    const string mappingFilePath = "filesystem/metadata/share_mappings.mapping";
-    if (!updateShareMapping(mappingFilePath, sourceFile, targetUser, targetFile, globalSharingKey)) {
-        cout << "Failed to update share mappings." << endl;
-        return;
+    if (!updateShareMapping(sourceFile, targetUser, targetFile, globalSharingKey)) {
+        out << "Failed to update share mappings.\n";
+        return false;
     }
     
-    // Create a hard link at the target location.
-    if (fileExists(targetFile))
-        removeFile(targetFile);
-    if (!createHardLink(sourceFile, targetFile))
-        cout << "Error sharing file at " << targetFile << endl;
+    // Create a hard link at the target location, replacing an older one.
+    logHardLink(sourceFile, targetFile);
+    if (!transaction.commit()) {
+        out << "Error sharing file at " << targetFile << '\n';
+        return false;
+    }
+    out << "File shared with " << targetUser << '\n';
+    return true;
 }
 
 
@@ -425,19 +893,19 @@ static void command_share(const string &base, const string &currentRelative,
 // stores the public key outside the filesystem (as "<username>_keyfile.pem"),
 // stores the private key (encrypted with a randomly generated passphrase) in "filesystem/keyfiles/<username>_keyfile.pem",
 // and creates the user's directory structure.
-void command_adduser(const string &username, const string &globalKey) {
+bool command_adduser(ostream &out, const string &username, const string &globalKey) {
 
     string newUser = trim(username);
 
     if (!is_valid_input(newUser)) {
         cerr << "Invalid username. Please try again." << endl;
-        return;
+        return false;
     }
 
     string userDir = "filesystem/" + newUser;
     if (directoryExists(userDir)) {
-        cout << "User " << newUser << " already exists" << endl;
-        return;
+        out << "User " << newUser << " already exists\n";
+        return false;
     }
     
     // Generate a temporary passphrase for the new user.
@@ -449,14 +917,14 @@ void command_adduser(const string &username, const string &globalKey) {
     
     // Generate the RSA key pair, encrypting the private key with the temporary passphrase.
     if (!generate_rsa_keypair(privateKeyPath, publicKeyPath, tempPassphrase)) {
-        cout << "Error creating keyfiles for " << newUser << endl;
-        return;
+        out << "Error creating keyfiles for " << newUser << '\n';
+        return false;
     }
     
     // Create the user's filesystem directory and subdirectories.
     if (!createDirectory(userDir)) {
-        cout << "Error creating user directory for " << newUser << endl;
-        return;
+        out << "Error creating user directory for " << newUser << '\n';
+        return false;
     }
     createDirectory(userDir + "/personal");
     createDirectory(userDir + "/shared");
@@ -465,46 +933,57 @@ void command_adduser(const string &username, const string &globalKey) {
     string metaDir = "filesystem/metadata/" + newUser;
     if (!directoryExists(metaDir)) {
         if (!createDirectory(metaDir)) {
-            cout << "Error creating metadata directory for " << newUser << endl;
-            return;
+            out << "Error creating metadata directory for " << newUser << '\n';
+            return false;
         }
     }
     
     // Grant the new user access to the global sharing key.
     if (!grantUserAccessToGlobalKey(newUser, publicKeyPath)) {
-        cout << "Error granting access to global sharing key." << endl;
-        return;
+        out << "Error granting access to global sharing key.\n";
+        return false;
     }
     
     // Inform the admin that the new user was created and display the temporary passphrase.
-    cout << "Added user: " << newUser << endl;
-    cout << "Temporary passphrase for " << newUser << " is: " << tempPassphrase << endl;
-    cout << "User must change this passphrase at first login." << endl;
+    out << "Added user: " << newUser << '\n';
+    out << "Temporary passphrase for " << newUser << " is: " << tempPassphrase << '\n';
+    out << "User must change this passphrase at first login.\n";
+    return true;
 }
 
-void command_changepass(const string &currentUser, const string &oldPass, const string &newPass) {
+bool command_changepass(ostream &out, const string &currentUser, const string &oldPass, const string &newPass) {
+    // Nothing else may touch the metadata while it moves to the new key.
+    MetadataLock metadataLock(userMetadataPath(currentUser), LockMode::Exclusive);
+    if (!metadataLock.locked()) {
+        out << "Failed to lock your metadata for password change.\n";
+        return false;
+    }
     // Re-encrypt the private key.
     string privKeyPath = "filesystem/keyfiles/" + currentUser + "_keyfile.pem";
     RSA* rsa = load_private_key(privKeyPath, oldPass);
     if (!rsa) {
-        cout << "Failed to load your current private key. Incorrect old passphrase?" << endl;
-        return;
-    }
-    FILE* fp = fopen(privKeyPath.c_str(), "w");
-    if (!fp) {
-        cout << "Failed to open your private key file for writing." << endl;
-        RSA_free(rsa);
-        return;
+        out << "Failed to load your current private key. Incorrect old passphrase?\n";
+        return false;
     }
-    if (!PEM_write_RSAPrivateKey(fp, rsa, EVP_aes_256_cbc(), nullptr, 0, nullptr, const_cast<char*>(newPass.c_str()))) {
-        cout << "Failed to re-encrypt your private key." << endl;
-        fclose(fp);
+    BIO *pem = BIO_new(BIO_s_mem());
+    if (!pem || !PEM_write_bio_RSAPrivateKey(pem, rsa, EVP_aes_256_cbc(), nullptr, 0, nullptr,
+                                             const_cast<char*>(newPass.c_str()))) {
+        out << "Failed to re-encrypt your private key.\n";
+        BIO_free(pem);
         RSA_free(rsa);
-        return;
+        return false;
     }
-    fclose(fp);
     RSA_free(rsa);
-    
+    char *pemData = nullptr;
+    long pemLen = BIO_get_mem_data(pem, &pemData);
+    string newPrivateKey(pemData, pemLen > 0 ? pemLen : 0);
+    BIO_free(pem);
+
+    // The key and the metadata move to the new passphrase in one transaction, so a
+    // crash can't leave one of them behind under the old one.
+    MetadataTransaction transaction;
+    logWriteFile(privKeyPath, newPrivateKey);
+
     // Now re-encrypt the metadata file.
     // Derive old and new keys.
     string oldDerivedKey = deriveKeyFromPassword(oldPass);
@@ -512,116 +991,281 @@ void command_changepass(const string &currentUser, const string &oldPass, const
     // Load current metadata.
     vector<EnvelopeEntry> entries;
     if (!loadUserMetadata(currentUser, oldDerivedKey, entries)) {
-        cout << "Failed to load your metadata for password change." << endl;
-        return;
+        out << "Failed to load your metadata for password change.\n";
+        return false;
     }
     // Save metadata with new derived key.
-    if (!saveUserMetadata(currentUser, newDerivedKey, entries)) {
-        cout << "Failed to update your metadata encryption." << endl;
-        return;
+    if (!saveUserMetadata(currentUser, newDerivedKey, entries) || !transaction.commit()) {
+        out << "Failed to update your metadata encryption.\n";
+        return false;
+    }
+    out << "\nPassword changed successfully.\n";
+    out << "\nPlease Log in Again to re-initialize.\n";
+    return true;
+}
+
+
+// namemode [plain|siv]: shows or sets how names are stored on disk (see NameCache).
+static bool command_namemode(ostream &out, istringstream &iss, const UserSession &session) {
+    string arg;
+    if (!(iss >> arg)) {
+        out << "Name mode: " << nameModeName(session.names.mode()) << '\n';
+        return true;
+    }
+    NameMode mode;
+    if (!parseNameMode(arg, mode)) {
+        out << "Invalid Command\n";
+        return false;
+    }
+    if (!storeNameMode(mode)) {
+        out << "Failed to change name mode\n";
+        return false;
     }
-    cout << "\nPassword changed successfully." << endl;
-    cout << "\nPlease Log in Again to re-initialize." << endl;
+    // The session's names follow once the mode file is written, with the command.
+    out << "Name mode: " << nameModeName(mode) << '\n';
+    return true;
+}
+
+static CommandStatus invalidCommand(ostream &out) {
+    out << "Invalid Command\n";
+    return CommandStatus::Invalid;
 }
 
+// Parses and runs one command line, writing its output to 'out'. 'currentRelative' is
+// the virtual location relative to the user's root ("" for the root itself).
+static CommandStatus executeCommand(ostream &out, const string &line, const string &base, string &currentRelative,
+                                    const UserSession &session, bool interactive) {
+    const bool isAdmin = session.isAdmin;
+    const string &currentUser = session.username;
+    const string &globalSharingKey = session.globalSharingKey;
+
+    istringstream iss(line);
+    string command;
+    iss >> command;
+    bool ok;
+    if (command == "exit") {
+        return CommandStatus::Exit;
+    } else if (command == "cd") {
+        string dirArg;
+        if (!(iss >> dirArg))
+            return invalidCommand(out);
+        ok = command_cd(out, base, currentRelative, dirArg, session);
+    } else if (command == "pwd") {
+        ok = command_pwd(out, base, currentRelative);
+    } else if (command == "ls") {
+        // ls [--sort] [--offset <n>] [--limit <n>] [directory]
+        LsOptions options;
+        string arg, dirArg;
+        bool valid = true;
+        while (valid && iss >> arg) {
+            if (arg == "--sort") {
+                options.sort = true;
+            } else if (arg == "--offset" || arg == "--limit") {
+                string count;
+                valid = (iss >> count) && parseByteCount(count, arg == "--offset" ? options.offset : options.limit);
+            } else if (dirArg.empty() && arg.compare(0, 2, "--") != 0) {
+                dirArg = arg;
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid)
+            return invalidCommand(out);
+        ok = command_ls(out, base, currentRelative, dirArg, session, options);
+    } else if (command == "find") {
+        // find [directory] [-name <pattern>]
+        string arg, dirArg, pattern;
+        bool valid = true;
+        while (valid && iss >> arg) {
+            if (arg == "-name")
+                valid = static_cast<bool>(iss >> pattern);
+            else if (dirArg.empty())
+                dirArg = arg;
+            else
+                valid = false;
+        }
+        if (!valid)
+            return invalidCommand(out);
+        ok = command_find(out, base, currentRelative, dirArg, pattern, session);
+    } else if (command == "tree" || command == "du") {
+        string dirArg, extra;
+        iss >> dirArg;
+        if (iss >> extra)
+            return invalidCommand(out);
+        if (command == "tree")
+            ok = command_tree(out, base, currentRelative, dirArg, session);
+        else
+            ok = command_du(out, base, currentRelative, dirArg, session);
+    } else if (command == "cat") {
+        string filename;
+        if (!(iss >> filename))
+            return invalidCommand(out);
+        // Optional byte range: cat <filename> <offset> <length>
+        string offsetArg, lengthArg;
+        uint64_t offset = 0, length = UINT64_MAX;
+        if (iss >> offsetArg) {
+            if (!(iss >> lengthArg) || !parseByteCount(offsetArg, offset) || !parseByteCount(lengthArg, length))
+                return invalidCommand(out);
+        }
+        ok = command_cat(out, base, currentRelative, filename, session, offset, length);
+    } else if (command == "mkfile") {
+        string filename;
+        if (!(iss >> filename))
+            return invalidCommand(out);
+        string contents;
+        getline(iss, contents);
+        contents = trim(contents);
+        ok = command_mkfile(out, base, currentRelative, filename, contents, session);
+    } else if (command == "put" || command == "get") {
+        string from, to;
+        if (!(iss >> from >> to))
+            return invalidCommand(out);
+        if (command == "put")
+            ok = command_put(out, base, currentRelative, from, to, session);
+        else
+            ok = command_get(out, base, currentRelative, from, to, session);
+    } else if (command == "import") {
+        string localDir, dest;
+        if (!(iss >> localDir >> dest))
+            return invalidCommand(out);
+        ok = command_import(out, base, currentRelative, localDir, dest, session);
+    } else if (command == "mkdir") {
+        string dirname;
+        if (!(iss >> dirname) || !is_valid_input(dirname))
+            return invalidCommand(out);
+        ok = command_mkdir(out, base, currentRelative, dirname, session);
+    } else if (command == "share") {
+        string filename, targetUser;
+        if (!(iss >> filename >> targetUser))
+            return invalidCommand(out);
+        ok = command_share(out, base, currentRelative, filename, targetUser, session);
+    } else if (command == "changepass") {
+        // Prompts for passphrases on the terminal, so it is only available interactively.
+        if (!interactive)
+            return invalidCommand(out);
+        out << "\nEnter current passphrase: " << flush;
+        string oldPass = getHiddenPassword();
+        oldPass = trim(oldPass);
+        out << "\nEnter new passphrase: " << flush;
+        string newPass = getHiddenPassword();
+        newPass = trim(newPass);
+        out << "\nConfirm new passphrase: " << flush;
+        string confirmPass = getHiddenPassword();
+        confirmPass = trim(confirmPass);
+        if (newPass != confirmPass || newPass.empty()) {
+            out << "\nPassphrases do not match or are empty.\n";
+            return CommandStatus::Failed;
+        }
+        command_changepass(out, currentUser, oldPass, newPass);
+        return CommandStatus::Exit;
+    } else if (command == "adduser") {
+        string newUser;
+        if (!isAdmin || !(iss >> newUser))
+            return invalidCommand(out);
+        ok = command_adduser(out, newUser, globalSharingKey);
+    } else if (command == "namemode") {
+        if (!isAdmin)
+            return invalidCommand(out);
+        ok = command_namemode(out, iss, session);
+    } else {
+        return invalidCommand(out);
+    }
+    return ok ? CommandStatus::Ok : CommandStatus::Failed;
+}
 
-void shellLoop(const string &base, bool isAdmin, 
-               const string &currentUser, const string &userPass, 
-               const string &globalSharingKey, const string &userDerivedKey) {
-    // currentRelative represents the virtual location relative to the user’s root.
-    // For virtual root, we use an empty string ("").
+// Runs a command as one metadata transaction: what it changes, including the envelopes
+// it buffered, reaches the disk together at the end of the command or not at all.
+static CommandStatus runCommand(ostream &out, const string &line, const string &base, string &currentRelative,
+                                const UserSession &session, bool interactive) {
+    MetadataTransaction transaction;
+    CommandStatus status = executeCommand(out, line, base, currentRelative, session, interactive);
+    // Sync point: write back metadata buffered by the command. A failed write-back
+    // leaves the transaction uncommitted, which discards the command's changes.
+    bool saved = flushEnvelopeStores() && transaction.commit();
+    if (!saved && status == CommandStatus::Ok)
+        status = CommandStatus::Failed;
+    return status;
+}
 
+void shellLoop(const string &base, const UserSession &session) {
     string currentRelative = "";
     string line;
     while (true) {
-        cout << currentRelative << "> ";
+        cout << currentRelative << "> " << flush;
         if (!getline(cin, line))
             break;
         line = trim(line);
         if (line.empty())
             continue;
-        istringstream iss(line);
-        string command;
-        iss >> command;
-        if (command == "exit") {
+        if (runCommand(cout, line, base, currentRelative, session, true) == CommandStatus::Exit)
             break;
-        } else if (command == "cd") {
-            string dirArg;
-            if (!(iss >> dirArg)) {
-                cout << "Invalid Command" << endl;
-                continue;
-            }
-            command_cd(base, currentRelative, dirArg);
-        } else if (command == "pwd") {
-            command_pwd(base, currentRelative);
-        } else if (command == "ls") {
-            string dirArg;
-            if (!(iss >> dirArg)) {
-                command_ls(base, currentRelative, "");
-            } else 
-                command_ls(base, currentRelative, dirArg);
-        } else if (command == "cat") {
-            string filename;
-            if (!(iss >> filename)) {
-                cout << "Invalid Command" << endl;
-                continue;
-            }
-            command_cat(base, currentRelative, filename, currentUser, userPass, userDerivedKey, globalSharingKey);
-        } else if (command == "mkfile") {
-            string filename;
-            if (!(iss >> filename)) {
-                cout << "Invalid Command" << endl;
-                continue;
-            }
-            string contents;
-            getline(iss, contents);
-            contents = trim(contents);
-            command_mkfile(base, currentRelative, filename, contents, 
-                           isAdmin, currentUser, userPass, 
-                           userDerivedKey, globalSharingKey);
-        } else if (command == "mkdir") {
-            string dirname;
-            if (!(iss >> dirname) || !is_valid_input(dirname)) {
-                cout << "Invalid Command" << endl;
-                continue;
-            }
-            command_mkdir(base, currentRelative, dirname, isAdmin);
-        } else if (command == "share") {
-            string filename, targetUser;
-            if (!(iss >> filename >> targetUser)) {
-                cout << "Invalid Command" << endl;
-                continue;
-            }
-            command_share(base, currentRelative, filename, targetUser, isAdmin, currentUser, userPass, userDerivedKey, globalSharingKey);
-        } else if (command == "changepass") {
-            cout << "\nEnter current passphrase: ";
-            string oldPass = getHiddenPassword();
-            oldPass = trim(oldPass);
-            cout << "\nEnter new passphrase: ";
-            string newPass = getHiddenPassword();
-            newPass = trim(newPass);
-            cout << "\nConfirm new passphrase: ";
-            string confirmPass = getHiddenPassword();
-            confirmPass = trim(confirmPass);
-            if (newPass != confirmPass || newPass.empty()) {
-                cout << "\nPassphrases do not match or are empty." << endl;
-                continue;
-            }
-            command_changepass(currentUser, oldPass, newPass); 
+    }
+    flushEnvelopeStores();
+}
+
+CommandStatus runCommandLine(ostream &out, const string &line, const string &base, string &currentRelative,
+                             const UserSession &session) {
+    return runCommand(out, line, base, currentRelative, session, false);
+}
+
+bool commandIsReadOnly(const string &line) {
+    istringstream iss(line);
+    string command;
+    iss >> command;
+    static const set<string> readOnly = {"pwd", "ls", "find", "tree", "du", "cat"};
+    return readOnly.count(command) > 0;
+}
+
+static const char *commandStatusName(CommandStatus status) {
+    switch (status) {
+    case CommandStatus::Ok:
+        return "ok";
+    case CommandStatus::Failed:
+        return "error";
+    default:
+        return "invalid";
+    }
+}
+
+CommandStatus runScriptCommand(ostream &out, const string &line, const string &base, string &currentRelative,
+                               const UserSession &session, size_t seq) {
+    auto start = chrono::steady_clock::now();
+    CommandStatus status = runCommandLine(out, line, base, currentRelative, session);
+    if (status == CommandStatus::Exit)
+        return status;
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    string name = line.substr(0, line.find_first_of(" \t"));
+    out << "%result seq=" << seq << " status=" << commandStatusName(status)
+        << " us=" << elapsed.count() << " cmd=" << name << '\n';
+    return status;
+}
+
+bool runBatch(const string &base, const UserSession &session, istream &script) {
+    string currentRelative = "";
+    string line;
+    size_t seq = 0, okCount = 0, failedCount = 0, invalidCount = 0;
+    auto batchStart = chrono::steady_clock::now();
+    while (getline(script, line)) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+        CommandStatus status = runScriptCommand(cout, line, base, currentRelative, session, seq + 1);
+        if (status == CommandStatus::Exit)
             break;
-        } else if (command == "adduser") {
-            if (!isAdmin) {
-                cout << "Invalid Command" << endl;
-                continue;
-            }
-            string newUser;
-            if (!(iss >> newUser)) {
-                cout << "Invalid Command" << endl;
-                continue;
-            }
-            command_adduser(newUser, globalSharingKey);
-        } else {
-            cout << "Invalid Command" << endl;
-        }
+        seq++;
+        if (status == CommandStatus::Ok)
+            okCount++;
+        else if (status == CommandStatus::Failed)
+            failedCount++;
+        else
+            invalidCount++;
     }
+    flushEnvelopeStores();
+
+    auto total = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - batchStart).count();
+    double perSecond = total > 0 ? seq * 1e6 / total : 0;
+    cout << "%summary commands=" << seq << " ok=" << okCount << " error=" << failedCount
+         << " invalid=" << invalidCount << " us=" << total
+         << " commands_per_s=" << static_cast<uint64_t>(perSecond) << endl;
+    return failedCount == 0 && invalidCount == 0;
 }
@@ -0,0 +1,110 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+// Pool and deque index of the calling thread, when it is a pool worker.
+static thread_local ThreadPool *tCurrentPool = nullptr;
+static thread_local size_t tWorkerIndex = 0;
+
+size_t workerCountFor(size_t jobs) {
+    size_t hw = thread::hardware_concurrency();
+    if (hw == 0)
+        hw = 2;
+    return max<size_t>(1, min(jobs, hw));
+}
+
+ThreadPool::ThreadPool(size_t threads) : queued_(0), pending_(0), nextQueue_(0), stopping_(false) {
+    if (threads == 0)
+        threads = workerCountFor(SIZE_MAX);
+    for (size_t i = 0; i < threads; i++)
+        queues_.emplace_back(new WorkQueue());
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        workers_.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        lock_guard<mutex> guard(lock_);
+        stopping_ = true;
+    }
+    taskReady_.notify_all();
+    for (auto &worker : workers_)
+        worker.join();
+}
+
+void ThreadPool::submit(function<void()> task) {
+    // Count the task before it becomes visible, so a worker that takes it at once
+    // can never drive the counters below zero.
+    size_t slot;
+    {
+        lock_guard<mutex> guard(lock_);
+        slot = tCurrentPool == this ? tWorkerIndex : nextQueue_++ % queues_.size();
+        queued_++;
+        pending_++;
+    }
+    {
+        lock_guard<mutex> guard(queues_[slot]->lock);
+        queues_[slot]->tasks.push_back(std::move(task));
+    }
+    taskReady_.notify_one();
+}
+
+void ThreadPool::wait() {
+    unique_lock<mutex> guard(lock_);
+    allDone_.wait(guard, [this] { return pending_ == 0; });
+}
+
+bool ThreadPool::waitFor(chrono::milliseconds timeout) {
+    unique_lock<mutex> guard(lock_);
+    return allDone_.wait_for(guard, timeout, [this] { return pending_ == 0; });
+}
+
+// Own deque from the back (newest first), then steal from the front of the others.
+bool ThreadPool::takeTask(size_t self, function<void()> &task) {
+    for (size_t i = 0; i < queues_.size(); i++) {
+        WorkQueue &queue = *queues_[(self + i) % queues_.size()];
+        {
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        lock_guard<mutex> guard(lock_);
+        queued_--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(size_t self) {
+    tCurrentPool = this;
+    tWorkerIndex = self;
+    for (;;) {
+        function<void()> task;
+        if (!takeTask(self, task)) {
+            unique_lock<mutex> guard(lock_);
+            taskReady_.wait(guard, [this] { return stopping_ || queued_ > 0; });
+            if (stopping_ && queued_ == 0)
+                return;
+            continue;
+        }
+        // Tasks report their own errors; an escaping exception would terminate the process.
+        task();
+        {
+            lock_guard<mutex> guard(lock_);
+            if (--pending_ == 0)
+                allDone_.notify_all();
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#include "tree_walk.h"
+#include "fs_utils.h"
+#include "thread_pool.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+
+// Descriptor of a directory that has been read, kept open while subdirectories are
+// still to be opened relative to it; the last of them to start closes it.
+struct WalkDirHandle {
+    int fd;
+    string diskPath;
+    WalkDirHandle(int fd, const string &diskPath) : fd(fd), diskPath(diskPath) {}
+    ~WalkDirHandle() {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+struct WalkState {
+    const WalkOptions &options;
+    const WalkVisitor &visit;
+    ThreadPool pool;
+    atomic<bool> ok;
+
+    WalkState(const WalkOptions &options, const WalkVisitor &visit)
+        : options(options), visit(visit), pool(options.threads), ok(true) {}
+};
+
+static void statEntry(int dirFd, const char *name, WalkEntry &entry) {
+    struct stat st;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return;
+    entry.bytes = uint64_t(st.st_blocks) * 512;
+    entry.device = st.st_dev;
+    entry.inode = st.st_ino;
+    entry.linked = st.st_nlink > 1;
+}
+
+static void walkDirectory(WalkState &state, DirReader &reader, const string &diskPath,
+                          const string &path, int depth) {
+    vector<WalkEntry> entries;
+    vector<pair<string, string>> subdirs;   // on-disk name, display path
+    DirEntry entry;
+    while (reader.next(entry)) {
+        if (entry.name == "." || entry.name == ".." || entry.type == DirEntryType::Missing)
+            continue;
+        string diskName(entry.name);
+        WalkEntry item{state.options.displayName ? state.options.displayName(diskPath, diskName) : diskName,
+                       entry.type == DirEntryType::Directory, 0, 0, 0, false};
+        if (item.isDir)
+            subdirs.emplace_back(diskName, path.empty() ? item.name : path + "/" + item.name);
+        else if (state.options.sizes)
+            statEntry(reader.fd(), diskName.c_str(), item);
+        entries.push_back(move(item));
+    }
+    if (reader.failed()) {
+        cerr << "Cannot read directory " << diskPath << endl;
+        state.ok = false;
+    }
+    state.visit(path, depth, entries);
+    if (subdirs.empty())
+        return;
+
+    shared_ptr<WalkDirHandle> parent = make_shared<WalkDirHandle>(reader.release(), diskPath);
+    for (auto &subdir : subdirs) {
+        string diskName = move(subdir.first);
+        string childPath = move(subdir.second);
+        state.pool.submit([&state, parent, diskName, childPath, depth]() mutable {
+            DirReader child;
+            string childDisk = parent->diskPath + "/" + diskName;
+            if (!child.openAt(parent->fd, diskName.c_str())) {
+                cerr << "Cannot open directory " << childDisk << endl;
+                state.ok = false;
+                return;
+            }
+            parent.reset();
+            walkDirectory(state, child, childDisk, childPath, depth + 1);
+        });
+    }
+}
+
+bool walkTree(const string &root, const WalkOptions &options, const WalkVisitor &visit) {
+    DirReader reader;
+    if (!reader.open(root))
+        return false;
+    WalkState state(options, visit);
+    walkDirectory(state, reader, root, "", 0);
+    state.pool.wait();
+    return state.ok;
+}
@@ -2,16 +2,24 @@
 #include "user_metadata.h"
 #include "fs_utils.h"
 #include "crypto_utils.h"
+#include "envelope_store.h"
+#include "metadata_log.h"
 
 #include <openssl/rand.h>
 
 #include <sstream>
-#include <fstream>
 #include <iostream>
 #include <vector>
 #include <stdexcept>
 #include <iomanip>
 #include <string>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
 
 using namespace std;
 
@@ -19,16 +27,30 @@ using namespace std;
 // For simplicity, we use the AES_IVLEN defined in crypto_utils.h.
 extern const int AES_IVLEN; // assume this is defined (e.g., 16)
 
-static string serializeEntries(const vector<EnvelopeEntry> &entries) {
-    ostringstream oss;
+static const char kEnvelopeTableMagic[4] = {'B', 'E', 'N', 'V'};
+static const unsigned char kEnvelopeTableVersion = 1;
+
+string serializeEnvelopeEntries(const vector<EnvelopeEntry> &entries) {
+    size_t total = sizeof(kEnvelopeTableMagic) + 1 + 10;
+    for (const auto &entry : entries)
+        total += entry.filePath.size() + entry.envelope.size() + 4;
+
+    string out;
+    out.reserve(total);
+    out.append(kEnvelopeTableMagic, sizeof(kEnvelopeTableMagic));
+    out.push_back(static_cast<char>(kEnvelopeTableVersion));
+    putVarint(out, entries.size());
     for (const auto &entry : entries) {
-        oss << entry.filePath << " " << toHex(entry.envelope) << "\n";
+        putVarint(out, entry.filePath.size());
+        out.append(entry.filePath);
+        putVarint(out, entry.envelope.size());
+        out.append(entry.envelope);
     }
-    
-    return oss.str();
+    return out;
 }
 
-static bool deserializeEntries(const string &data, vector<EnvelopeEntry> &entries) {
+// Legacy format: one "<path> <hex envelope>" line per entry.
+static bool deserializeTextEntries(const string &data, vector<EnvelopeEntry> &entries) {
     istringstream iss(data);
     string line;
     while (getline(iss, line)) {
@@ -38,18 +60,316 @@ static bool deserializeEntries(const string &data, vector<EnvelopeEntry> &entrie
         if (!(linestream >> entry.filePath >> entry.envelope)) 
             return false;
 
-        entry.envelope = fromHex(entry.envelope);
+        string envelope = fromHex(entry.envelope);
+        if (envelope.empty())
+            return false;
+        entry.envelope = move(envelope);
         entries.push_back(entry);
     }
     return true;
 }
 
+bool deserializeEnvelopeEntries(const string &data, vector<EnvelopeEntry> &entries) {
+    if (data.size() < sizeof(kEnvelopeTableMagic) ||
+        data.compare(0, sizeof(kEnvelopeTableMagic), kEnvelopeTableMagic, sizeof(kEnvelopeTableMagic)) != 0)
+        return deserializeTextEntries(data, entries);
+
+    const unsigned char *pos = reinterpret_cast<const unsigned char*>(data.data()) + sizeof(kEnvelopeTableMagic);
+    const unsigned char *end = reinterpret_cast<const unsigned char*>(data.data()) + data.size();
+    if (pos >= end || *pos++ != kEnvelopeTableVersion) {
+        cerr << "Unsupported envelope table version." << endl;
+        return false;
+    }
+    uint64_t count;
+    if (!getVarint(pos, end, count) || count > data.size())
+        return false;
+    entries.reserve(entries.size() + count);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t pathLen, envelopeLen;
+        if (!getVarint(pos, end, pathLen) || pathLen > uint64_t(end - pos))
+            return false;
+        const char *path = reinterpret_cast<const char*>(pos);
+        pos += pathLen;
+        if (!getVarint(pos, end, envelopeLen) || envelopeLen > uint64_t(end - pos))
+            return false;
+        entries.push_back(EnvelopeEntry{string(path, pathLen),
+                                        string(reinterpret_cast<const char*>(pos), envelopeLen)});
+        pos += envelopeLen;
+    }
+    return pos == end;
+}
+
+string formatEnvelopeEntries(const vector<EnvelopeEntry> &entries) {
+    string out;
+    for (const auto &entry : entries) {
+        out += entry.filePath;
+        out += ' ';
+        out += toHex(entry.envelope);
+        out += '\n';
+    }
+    return out;
+}
+
+// Journal layout: "BJNL" magic, 1 byte version and a 16 byte random journal id,
+// followed by records of [4 byte length (BE)][12 byte nonce][ciphertext][16 byte tag].
+// A record's plaintext is [1 byte op][varint path length][path][varint envelope length][envelope]
+// and its AAD is the journal header plus the record's 8 byte sequence number, so records
+// cannot be reordered, dropped from the middle or moved to another journal.
+static const char kJournalMagic[4] = {'B', 'J', 'N', 'L'};
+static const unsigned char kJournalVersion = 1;
+static const size_t kJournalIdLen = 16;
+static const size_t kJournalHeaderLen = sizeof(kJournalMagic) + 1 + kJournalIdLen;
+static const unsigned char kJournalOpUpsert = 1;
+static const unsigned char kJournalOpRemove = 2;
+
+// Compact once the journal is larger than the snapshot (and past a small floor).
+static const uint64_t kJournalCompactMinBytes = 32 * 1024;
+static const double kJournalCompactRatio = 1.0;
+
+// What this process knows about each user's journal; set by replay, advanced by appends.
+struct JournalState {
+    string header;     // empty while no journal file exists
+    uint64_t nextSeq;
+    uint64_t bytes;
+};
+static mutex gJournalLock;
+static map<string, JournalState> gJournals;
+
+string userMetadataPath(const string &username) {
+    return "filesystem/metadata/" + username + "/envelopes.enc";
+}
+
+static string userJournalPath(const string &username) {
+    return "filesystem/metadata/" + username + "/envelopes.log";
+}
+
+// AAD of record 'seq': the journal header followed by the big-endian sequence number.
+static const size_t kJournalAadLen = kJournalHeaderLen + 8;
+
+static void journalAad(const string &header, uint64_t seq, unsigned char *aad) {
+    memcpy(aad, header.data(), kJournalHeaderLen);
+    for (int i = 0; i < 8; i++)
+        aad[kJournalHeaderLen + i] = static_cast<unsigned char>(seq >> (56 - 8 * i));
+}
+
+// Replays envelopes.log on top of the snapshot entries. A partially written final
+// record (a crash mid-append) is cut off; a record that fails authentication is an error.
+static bool replayUserJournal(const string &username, const string &derivedKey,
+                              vector<EnvelopeEntry> &entries) {
+    string journalPath = userJournalPath(username);
+    // Read, not mapped: the journal is appended to and cut in place.
+    string contents;
+    string_view data;
+    JournalState state{"", 0, 0};
+    if (readFile(journalPath, contents))
+        data = contents;
+    if (data.size() < kJournalHeaderLen) {
+        // No journal, or one whose header was never completely written.
+        if (!data.empty())
+            logRemoveFile(journalPath);
+        lock_guard<mutex> guard(gJournalLock);
+        gJournals[username] = state;
+        return true;
+    }
+    if (data.compare(0, sizeof(kJournalMagic), kJournalMagic, sizeof(kJournalMagic)) != 0 ||
+        static_cast<unsigned char>(data[sizeof(kJournalMagic)]) != kJournalVersion) {
+        cerr << "Unsupported user metadata journal for " << username << endl;
+        return false;
+    }
+    state.header = string(data.substr(0, kJournalHeaderLen));
+
+    unordered_map<string, size_t> index;
+    vector<bool> removed(entries.size(), false);
+    for (size_t i = 0; i < entries.size(); i++)
+        index[entries[i].filePath] = i;
+
+    const unsigned char *key = reinterpret_cast<const unsigned char*>(derivedKey.data());
+    const unsigned char *base = reinterpret_cast<const unsigned char*>(data.data());
+    size_t pos = kJournalHeaderLen;
+    vector<unsigned char> plain;
+    while (data.size() - pos >= 4) {
+        uint32_t len = (uint32_t(base[pos]) << 24) | (uint32_t(base[pos + 1]) << 16) |
+                       (uint32_t(base[pos + 2]) << 8) | uint32_t(base[pos + 3]);
+        // Only the last append can be torn, and then its record runs past the end of
+        // the file. A length that fits but can't be a record is damage, not a tail.
+        if (data.size() - pos - 4 < len)
+            break;
+        if (len < GCM_NONCELEN + GCM_TAGLEN + 1) {
+            cerr << "Corrupt record in user metadata journal for " << username << endl;
+            return false;
+        }
+        const unsigned char *nonce = base + pos + 4;
+        size_t cipherLen = len - GCM_NONCELEN - GCM_TAGLEN;
+        unsigned char aad[kJournalAadLen];
+        journalAad(state.header, state.nextSeq, aad);
+        plain.resize(cipherLen);
+        try {
+            aes_gcm_open(key, nonce, aad, kJournalAadLen,
+                         nonce + GCM_NONCELEN, cipherLen, nonce + GCM_NONCELEN + cipherLen, plain.data());
+        } catch (const exception &ex) {
+            cerr << "Failed to decrypt user metadata journal: " << ex.what() << endl;
+            return false;
+        }
+
+        const unsigned char *p = plain.data() + 1;
+        const unsigned char *end = plain.data() + plain.size();
+        uint64_t pathLen, envelopeLen;
+        if (!getVarint(p, end, pathLen) || pathLen > uint64_t(end - p))
+            return false;
+        string filePath(reinterpret_cast<const char*>(p), pathLen);
+        p += pathLen;
+        if (!getVarint(p, end, envelopeLen) || envelopeLen != uint64_t(end - p))
+            return false;
+
+        auto it = index.find(filePath);
+        if (plain[0] == kJournalOpUpsert) {
+            string envelope(reinterpret_cast<const char*>(p), envelopeLen);
+            if (it != index.end()) {
+                entries[it->second].envelope = envelope;
+                removed[it->second] = false;
+            } else {
+                index[filePath] = entries.size();
+                entries.push_back(EnvelopeEntry{filePath, envelope});
+                removed.push_back(false);
+            }
+        } else if (plain[0] == kJournalOpRemove) {
+            if (it != index.end())
+                removed[it->second] = true;
+        } else {
+            cerr << "Unknown record in user metadata journal." << endl;
+            return false;
+        }
+        state.nextSeq++;
+        pos += 4 + len;
+    }
+    if (pos != data.size()) {
+        cerr << "Discarding incomplete tail of metadata journal for " << username << endl;
+        if (!logWriteAt(journalPath, pos, ""))
+            return false;
+    }
+    state.bytes = pos;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (!removed[i]) {
+            if (kept != i)
+                entries[kept] = std::move(entries[i]);
+            kept++;
+        }
+    }
+    entries.resize(kept);
+
+    lock_guard<mutex> guard(gJournalLock);
+    gJournals[username] = state;
+    return true;
+}
+
+bool appendUserMetadataJournal(const string &username,
+                               const string &derivedKey,
+                               const vector<EnvelopeUpdate> &updates) {
+    // Callers hold the metadata file exclusively, so the journal can't move under us
+    // while the lock is released for the (synced) write below.
+    JournalState state;
+    {
+        lock_guard<mutex> guard(gJournalLock);
+        auto found = gJournals.find(username);
+        if (found == gJournals.end())
+            return false; // journal position unknown until the metadata has been loaded
+        state = found->second;
+    }
+
+    string out;
+    bool fresh = state.header.empty();
+    if (fresh) {
+        unsigned char id[kJournalIdLen];
+        if (RAND_bytes(id, kJournalIdLen) != 1) {
+            cerr << "Failed to generate metadata journal id" << endl;
+            return false;
+        }
+        state.header.assign(kJournalMagic, sizeof(kJournalMagic));
+        state.header.push_back(static_cast<char>(kJournalVersion));
+        state.header.append(reinterpret_cast<char*>(id), kJournalIdLen);
+        state.nextSeq = 0;
+        state.bytes = 0;
+        out = state.header;
+    }
+
+    const unsigned char *key = reinterpret_cast<const unsigned char*>(derivedKey.data());
+    uint64_t seq = state.nextSeq;
+    string body;
+    vector<unsigned char> record;
+    for (const auto &update : updates) {
+        body.clear();
+        body.push_back(static_cast<char>(update.removed ? kJournalOpRemove : kJournalOpUpsert));
+        putVarint(body, update.filePath.size());
+        body.append(update.filePath);
+        putVarint(body, update.removed ? 0 : update.envelope.size());
+        if (!update.removed)
+            body.append(update.envelope);
+
+        uint32_t len = GCM_NONCELEN + body.size() + GCM_TAGLEN;
+        record.resize(4 + len);
+        record[0] = static_cast<unsigned char>(len >> 24);
+        record[1] = static_cast<unsigned char>(len >> 16);
+        record[2] = static_cast<unsigned char>(len >> 8);
+        record[3] = static_cast<unsigned char>(len);
+        unsigned char *nonce = record.data() + 4;
+        if (RAND_bytes(nonce, GCM_NONCELEN) != 1) {
+            cerr << "Failed to generate nonce for metadata journal" << endl;
+            return false;
+        }
+        unsigned char aad[kJournalAadLen];
+        journalAad(state.header, seq, aad);
+        try {
+            aes_gcm_seal(key, nonce, aad, kJournalAadLen,
+                         reinterpret_cast<const unsigned char*>(body.data()), body.size(),
+                         nonce + GCM_NONCELEN, nonce + GCM_NONCELEN + body.size());
+        } catch (const exception &ex) {
+            cerr << "Encryption of metadata journal record failed: " << ex.what() << endl;
+            return false;
+        }
+        out.append(reinterpret_cast<char*>(record.data()), record.size());
+        seq++;
+    }
+
+    // One logged write per flush, at the end of the journal or over it when starting
+    // afresh. A journal that vanished since the load makes the caller save in full.
+    FileStamp current;
+    string journalPath = userJournalPath(username);
+    uint64_t offset = !fresh && getFileStamp(journalPath, current) ? current.size : 0;
+    if (!fresh && offset == 0)
+        return false;
+    if (!logWriteAt(journalPath, offset, out))
+        return false;
+    state.nextSeq = seq;
+    state.bytes += out.size();
+    lock_guard<mutex> guard(gJournalLock);
+    gJournals[username] = state;
+    return true;
+}
+
+bool userMetadataNeedsCompaction(const string &username) {
+    uint64_t journalBytes;
+    {
+        lock_guard<mutex> guard(gJournalLock);
+        auto found = gJournals.find(username);
+        if (found == gJournals.end())
+            return false;
+        journalBytes = found->second.bytes;
+    }
+    if (journalBytes < kJournalCompactMinBytes)
+        return false;
+    FileStamp snapshot;
+    uint64_t snapshotBytes = getFileStamp(userMetadataPath(username), snapshot) ? snapshot.size : 0;
+    return journalBytes > snapshotBytes * kJournalCompactRatio;
+}
+
 bool loadUserMetadata(const string &username,
                       const string &derivedKey,
                       vector<EnvelopeEntry> &entries) {
-    string metaPath = "filesystem/metadata/" + username + "/envelopes.enc";
-    string fileData;
-    if (!readFile(metaPath, fileData) || fileData.size() < AES_IVLEN) {
+    string metaPath = userMetadataPath(username);
+    MappedFile mapped;
+    if (!mapped.open(metaPath) || mapped.size() < AES_IVLEN) {
         // Metadata file is missing or too small, so initialize it with a default entry.
         vector<EnvelopeEntry> defaultEntries;
         EnvelopeEntry defaultEntry;
@@ -59,91 +379,71 @@ bool loadUserMetadata(const string &username,
             cerr << "Error initializing user metadata for " << username << endl;
             return false;
         }
-        if (!readFile(metaPath, fileData)) {
-            cerr << "Failed to read metadata after initialization for " << username << endl;
-            return false;
-        }
+        // Not read back: inside a metadata transaction the file isn't written yet.
+        entries = defaultEntries;
+        return true;
     }
-    if (fileData.size() < AES_IVLEN) {
+    if (mapped.size() < AES_IVLEN) {
         cerr << "User metadata file corrupt (too small)." << endl;
         return false;
     }
-    string iv = fileData.substr(0, AES_IVLEN);
-    string ciphertext = fileData.substr(AES_IVLEN);
     string plaintext;
     try {
-        plaintext = aes_decrypt(ciphertext,
-                                reinterpret_cast<const unsigned char*>(derivedKey.data()),
-                                reinterpret_cast<const unsigned char*>(iv.data()));
+        aes_decrypt_blob(mapped.view(), reinterpret_cast<const unsigned char*>(derivedKey.data()), plaintext);
     } catch (const exception &ex) {
         cerr << "Failed to decrypt user metadata: " << ex.what() << endl;
         return false;
     }
-    return deserializeEntries(plaintext, entries);
+    if (!deserializeEnvelopeEntries(plaintext, entries))
+        return false;
+    return replayUserJournal(username, derivedKey, entries);
 }
 
 // Helper: Find the envelope entry for a file from a user's personal metadata.
-// Returns true and sets 'envelope' if found.
+// Returns true and sets 'envelope' if found. Served from the session's indexed store.
 bool findUserEnvelope(const string &username, const string &filePath, 
                       const string &derivedKey, string &envelope) {
-    vector<EnvelopeEntry> entries;
-    if (!loadUserMetadata(username, derivedKey, entries)) {
-        cerr << "Failed to load user metadata for " << username << endl;
-        return false;
-    }
-
-    for (const auto &entry : entries) {
-        if (entry.filePath == filePath) {
-            envelope = entry.envelope;
-            return true;
-        }
-    }
-    return false;
+    return userEnvelopeStore(username).find(derivedKey, filePath, envelope);
 }
 
 bool saveUserMetadata(const string &username,
                       const string &derivedKey,
                       const vector<EnvelopeEntry> &entries) {
-    string metaPath = "filesystem/metadata/" + username + "/envelopes.enc";
-    string plaintext = serializeEntries(entries);
+    string metaPath = userMetadataPath(username);
+    string plaintext = serializeEnvelopeEntries(entries);
     unsigned char iv[AES_IVLEN];
     if (RAND_bytes(iv, AES_IVLEN) != 1) {
         cerr << "Failed to generate IV for user metadata" << endl;
         return false;
     }
-    string ivStr(reinterpret_cast<char*>(iv), AES_IVLEN);
-    string ciphertext;
+    string blob;
     try {
-        ciphertext = aes_encrypt(plaintext,
-                                 reinterpret_cast<const unsigned char*>(derivedKey.data()),
-                                 iv);
+        blob = aes_encrypt_blob(plaintext, reinterpret_cast<const unsigned char*>(derivedKey.data()), iv);
     } catch (const exception &ex) {
         cerr << "Encryption of user metadata failed: " << ex.what() << endl;
         return false;
     }
-    return writeFile(metaPath, ivStr + ciphertext);
+    // The snapshot now holds every journaled update, so the journal goes with it.
+    MetadataTransaction transaction;
+    transaction.add(MetadataChange{MetadataChangeKind::Write, metaPath, blob, 0});
+    transaction.add(MetadataChange{MetadataChangeKind::Remove, userJournalPath(username), "", 0});
+    if (!transaction.commit())
+        return false;
+    lock_guard<mutex> guard(gJournalLock);
+    gJournals[username] = JournalState{"", 0, 0};
+    return true;
 }
 
+// Buffered in the user's envelope store; written back at the next flushEnvelopeStores().
 bool updateUserEnvelopeEntry(const string &username,
                              const string &derivedKey,
                              const string &filePath,
                              const string &envelope) {
-    vector<EnvelopeEntry> entries;
-    loadUserMetadata(username, derivedKey, entries);
-    bool found = false;
-    for (auto &entry : entries) {
-        if (entry.filePath == filePath) {
-            entry.envelope = envelope; // assume envelope is already hex encoded
-            found = true;
-            break;
-        }
-    }
-    if (!found) {
-        EnvelopeEntry newEntry;
-        newEntry.filePath = filePath;
-        newEntry.envelope = envelope;
-        entries.push_back(newEntry);
-    }
-    
-    return saveUserMetadata(username, derivedKey, entries);
+    return userEnvelopeStore(username).upsert(derivedKey, filePath, envelope);
+}
+
+bool removeUserEnvelopeEntry(const string &username,
+                             const string &derivedKey,
+                             const string &filePath) {
+    return userEnvelopeStore(username).remove(derivedKey, filePath);
 }
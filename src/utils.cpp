@@ -1,10 +1,15 @@
 #include "utils.h"
-#include "crypto_utils.h" 
-#include <openssl/rand.h>
+#include "crypto_utils.h"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <sstream>
 #include <stdexcept>
-#include <iomanip>
 #include <vector>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -23,52 +28,281 @@ static vector<string> split(const string &s, char delim) {
 }
 
 
-string toHex(const string &input) {
-    ostringstream oss;
-    for (unsigned char c : input)
-        oss << hex << setw(2) << setfill('0') << (int)c;
-    return oss.str();
+// Hex codec. The scalar paths are table driven; on x86 the bulk of the input goes
+// through SSSE3 or AVX2 kernels chosen once at runtime from the CPU's features, so the
+// binary still runs on machines without them. Encoding emits lower-case digits;
+// decoding accepts either case and rejects anything that is not a hex digit.
+
+static const char kHexDigits[] = "0123456789abcdef";
+
+// Two output characters per byte value.
+struct HexEncodeTable {
+    char pairs[256][2];
+    HexEncodeTable() {
+        for (int i = 0; i < 256; i++) {
+            pairs[i][0] = kHexDigits[i >> 4];
+            pairs[i][1] = kHexDigits[i & 0xf];
+        }
+    }
+};
+
+// Nibble value of each character, or -1 for a non-hex character.
+struct HexDecodeTable {
+    signed char nibble[256];
+    HexDecodeTable() {
+        for (int i = 0; i < 256; i++)
+            nibble[i] = -1;
+        for (int i = 0; i < 10; i++)
+            nibble['0' + i] = i;
+        for (int i = 0; i < 6; i++)
+            nibble['a' + i] = nibble['A' + i] = 10 + i;
+    }
+};
+
+static const HexEncodeTable kHexEncode;
+static const HexDecodeTable kHexDecode;
+
+static void hexEncodeScalar(const unsigned char *in, size_t len, char *out) {
+    for (size_t i = 0; i < len; i++) {
+        memcpy(out, kHexEncode.pairs[in[i]], 2);
+        out += 2;
+    }
+}
+
+static bool hexDecodeScalar(const char *in, size_t len, unsigned char *out) {
+    int bad = 0;
+    for (size_t i = 0; i < len; i++) {
+        int hi = kHexDecode.nibble[static_cast<unsigned char>(in[2 * i])];
+        int lo = kHexDecode.nibble[static_cast<unsigned char>(in[2 * i + 1])];
+        bad |= hi | lo;
+        out[i] = static_cast<unsigned char>((hi << 4) | (lo & 0xf));
+    }
+    return bad >= 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Encoding: split every byte into nibbles and map them to digits with a 16-entry
+// shuffle table, then interleave high and low digits.
+__attribute__((target("ssse3")))
+static size_t hexEncodeSsse3(const unsigned char *in, size_t len, char *out) {
+    const __m128i digits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kHexDigits));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t hexEncodeAvx2(const unsigned char *in, size_t len, char *out) {
+    const __m256i digits = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(kHexDigits)));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, mask));
+        // Unpacking works per 128-bit lane: 'first' holds bytes 0-7 and 16-23, 'second'
+        // bytes 8-15 and 24-31; recombine the lanes to restore input order.
+        __m256i first = _mm256_unpacklo_epi8(hi, lo);
+        __m256i second = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i),
+                            _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i + 32),
+                            _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    return i;
+}
+
+// Decoding: classify each character as digit or letter (case folded), take its nibble
+// value, and fold character pairs into bytes with a multiply-add (high * 16 + low).
+// Any character outside both ranges clears its bit in the validity mask.
+__attribute__((target("ssse3")))
+static inline bool hexNibblesSsse3(__m128i c, __m128i &value) {
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i isAlpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    value = _mm_or_si128(_mm_and_si128(isDigit, digit),
+                         _mm_and_si128(isAlpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+    return _mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) == 0xffff;
+}
+
+__attribute__((target("ssse3")))
+static bool hexDecodeSsse3(const char *in, size_t len, unsigned char *out, size_t &done) {
+    const __m128i weights = _mm_set1_epi16(0x0110);   // bytes {16, 1}
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a, b;
+        bool ok = hexNibblesSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i)), a);
+        ok &= hexNibblesSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i + 16)), b);
+        if (!ok)
+            return false;
+        __m128i bytes = _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), bytes);
+    }
+    done = i;
+    return true;
+}
+
+__attribute__((target("avx2")))
+static inline bool hexNibblesAvx2(__m256i c, __m256i &value) {
+    __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    __m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+    __m256i alpha = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i isAlpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+    value = _mm256_or_si256(_mm256_and_si256(isDigit, digit),
+                            _mm256_and_si256(isAlpha, _mm256_add_epi8(alpha, _mm256_set1_epi8(10))));
+    return _mm256_movemask_epi8(_mm256_or_si256(isDigit, isAlpha)) == -1;
 }
 
-string fromHex(const string &hexString) {
+__attribute__((target("avx2")))
+static bool hexDecodeAvx2(const char *in, size_t len, unsigned char *out, size_t &done) {
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a, b;
+        bool ok = hexNibblesAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i)), a);
+        ok &= hexNibblesAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i + 32)), b);
+        if (!ok)
+            return false;
+        // packus interleaves per lane (a0 b0 a1 b1); put the 64-bit groups back in order.
+        __m256i bytes = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights), _mm256_maddubs_epi16(b, weights));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permute4x64_epi64(bytes, 0xd8));
+    }
+    done = i;
+    return true;
+}
+
+enum class HexKernel { Scalar, Ssse3, Avx2 };
+
+static HexKernel hexKernel() {
+    static const HexKernel kernel = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return HexKernel::Avx2;
+        if (__builtin_cpu_supports("ssse3"))
+            return HexKernel::Ssse3;
+        return HexKernel::Scalar;
+    }();
+    return kernel;
+}
+
+#endif
+
+void hexEncode(const unsigned char *in, size_t len, char *out) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    switch (hexKernel()) {
+    case HexKernel::Avx2:  done = hexEncodeAvx2(in, len, out); break;
+    case HexKernel::Ssse3: done = hexEncodeSsse3(in, len, out); break;
+    case HexKernel::Scalar: break;
+    }
+#endif
+    hexEncodeScalar(in + done, len - done, out + 2 * done);
+}
+
+bool hexDecode(const char *in, size_t len, unsigned char *out) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    bool ok = true;
+    switch (hexKernel()) {
+    case HexKernel::Avx2:  ok = hexDecodeAvx2(in, len, out, done); break;
+    case HexKernel::Ssse3: ok = hexDecodeSsse3(in, len, out, done); break;
+    case HexKernel::Scalar: break;
+    }
+    if (!ok)
+        return false;
+#endif
+    return hexDecodeScalar(in + 2 * done, len - done, out + done);
+}
+
+string toHex(string_view input) {
+    string output(input.size() * 2, '\0');
+    hexEncode(reinterpret_cast<const unsigned char*>(input.data()), input.size(), &output[0]);
+    return output;
+}
+
+string fromHex(string_view hexString) {
     string output;
     if (hexString.length() % 2 != 0)
         return output; // error: invalid hex string length
+    output.resize(hexString.length() / 2);
+    if (!hexDecode(hexString.data(), output.size(), reinterpret_cast<unsigned char*>(&output[0])))
+        output.clear(); // error: invalid hex digit
+    return output;
+}
 
-    for (size_t i = 0; i < hexString.length(); i += 2) {
-        unsigned int byte;
-        istringstream iss(hexString.substr(i, 2));
-        iss >> hex >> byte;
-        output.push_back(static_cast<char>(byte));
+void putVarint(string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
     }
-    return output;
+    out.push_back(static_cast<char>(value));
+}
+
+bool getVarint(const unsigned char *&pos, const unsigned char *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        unsigned char byte = *pos++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Name keys: independent MAC and encryption keys derived from the global key, so the
+// deterministic name cipher never uses the key that wraps file envelopes. Derivation
+// is cached per thread for the last global key seen.
+struct NameKeys {
+    string globalKey;
+    unsigned char mac[SHA256_DIGEST_LENGTH];
+    unsigned char enc[SHA256_DIGEST_LENGTH];
+};
+
+static const NameKeys &nameKeys(const string &globalKey) {
+    thread_local NameKeys keys;
+    if (keys.globalKey.empty() || keys.globalKey != globalKey) {
+        static const char kMacLabel[] = "name-siv-mac";
+        static const char kEncLabel[] = "name-siv-enc";
+        if (!HMAC(EVP_sha256(), globalKey.data(), globalKey.size(),
+                  reinterpret_cast<const unsigned char*>(kMacLabel), sizeof(kMacLabel) - 1, keys.mac, nullptr) ||
+            !HMAC(EVP_sha256(), globalKey.data(), globalKey.size(),
+                  reinterpret_cast<const unsigned char*>(kEncLabel), sizeof(kEncLabel) - 1, keys.enc, nullptr))
+            throw runtime_error("Failed to derive name keys");
+        keys.globalKey = globalKey;
+    }
+    return keys;
 }
 
 // Encrypt a single file/directory name using the global key.
-// The function returns a hex string containing IV + ciphertext.
+// The function returns a hex string of SIV + ciphertext. Encryption is deterministic:
+// the same name always maps to the same string, so it can be used to look names up.
 string encryptName(const string &name, const string &globalKey) {
-    // Generate a random IV for this name.
-    unsigned char iv[AES_IVLEN];
-    if (RAND_bytes(iv, AES_IVLEN) != 1) {
-        throw runtime_error("RAND_bytes failed for name encryption");
-    }
-    // Encrypt the name using AES
-    string cipherText = aes_encrypt(name, reinterpret_cast<const unsigned char*>(globalKey.data()), iv);
-    // Prepend the IV to the ciphertext and return the hex encoding.
-    string combined = string(reinterpret_cast<char*>(iv), AES_IVLEN) + cipherText;
-    return toHex(combined);
+    const NameKeys &keys = nameKeys(globalKey);
+    return toHex(aes_siv_encrypt(name, keys.mac, keys.enc));
 }
 
 // Decrypt a single file/directory name using the global key.
-// The input is expected to be a hex string (IV+ciphertext).
+// The input is expected to be a hex string (SIV + ciphertext).
 string decryptName(const string &encryptedNameHex, const string &globalKey) {
     // Convert from hex to raw bytes.
     string combined = fromHex(encryptedNameHex);
-    if (combined.size() < AES_IVLEN)
+    if (combined.size() < SIV_LEN)
         throw runtime_error("Encrypted name too short");
-    string iv = combined.substr(0, AES_IVLEN);
-    string cipherText = combined.substr(AES_IVLEN);
-    return aes_decrypt(cipherText, reinterpret_cast<const unsigned char*>(globalKey.data()), reinterpret_cast<const unsigned char*>(iv.data()));
+    const NameKeys &keys = nameKeys(globalKey);
+    string name;
+    if (!aes_siv_decrypt(combined, keys.mac, keys.enc, name))
+        throw runtime_error("Encrypted name failed authentication");
+    return name;
 }
 
 // Split a path (using '/' as separator), encrypt each component, and reassemble.